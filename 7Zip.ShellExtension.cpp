@@ -23,13 +23,30 @@
 //      * Single item  -> <ItemName>.ext
 //      * Multi items  -> <ParentName>.ext if all from same parent; else Archive.ext
 //  - CRC submenu with CRC-32/CRC-64/SHA-1/SHA-256.
+//  - "Update <Name>.7z" re-adds only files whose size/mtime differ from the
+//    archive header.
+//  - "Index archives in folder" writes a sorted entry-name index of every
+//    archive below a folder; "Search archive index..." queries it.
+//  - "Search in archives..." finds text inside archives without extracting.
+//  - "Compare with extracted folder" checks "<ArchiveName>\\" against the stored
+//    sizes/CRC-32s without decompressing.
+//  - "Find duplicates" scans the selection in-process (size -> edge hash ->
+//    full SHA-256) and opens a report.
+//  - "Compare compression methods" projects ratio and times of several
+//    methods/levels for the selection from a small stratified sample.
+//  - "CRC SHA > Benchmark" (or rundll32 ...,Benchmark) times the in-process
+//    hash kernels and codecs and stores the speeds for later jobs.
+//    "rundll32 ...,Benchmark /menu" times opening the menu on large selections.
 //  - Add/Email entries available for files/dirs/archives, like classic.
 //
-// NOTE: This DLL assumes 7zFM.exe, 7zG.exe, 7z.exe are either next to the DLL
-//       (inside your MSIX) or discoverable via PATH.
+// NOTE: 7zFM.exe, 7zG.exe and 7z.exe are looked up next to the DLL (inside
+//       your MSIX), then in the 7-Zip install folder, then via PATH.
+//       When built against the 7-Zip SDK, listing and searching load 7z.dll
+//       from that folder in-process instead of running 7z.exe.
 
 #define NOMINMAX
 #include <Windows.h>
+#include <bcrypt.h>
 #include <shobjidl_core.h>
 #include <shlwapi.h>
 #include <shellapi.h>
@@ -38,92 +55,4554 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+#include "CacheBudget.h"
+#include "Concurrency.h"
+#include "PathArena.h"
+#include "Utf8.h"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#include <immintrin.h> // SSE4.2 crc32, AVX2; availability is checked at run time
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#ifndef PF_SSE4_2_INSTRUCTIONS_AVAILABLE // older SDKs
+#define PF_SSE4_2_INSTRUCTIONS_AVAILABLE 38
+#define PF_AVX2_INSTRUCTIONS_AVAILABLE 40
+#endif
+
+// 7-Zip SDK (CPP folder on the include path): enables the in-process backend.
+#if __has_include("7zip/Archive/IArchive.h")
+#define SEVENZIP_INPROC 1
+#include "Common/MyInitGuid.h"
+#include "7zip/Archive/IArchive.h"
+#include "7zip/ICoder.h"
+#include "7zip/IPassword.h"
+#else
+#define SEVENZIP_INPROC 0
+#endif
 
 #pragma comment(lib, "Ole32.lib")
 #pragma comment(lib, "Shell32.lib")
 #pragma comment(lib, "Shlwapi.lib")
+#pragma comment(lib, "Bcrypt.lib")
+#pragma comment(lib, "Advapi32.lib")
+#pragma comment(lib, "User32.lib")
+
+// Export COM entry points on x64 without a .def (harmless if also supplied via .def)
+#if defined(_M_X64) || defined(_WIN64)
+#pragma comment(linker, "/EXPORT:DllGetClassObject")
+#pragma comment(linker, "/EXPORT:DllCanUnloadNow")
+#pragma comment(linker, "/EXPORT:Benchmark")
+#endif
+
+// {7C9F3AA6-4D07-4E1D-8B86-0F5A4E4F44AC}
+static const CLSID CLSID_SevenZipExplorer =
+{ 0x7c9f3aa6, 0x4d07, 0x4e1d, { 0x8b, 0x86, 0x0f, 0x5a, 0x4e, 0x4f, 0x44, 0xac } };
+
+static HMODULE g_hMod = nullptr;
+static LONG g_ObjCount = 0;
+static LONG g_LockCount = 0;
+static bool g_processExiting = false; // DLL_PROCESS_DETACH because the process ends, not FreeLibrary
+
+// ---------- Case-insensitive names ----------
+// File names compare the way NTFS does: code unit by code unit after simple
+// uppercase mapping (the rule CompareStringOrdinal(..., TRUE) applies). ASCII
+// runs are folded 8 code units at a time with SSE2; anything else goes
+// through a table built once from LCMapStringEx. NameHash agrees with
+// NamesEqualI, so the pair can key hash tables.
+static const wchar_t* UpcaseTable() {
+    static const std::vector<wchar_t> table = [] {
+        std::vector<wchar_t> t(0x10000);
+        for (size_t i = 0; i < t.size(); ++i) t[i] = wchar_t(i);
+        auto map = [&](size_t from, size_t to) { // surrogates are left alone
+            std::vector<wchar_t> up(to - from);
+            if (LCMapStringEx(LOCALE_NAME_INVARIANT, LCMAP_UPPERCASE, &t[from], int(to - from),
+                              up.data(), int(up.size()), nullptr, nullptr, 0) == int(up.size()))
+                std::copy(up.begin(), up.end(), t.begin() + ptrdiff_t(from));
+        };
+        map(0x80, 0xD800);
+        map(0xE000, 0x10000);
+        for (wchar_t c = L'a'; c <= L'z'; ++c) t[c] = wchar_t(c - 32);
+        return t;
+    }();
+    return table.data();
+}
+static inline wchar_t FoldChar(wchar_t c) {
+    if (c < 0x80) return (c >= L'a' && c <= L'z') ? wchar_t(c - 32) : c;
+    return UpcaseTable()[uint16_t(c)];
+}
+#if defined(_M_X64) || defined(__SSE2__)
+// Folds 8 code units if they are all ASCII; returns false otherwise.
+static inline bool FoldAscii8(const wchar_t* p, __m128i& out) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i high = _mm_and_si128(v, _mm_set1_epi16(short(0xFF80)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) != 0xFFFF) return false;
+    __m128i lower = _mm_and_si128(_mm_cmpgt_epi16(v, _mm_set1_epi16('a' - 1)),
+                                  _mm_cmplt_epi16(v, _mm_set1_epi16('z' + 1)));
+    out = _mm_sub_epi16(v, _mm_and_si128(lower, _mm_set1_epi16(0x20)));
+    return true;
+}
+#endif
+static void FoldInto(wchar_t* dst, const wchar_t* src, size_t n) {
+    size_t i = 0;
+#if defined(_M_X64) || defined(__SSE2__)
+    for (; i + 8 <= n; i += 8) {
+        __m128i f;
+        if (FoldAscii8(src + i, f)) _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), f);
+        else for (size_t k = i; k < i + 8; ++k) dst[k] = FoldChar(src[k]);
+    }
+#endif
+    for (; i < n; ++i) dst[i] = FoldChar(src[i]);
+}
+static std::wstring FoldName(std::wstring s) {
+    FoldInto(s.data(), s.data(), s.size());
+    return s;
+}
+static bool NamesEqualI(std::wstring_view a, std::wstring_view b) {
+    if (a.size() != b.size()) return false;
+    size_t i = 0, n = a.size();
+#if defined(_M_X64) || defined(__SSE2__)
+    for (; i + 8 <= n; i += 8) {
+        __m128i fa, fb;
+        if (FoldAscii8(a.data() + i, fa) && FoldAscii8(b.data() + i, fb)) {
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(fa, fb)) != 0xFFFF) return false;
+            continue;
+        }
+        for (size_t k = i; k < i + 8; ++k) if (FoldChar(a[k]) != FoldChar(b[k])) return false;
+    }
+#endif
+    for (; i < n; ++i) if (FoldChar(a[i]) != FoldChar(b[i])) return false;
+    return true;
+}
+static uint64_t NameHashI(std::wstring_view s) {
+    auto mix = [](uint64_t h, uint64_t w) {
+        h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+        return (h << 31) | (h >> 33);
+    };
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ s.size();
+    wchar_t buf[8];
+    for (size_t i = 0; i < s.size(); i += 8) {
+        size_t n = std::min<size_t>(8, s.size() - i);
+        if (n < 8) std::fill(buf + n, buf + 8, L'\0');
+        FoldInto(buf, s.data() + i, n);
+        uint64_t w[2];
+        memcpy(w, buf, sizeof(w));
+        h = mix(mix(h, w[0]), w[1]);
+    }
+    h ^= h >> 33; h *= 0xC4CEB9FE1A85EC53ull; h ^= h >> 33;
+    return h;
+}
+struct NameHash {
+    size_t operator()(std::wstring_view s) const { return size_t(NameHashI(s)); }
+};
+struct NameEq {
+    bool operator()(std::wstring_view a, std::wstring_view b) const { return NamesEqualI(a, b); }
+};
+template <class V> using NameMap = std::unordered_map<std::wstring, V, NameHash, NameEq>;
+
+// ---------- helpers ----------
+static std::wstring GetModuleDir(HMODULE mod) {
+    wchar_t buf[MAX_PATH]{};
+    GetModuleFileNameW(mod, buf, MAX_PATH);
+    PathRemoveFileSpecW(buf);
+    return buf;
+}
+// Plain string join: PathAppendW caps the result at MAX_PATH, which index rows
+// and deep extraction targets exceed.
+static std::wstring Combine(const std::wstring& a, const std::wstring& b) {
+    if (a.empty()) return b;
+    size_t skip = (!b.empty() && (b[0] == L'\\' || b[0] == L'/')) ? 1 : 0;
+    std::wstring out = a;
+    if (out.back() != L'\\' && out.back() != L'/') out += L'\\';
+    out.append(b, skip, std::wstring::npos);
+    return out;
+}
+static bool FileExists(const wchar_t* p) {
+    DWORD a = GetFileAttributesW(p);
+    return (a != INVALID_FILE_ATTRIBUTES) && !(a & FILE_ATTRIBUTE_DIRECTORY);
+}
+static bool FileExists(const std::wstring& p) { return FileExists(p.c_str()); }
+static void ShellRun(const std::wstring& exe, const std::wstring& args, const std::wstring& cwd = L"") {
+    SHELLEXECUTEINFOW sei{ sizeof(sei) };
+    sei.fMask = SEE_MASK_NOASYNC | SEE_MASK_FLAG_NO_UI;
+    sei.lpFile = exe.c_str();
+    sei.lpParameters = args.empty() ? nullptr : args.c_str();
+    sei.lpDirectory = cwd.empty() ? nullptr : cwd.c_str();
+    sei.nShow = SW_SHOWNORMAL;
+    ShellExecuteExW(&sei);
+}
+// Like ShellRun, but hands back the process handle (nullptr on failure).
+static HANDLE ShellRunProcess(const std::wstring& exe, const std::wstring& args, const std::wstring& cwd = L"") {
+    SHELLEXECUTEINFOW sei{ sizeof(sei) };
+    sei.fMask = SEE_MASK_NOASYNC | SEE_MASK_FLAG_NO_UI | SEE_MASK_NOCLOSEPROCESS;
+    sei.lpFile = exe.c_str();
+    sei.lpParameters = args.empty() ? nullptr : args.c_str();
+    sei.lpDirectory = cwd.empty() ? nullptr : cwd.c_str();
+    sei.nShow = SW_SHOWNORMAL;
+    return ShellExecuteExW(&sei) ? sei.hProcess : nullptr;
+}
+// Runs a console tool hidden with stdout on a pipe handed to `consume`;
+// stdin and stderr go to NUL. Returns false if the tool could not start.
+// Raising `cancel` terminates the tool, which also ends consume's reads.
+static bool RunPiped(const std::wstring& exe, const std::wstring& args,
+                     const std::function<void(HANDLE)>& consume, DWORD* exitCode = nullptr,
+                     const std::atomic<bool>* cancel = nullptr) {
+    SECURITY_ATTRIBUTES sa{ sizeof(sa), nullptr, TRUE };
+    HANDLE rd = nullptr, wr = nullptr;
+    if (!CreatePipe(&rd, &wr, &sa, 0)) return false;
+    SetHandleInformation(rd, HANDLE_FLAG_INHERIT, 0);
+    HANDLE nul = CreateFileW(L"NUL", GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, &sa,
+                             OPEN_EXISTING, 0, nullptr);
+
+    STARTUPINFOW si{ sizeof(si) };
+    si.dwFlags = STARTF_USESTDHANDLES | STARTF_USESHOWWINDOW;
+    si.wShowWindow = SW_HIDE;
+    si.hStdInput = nul;
+    si.hStdOutput = wr;
+    si.hStdError = nul;
+    PROCESS_INFORMATION pi{};
+    std::wstring cmd = L"\"" + exe + L"\" " + args;
+    BOOL started = CreateProcessW(nullptr, cmd.data(), nullptr, nullptr, TRUE, CREATE_NO_WINDOW,
+                                  nullptr, nullptr, &si, &pi);
+    CloseHandle(wr);
+    if (nul != INVALID_HANDLE_VALUE) CloseHandle(nul);
+    if (!started) { CloseHandle(rd); return false; }
+
+    std::thread watcher; // the tool may sit in a long read without writing anything
+    if (cancel) watcher = std::thread([&] {
+        while (WaitForSingleObject(pi.hProcess, 20) == WAIT_TIMEOUT)
+            if (cancel->load(std::memory_order_relaxed)) { TerminateProcess(pi.hProcess, ERROR_CANCELLED); break; }
+    });
+    consume(rd);
+    CloseHandle(rd); // a tool still writing now fails with a broken pipe and exits
+    WaitForSingleObject(pi.hProcess, INFINITE);
+    if (watcher.joinable()) watcher.join();
+    if (exitCode) GetExitCodeProcess(pi.hProcess, exitCode);
+    CloseHandle(pi.hProcess);
+    CloseHandle(pi.hThread);
+    return true;
+}
+// Runs a console tool hidden and collects its stdout.
+static bool RunCapture(const std::wstring& exe, const std::wstring& args, std::string& out, DWORD* exitCode = nullptr,
+                       const std::atomic<bool>* cancel = nullptr) {
+    out.clear();
+    return RunPiped(exe, args, [&](HANDLE rd) {
+        char buf[64 * 1024];
+        DWORD got = 0;
+        while (ReadFile(rd, buf, sizeof(buf), &got, nullptr) && got) out.append(buf, got);
+    }, exitCode, cancel);
+}
+static std::wstring GetItemPath(IShellItem* it) {
+    LPWSTR s = nullptr; std::wstring out;
+    if (SUCCEEDED(it->GetDisplayName(SIGDN_FILESYSPATH, &s)) && s) { out = s; CoTaskMemFree(s); }
+    return out;
+}
+static bool IsDirectoryPath(const wchar_t* p) {
+    DWORD a = GetFileAttributesW(p);
+    return (a != INVALID_FILE_ATTRIBUTES) && (a & FILE_ATTRIBUTE_DIRECTORY);
+}
+static bool IsDirectoryPath(const std::wstring& p) { return IsDirectoryPath(p.c_str()); }
+static bool IsArchiveExt(const std::wstring& ext) {
+    static const wchar_t* exts[] = {
+        L".7z",L".zip",L".rar",L".tar",L".gz",L".xz",L".bz2",L".cab",L".wim",L".lzma",L".zst",L".arj"
+    };
+    for (auto e : exts) if (NamesEqualI(ext, e)) return true;
+    return false;
+}
+static std::wstring BaseName(const std::wstring& path) {
+    std::filesystem::path p(path);
+    return IsDirectoryPath(path) ? p.filename().wstring() : p.stem().wstring();
+}
+// A selection, as handed to the commands (see PathArena.h).
+using PathArena = BasicPathArena<wchar_t>;
+
+static std::wstring DefaultArchiveName(const PathArena& paths, const wchar_t* ext) {
+    if (paths.empty()) return L"Archive" + std::wstring(ext);
+    if (paths.size() == 1) return BaseName(paths[0]) + ext;
+
+    // Multi-selection → use parent directory name if common
+    std::filesystem::path parent = std::filesystem::path(paths[0]).parent_path();
+    if (paths.SameParent() && !parent.filename().empty())
+        return parent.filename().wstring() + ext;
+
+    // Fallback
+    return std::wstring(L"Archive") + ext;
+}
+// Drops exact duplicates and items already covered by a selected ancestor
+// (search results and libraries can hand us both a folder and its children),
+// so 7-Zip never reads the same data twice. Case-insensitive, O(n log n);
+// the surviving items keep their original order.
+static void NormalizeSelection(std::vector<std::wstring>& paths) {
+    if (paths.size() < 2) return;
+    // Fold case and map the separator below every other code unit, so a
+    // folder's descendants sort directly after it ("a", "a\x", "a b").
+    std::vector<std::wstring> keys(paths.size());
+    for (size_t i = 0; i < paths.size(); ++i) {
+        std::wstring& k = keys[i];
+        k = paths[i];
+        while (k.size() > 3 && (k.back() == L'\\' || k.back() == L'/')) k.pop_back();
+        for (auto& c : k) c = (c == L'\\' || c == L'/') ? L'\x01' : FoldChar(c);
+    }
+    std::vector<size_t> order(paths.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return keys[a] != keys[b] ? keys[a] < keys[b] : a < b;
+    });
+
+    std::vector<bool> drop(paths.size(), false);
+    const std::wstring* kept = nullptr;
+    for (size_t i : order) {
+        const std::wstring& k = keys[i];
+        if (kept && k.size() >= kept->size() && k.compare(0, kept->size(), *kept) == 0 &&
+            (k.size() == kept->size() || k[kept->size()] == L'\x01' || kept->back() == L'\x01')) {
+            drop[i] = true;
+            continue;
+        }
+        kept = &k;
+    }
+    size_t w = 0;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        if (drop[i]) continue;
+        if (w != i) paths[w] = std::move(paths[i]);
+        ++w;
+    }
+    paths.resize(w);
+}
+
+// ---------- Shared cache ----------
+// Results worth keeping across surrogates (file digests, the 7-Zip folder)
+// live in a named pagefile-backed section shared by every process of the
+// session, so a cold surrogate starts with whatever another one computed.
+// Digests sit in a fixed open-addressing table with no lock: each entry has
+// a sequence number that a writer makes odd while it writes (a seqlock);
+// readers copy the entry and discard the copy if the number moved (SeqRead
+// and friends, Concurrency.h). Writers that find an entry busy simply drop
+// their result. Fresh pages are zero,
+// which reads as an empty table, so nobody has to initialize the section.
+struct DigestRecord {
+    uint32_t kind;        // HashKind, 0 = empty
+    uint32_t len;
+    uint64_t key;         // NameHashI of the full path
+    uint64_t size, mtime; // the file's size and FILETIME ticks when hashed
+    uint8_t digest[64];
+};
+struct SharedDigest {
+    std::atomic<uint32_t> seq;
+    uint32_t pad;
+    DigestRecord rec;
+    uint8_t pad2[24];
+};
+static_assert(sizeof(SharedDigest) == 128, "two cache lines per entry");
+struct ToolDirRecord {
+    uint32_t len;
+    wchar_t dir[MAX_PATH];
+};
+struct SharedToolDir {
+    std::atomic<uint32_t> seq;
+    ToolDirRecord rec;
+};
+constexpr size_t kSharedDigests = 16384; // 2 MB
+constexpr size_t kSharedProbe = 8;       // entries looked at per key
+struct SharedSection {
+    SharedToolDir tools;
+    alignas(64) SharedDigest digests[kSharedDigests];
+};
+static std::atomic<SharedSection*> g_shared{ nullptr };
+static std::mutex g_sharedLock;
+
+static SharedSection* Shared() {
+    if (SharedSection* s = g_shared.load(std::memory_order_acquire)) return s;
+    std::lock_guard<std::mutex> g(g_sharedLock);
+    if (SharedSection* s = g_shared.load(std::memory_order_relaxed)) return s;
+    // The size is part of the name, so a layout change never maps an older table.
+    const std::wstring name = L"Local\\7-Zip.ShellExtension.Cache." + std::to_wstring(sizeof(SharedSection));
+    HANDLE h = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, DWORD(sizeof(SharedSection)), name.c_str());
+    if (!h) return nullptr;
+    auto* s = static_cast<SharedSection*>(MapViewOfFile(h, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(SharedSection)));
+    CloseHandle(h); // the view keeps the section alive
+    g_shared.store(s, std::memory_order_release);
+    return s;
+}
+// Called from DllCanUnloadNow, when no job can be reading the table.
+static void ShutdownSharedCache() {
+    std::lock_guard<std::mutex> g(g_sharedLock);
+    if (SharedSection* s = g_shared.exchange(nullptr)) UnmapViewOfFile(s);
+}
+
+static size_t DigestHome(uint32_t kind, uint64_t key) { return size_t((key ^ (kind * 0x9E3779B97F4A7C15ull)) % kSharedDigests); }
+
+static bool SharedDigestGet(uint32_t kind, uint64_t key, uint64_t size, uint64_t mtime, std::vector<uint8_t>& out) {
+    SharedSection* s = Shared();
+    if (!s) return false;
+    const size_t home = DigestHome(kind, key);
+    for (size_t k = 0; k < kSharedProbe; ++k) {
+        const SharedDigest& e = s->digests[(home + k) % kSharedDigests];
+        DigestRecord r;
+        if (!SeqRead(e.seq, e.rec, r) || r.kind != kind || r.key != key) continue;
+        if (r.size != size || r.mtime != mtime || r.len > sizeof(r.digest)) return false; // stale
+        out.assign(r.digest, r.digest + r.len);
+        return true;
+    }
+    return false;
+}
+static void SharedDigestPut(uint32_t kind, uint64_t key, uint64_t size, uint64_t mtime, const std::vector<uint8_t>& digest) {
+    SharedSection* s = Shared();
+    if (!s || digest.size() > sizeof(DigestRecord::digest)) return;
+    // Same key first, then an empty entry, else evict one picked by the file's stamp.
+    const size_t home = DigestHome(kind, key);
+    size_t slot = (home + size_t((size ^ mtime) % kSharedProbe)) % kSharedDigests;
+    for (size_t k = 0, empty = SIZE_MAX; k < kSharedProbe; ++k) {
+        const size_t i = (home + k) % kSharedDigests;
+        DigestRecord r;
+        if (!SeqRead(s->digests[i].seq, s->digests[i].rec, r)) continue;
+        if (r.kind == kind && r.key == key) { slot = i; break; }
+        if (r.kind == 0 && empty == SIZE_MAX) slot = empty = i;
+    }
+    SharedDigest& e = s->digests[slot];
+    uint32_t start;
+    if (!SeqWriteBegin(e.seq, start)) return;
+    e.rec.kind = kind;
+    e.rec.len = uint32_t(digest.size());
+    e.rec.key = key;
+    e.rec.size = size;
+    e.rec.mtime = mtime;
+    memcpy(e.rec.digest, digest.data(), digest.size());
+    SeqWriteEnd(e.seq, start);
+}
+
+static bool SharedToolDirGet(std::wstring& dir) {
+    SharedSection* s = Shared();
+    ToolDirRecord copy;
+    if (!s || !SeqRead(s->tools.seq, s->tools.rec, copy) || !copy.len || copy.len >= MAX_PATH) return false;
+    dir.assign(copy.dir, copy.len);
+    return true;
+}
+static void SharedToolDirPut(const std::wstring& dir) {
+    SharedSection* s = Shared();
+    uint32_t start;
+    if (!s || dir.size() >= MAX_PATH || !SeqWriteBegin(s->tools.seq, start)) return;
+    s->tools.rec.len = uint32_t(dir.size());
+    memcpy(s->tools.rec.dir, dir.c_str(), (dir.size() + 1) * sizeof(wchar_t));
+    SeqWriteEnd(s->tools.seq, start);
+}
+
+// ---------- 7-Zip tool discovery ----------
+// The tools are located once: next to this DLL, then the install folders
+// recorded by the 7-Zip setup (HKLM/HKCU\SOFTWARE\7-Zip), then the usual
+// Program Files folders, then PATH. The result is an immutable snapshot that
+// lookups read with one atomic load. A change notification on the tools'
+// folder marks it stale, and the next lookup resolves again. Snapshots are
+// only freed when the DLL is about to unload, so readers never see one die.
+// A completed search is published in the shared cache; the first lookup in
+// another surrogate reuses it only if it is one of its own candidate folders
+// and the tools are still there, so a forged entry cannot redirect 7z.dll.
+struct ToolSet {
+    std::wstring dir;     // folder 7zG.exe was found in; empty when relying on PATH
+    std::wstring g, z, fm;
+};
+static std::atomic<const ToolSet*> g_tools{ nullptr };
+static std::atomic<bool> g_toolsStale{ true };
+static std::mutex g_toolsLock; // serializes refreshes, never taken by a fresh lookup
+static std::vector<std::unique_ptr<const ToolSet>> g_toolsSnapshots;
+static HANDLE g_toolsChange = nullptr, g_toolsWait = nullptr;
+
+static std::wstring ReadInstallPath(HKEY root, const wchar_t* value, DWORD view) {
+    wchar_t buf[MAX_PATH]{};
+    DWORD cb = sizeof(buf);
+    if (RegGetValueW(root, L"SOFTWARE\\7-Zip", value, RRF_RT_REG_SZ | view, nullptr, buf, &cb) != ERROR_SUCCESS)
+        return {};
+    return buf;
+}
+static std::wstring ExpandEnv(const wchar_t* s) {
+    wchar_t buf[MAX_PATH]{};
+    DWORD n = ExpandEnvironmentStringsW(s, buf, MAX_PATH);
+    return (n && n <= MAX_PATH && !wcschr(buf, L'%')) ? std::wstring(buf) : std::wstring();
+}
+static ToolSet ResolveTools(bool useShared) {
+    ToolSet t;
+    const std::wstring moduleDir = GetModuleDir(g_hMod);
+    if (FileExists(Combine(moduleDir, L"7zG.exe"))) {
+        t.dir = moduleDir;
+    } else {
+        const std::wstring candidates[] = {
+            ReadInstallPath(HKEY_LOCAL_MACHINE, L"Path64", RRF_SUBKEY_WOW6464KEY),
+            ReadInstallPath(HKEY_LOCAL_MACHINE, L"Path", RRF_SUBKEY_WOW6464KEY),
+            ReadInstallPath(HKEY_LOCAL_MACHINE, L"Path", RRF_SUBKEY_WOW6432KEY),
+            ReadInstallPath(HKEY_CURRENT_USER, L"Path64", 0),
+            ReadInstallPath(HKEY_CURRENT_USER, L"Path", 0),
+            ExpandEnv(L"%ProgramW6432%\\7-Zip"),
+            ExpandEnv(L"%ProgramFiles%\\7-Zip"),
+            ExpandEnv(L"%ProgramFiles(x86)%\\7-Zip"),
+        };
+        // Any process can write the shared section, so its answer only saves
+        // the probing when it names one of our own candidates.
+        std::wstring shared;
+        if (useShared && SharedToolDirGet(shared)) {
+            for (auto& dir : candidates) {
+                if (!dir.empty() && NamesEqualI(dir, shared) && FileExists(Combine(dir, L"7zG.exe"))) { t.dir = dir; break; }
+            }
+        }
+        for (size_t i = 0; t.dir.empty() && i < std::size(candidates); ++i) {
+            if (!candidates[i].empty() && FileExists(Combine(candidates[i], L"7zG.exe"))) t.dir = candidates[i];
+        }
+        if (!t.dir.empty() && t.dir != shared) SharedToolDirPut(t.dir);
+    }
+    auto locate = [&](const wchar_t* name) {
+        if (!t.dir.empty()) {
+            auto p = Combine(t.dir, name);
+            if (FileExists(p)) return p;
+        }
+        wchar_t found[MAX_PATH]{};
+        if (SearchPathW(nullptr, name, nullptr, MAX_PATH, found, nullptr)) return std::wstring(found);
+        return std::wstring(name); // let ShellExecute try
+    };
+    t.g = locate(L"7zG.exe");
+    t.z = locate(L"7z.exe");
+    t.fm = locate(L"7zFM.exe");
+    return t;
+}
+static VOID CALLBACK OnToolDirChanged(PVOID, BOOLEAN) {
+    g_toolsStale.store(true, std::memory_order_release);
+}
+static void UnwatchToolDir() {
+    if (g_toolsWait) { UnregisterWaitEx(g_toolsWait, INVALID_HANDLE_VALUE); g_toolsWait = nullptr; }
+    if (g_toolsChange) { FindCloseChangeNotification(g_toolsChange); g_toolsChange = nullptr; }
+}
+static void WatchToolDir(const std::wstring& dir) {
+    if (dir.empty()) return;
+    HANDLE h = FindFirstChangeNotificationW(dir.c_str(), FALSE,
+                                            FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE);
+    if (h == INVALID_HANDLE_VALUE) return;
+    g_toolsChange = h;
+    if (!RegisterWaitForSingleObject(&g_toolsWait, h, OnToolDirChanged, nullptr, INFINITE, WT_EXECUTEONLYONCE))
+        g_toolsWait = nullptr;
+}
+static const ToolSet& Tools() {
+    const ToolSet* t = g_tools.load(std::memory_order_acquire);
+    if (t && !g_toolsStale.load(std::memory_order_acquire)) return *t;
+
+    std::lock_guard<std::mutex> g(g_toolsLock);
+    t = g_tools.load(std::memory_order_acquire);
+    if (t && !g_toolsStale.load(std::memory_order_acquire)) return *t;
+    g_toolsStale.store(false, std::memory_order_release); // a change from here on triggers another refresh
+    UnwatchToolDir();
+    auto fresh = std::make_unique<const ToolSet>(ResolveTools(t == nullptr)); // a refresh searches again
+    WatchToolDir(fresh->dir);
+    t = fresh.get();
+    g_toolsSnapshots.push_back(std::move(fresh));
+    g_tools.store(t, std::memory_order_release);
+    return *t;
+}
+// Called once nothing can reference a snapshot any more (DLL about to unload).
+static void ShutdownToolCache() {
+    std::lock_guard<std::mutex> g(g_toolsLock);
+    UnwatchToolDir();
+    g_tools.store(nullptr, std::memory_order_release);
+    g_toolsStale.store(true, std::memory_order_release);
+    g_toolsSnapshots.clear();
+}
+static std::wstring Find7zTool(const std::wstring& name) {
+    const ToolSet& t = Tools();
+    if (name == L"7zG.exe") return t.g;
+    if (name == L"7z.exe") return t.z;
+    if (name == L"7zFM.exe") return t.fm;
+    return t.dir.empty() ? name : Combine(t.dir, name);
+}
+
+// ---------- UTF-8 <-> UTF-16 ----------
+// Utf16ToUtf8/Utf8ToUtf16 live in Utf8.h; these are the std::wstring forms.
+static std::string ToUtf8(std::wstring_view s) {
+    std::string out(s.size() * 3, '\0');
+    out.resize(Utf16ToUtf8(s.data(), s.size(), out.data()));
+    return out;
+}
+static std::wstring FromUtf8(std::string_view s) {
+    std::wstring out(s.size(), L'\0');
+    out.resize(Utf8ToUtf16(s.data(), s.size(), out.data()));
+    return out;
+}
+
+// ---------- Settings ----------
+// Per-user tuning knobs under HKCU; absent values fall back to the defaults.
+static const wchar_t kSettingsKey[] = L"Software\\7-Zip\\ShellExtension";
+static DWORD ReadSetting(const wchar_t* name, DWORD def) {
+    DWORD v = 0, cb = sizeof(v);
+    if (RegGetValueW(HKEY_CURRENT_USER, kSettingsKey, name, RRF_RT_REG_DWORD, nullptr, &v, &cb) != ERROR_SUCCESS)
+        return def;
+    return v;
+}
+static void WriteSetting(const wchar_t* name, DWORD value) {
+    RegSetKeyValueW(HKEY_CURRENT_USER, kSettingsKey, name, REG_DWORD, &value, sizeof(value));
+}
+static double NowSeconds() {
+    static const double freq = [] { LARGE_INTEGER f; QueryPerformanceFrequency(&f); return double(f.QuadPart); }();
+    LARGE_INTEGER c;
+    QueryPerformanceCounter(&c);
+    return double(c.QuadPart) / freq;
+}
+
+// ---------- Cache manager ----------
+// Process-wide caches register how to measure and how to shrink themselves so
+// one budget (CacheBudgetMB, default 64) covers all of them; CacheBudget.h
+// trims the least recently used ones back to three quarters of it when they
+// grow past it. On top of that, once the surrogate has been idle for a minute
+// they are trimmed to a quarter, and a low-memory signal from Windows empties
+// them.
+class CacheManager {
+public:
+    size_t Register(const wchar_t* name, CacheBudget::Measure bytes, CacheBudget::Shrink trim) {
+        return m_budget.Register(name, std::move(bytes), std::move(trim));
+    }
+    // Called after a cache was used.
+    void Touch(size_t id) {
+        Start();
+        m_budget.Touch(id);
+    }
+    // Called after a cache grew.
+    void Grew(size_t id) {
+        Start();
+        m_budget.Grew(id);
+    }
+    void TrimTo(size_t target) { m_budget.TrimTo(target); }
+    // Only once g_LockCount is zero; the caches are emptied and the timer and
+    // low-memory wait start again on the next Touch.
+    void Shutdown() {
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            if (m_timer) { DeleteTimerQueueTimer(nullptr, m_timer, INVALID_HANDLE_VALUE); m_timer = nullptr; }
+            if (m_lowWait) { UnregisterWaitEx(m_lowWait, INVALID_HANDLE_VALUE); m_lowWait = nullptr; }
+            if (m_lowMemory) { CloseHandle(m_lowMemory); m_lowMemory = nullptr; }
+            m_running.store(false, std::memory_order_release);
+        }
+        m_budget.TrimTo(0);
+    }
+
+private:
+    static constexpr DWORD kTickMs = 10 * 1000;
+    static constexpr uint64_t kIdleMs = 60 * 1000;
+
+    void Start() {
+        if (m_running.load(std::memory_order_acquire)) return;
+        std::lock_guard<std::mutex> g(m_lock);
+        if (m_running.load(std::memory_order_relaxed)) return;
+        m_budget.SetBudget(size_t(ReadSetting(L"CacheBudgetMB", 64)) << 20);
+        m_lowMemory = CreateMemoryResourceNotification(LowMemoryResourceNotification);
+        ArmLowMemory();
+        if (!CreateTimerQueueTimer(&m_timer, nullptr, OnTimer, this, kTickMs, kTickMs, WT_EXECUTEDEFAULT))
+            m_timer = nullptr;
+        m_running.store(true, std::memory_order_release);
+    }
+    // One-shot: the notification stays signaled while memory is low, so the
+    // timer re-arms it only after memory has recovered.
+    void ArmLowMemory() {
+        if (m_lowWait) { UnregisterWait(m_lowWait); m_lowWait = nullptr; }
+        if (m_lowMemory && RegisterWaitForSingleObject(&m_lowWait, m_lowMemory, OnLowMemory, this, INFINITE, WT_EXECUTEONLYONCE))
+            m_lowArmed.store(true, std::memory_order_release);
+        else
+            m_lowWait = nullptr;
+    }
+    static VOID CALLBACK OnLowMemory(PVOID self, BOOLEAN) {
+        auto* m = static_cast<CacheManager*>(self);
+        m->m_lowArmed.store(false, std::memory_order_release);
+        m->m_budget.TrimTo(0);
+    }
+    static VOID CALLBACK OnTimer(PVOID self, BOOLEAN) {
+        auto* m = static_cast<CacheManager*>(self);
+        BOOL low = FALSE;
+        if (m->m_lowMemory && QueryMemoryResourceNotification(m->m_lowMemory, &low) && low) { m->m_budget.TrimTo(0); return; }
+        if (!m->m_lowArmed.load(std::memory_order_acquire)) m->ArmLowMemory();
+        if (g_LockCount == 0 && m->m_budget.IdleMs() >= kIdleMs)
+            m->m_budget.TrimTo(m->m_budget.Budget() / 4);
+    }
+
+    CacheBudget m_budget;
+    std::atomic<bool> m_running{ false };
+    std::atomic<bool> m_lowArmed{ false };
+    std::mutex m_lock; // start and shutdown
+    HANDLE m_timer{};
+    HANDLE m_lowMemory{};
+    HANDLE m_lowWait{};
+};
+static CacheManager g_caches;
+
+// ---------- Memory ----------
+// Menu callbacks (GetTitle/GetState, several per open) build their strings in
+// a per-thread monotonic arena that is rewound when the outermost callback
+// returns, so a steady-state menu open makes no heap calls of its own. A call
+// that outgrows the 64 KB falls back to the heap for the excess.
+class ScratchScope {
+public:
+    ScratchScope() { ++Depth(); }
+    ~ScratchScope() { if (--Depth() == 0) Resource().release(); }
+    ScratchScope(const ScratchScope&) = delete;
+    ScratchScope& operator=(const ScratchScope&) = delete;
+    static std::pmr::memory_resource* Get() { return &Resource(); }
+private:
+    static unsigned& Depth() { thread_local unsigned depth = 0; return depth; }
+    static std::pmr::monotonic_buffer_resource& Resource() {
+        thread_local std::unique_ptr<std::byte[]> storage(new std::byte[kSize]);
+        thread_local std::pmr::monotonic_buffer_resource arena(storage.get(), kSize);
+        return arena;
+    }
+    static constexpr size_t kSize = 64 * 1024;
+};
+using ScratchString = std::pmr::wstring;
+static ScratchString Scratch(std::wstring_view s = {}) { return ScratchString(s, ScratchScope::Get()); }
+// Like PathAppend: a drive root already ends in the separator.
+static ScratchString& AppendPath(ScratchString& dir, std::wstring_view name) {
+    if (!dir.empty() && dir.back() != L'\\') dir += L'\\';
+    return dir.append(name);
+}
+
+// 1 MB I/O blocks for every reader (file hashing, archive search, pipelines),
+// borrowed from a process-wide free list and handed back instead of being
+// allocated per file or per archive. Up to kKeep idle blocks stay cached; the
+// cache manager drops the least recently returned ones first.
+class BlockCache {
+public:
+    static constexpr size_t kSize = 1 << 20;
+    struct Return { void operator()(uint8_t* p) const { Put(p); } };
+    using Block = std::unique_ptr<uint8_t[], Return>;
+
+    static Block Take() {
+        {
+            std::lock_guard<std::mutex> g(Lock());
+            auto& free = Free();
+            if (!free.empty()) { uint8_t* p = free.back(); free.pop_back(); return Block(p); }
+        }
+        return Block(new uint8_t[kSize]);
+    }
+    // Releases idle blocks, oldest first, until at most `keep` bytes stay cached.
+    static void Trim(size_t keep = 0) {
+        std::lock_guard<std::mutex> g(Lock());
+        auto& free = Free();
+        const size_t drop = free.size() - std::min(free.size(), keep / kSize);
+        for (size_t i = 0; i < drop; ++i) delete[] free[i];
+        free.erase(free.begin(), free.begin() + drop);
+    }
+    static size_t Bytes() {
+        std::lock_guard<std::mutex> g(Lock());
+        return Free().size() * kSize;
+    }
+private:
+    static constexpr size_t kKeep = 32;
+    static void Put(uint8_t* p) {
+        {
+            std::lock_guard<std::mutex> g(Lock());
+            if (Free().size() < kKeep) { Free().push_back(p); p = nullptr; } // capacity reserved: never allocates
+        }
+        if (p) { delete[] p; g_caches.Touch(CacheId()); }
+        else g_caches.Grew(CacheId());
+    }
+    static size_t CacheId() {
+        static const size_t id = g_caches.Register(L"I/O blocks", Bytes, [](size_t keep) { Trim(keep); });
+        return id;
+    }
+    static std::mutex& Lock() { static std::mutex m; return m; }
+    static std::vector<uint8_t*>& Free() {
+        static std::vector<uint8_t*> free = [] { std::vector<uint8_t*> v; v.reserve(kKeep); return v; }();
+        return free;
+    }
+};
+
+// ---------- Executor ----------
+// The work-stealing pool and ParallelFor live in Concurrency.h; these are the
+// Windows parts they are given.
+
+// For pool destructors. At process exit the threads are already gone and only
+// the std::thread objects remain. On FreeLibrary they should have been joined
+// by DllCanUnloadNow's shutdown; a thread still here would run unmapped code.
+// Joining under the loader lock would deadlock, so say so in the debugger and
+// let go of them.
+static void ReleaseThreads(std::vector<std::thread>& threads, const wchar_t* pool) {
+    if (!threads.empty() && !g_processExiting) {
+        wchar_t line[128];
+        swprintf_s(line, L"7-Zip shell extension: unloaded with %zu %s thread(s) not joined\n", threads.size(), pool);
+        OutputDebugStringW(line);
+    }
+    for (auto& t : threads) t.detach();
+    threads.clear();
+}
+
+// Threads to use: CPUs in the process affinity mask, capped by the MaxWorkers
+// setting and halved while Windows battery saver is on. The answer is cached;
+// RefreshWorkerCount() (called as each background job starts) looks again, so
+// a setting or power change applies from the next command on.
+static std::atomic<unsigned> g_workerCount{ 0 };
+static unsigned RefreshWorkerCount() {
+    static const unsigned cpus = [] {
+        DWORD_PTR proc = 0, sys = 0;
+        unsigned n = 0;
+        if (GetProcessAffinityMask(GetCurrentProcess(), &proc, &sys))
+            for (; proc; proc &= proc - 1) ++n;
+        if (!n) n = std::thread::hardware_concurrency();
+        return n ? n : 4;
+    }();
+    unsigned n = cpus;
+    if (DWORD cap = ReadSetting(L"MaxWorkers", 0)) n = std::min<unsigned>(n, cap);
+    SYSTEM_POWER_STATUS ps{};
+    if (GetSystemPowerStatus(&ps) && ps.SystemStatusFlag) n = std::max(1u, n / 2);
+    g_workerCount.store(n, std::memory_order_relaxed);
+    return n;
+}
+static unsigned WorkerCount() {
+    const unsigned n = g_workerCount.load(std::memory_order_relaxed);
+    return n ? n : RefreshWorkerCount();
+}
+
+// Loop bodies' exceptions reach ParallelFor's caller; this is for a task
+// posted on its own, which has nobody to tell.
+static void TaskFailed(std::exception_ptr) {
+    OutputDebugStringW(L"7-Zip shell extension: a background task threw\n");
+}
+static Executor g_executor({ WorkerCount, ReleaseThreads, TaskFailed });
+
+// Runs fn(i) for i in [0, count) on g_executor, the calling thread included;
+// rethrows the first exception fn threw once every running call has returned.
+static void ParallelFor(size_t count, const std::function<void(size_t)>& fn, Priority prio = Priority::Bulk) {
+    g_executor.For(count, fn, prio);
+}
+
+// ---------- Background jobs ----------
+// Invoke hands its work to these threads (JobQueue, Concurrency.h) so
+// Explorer's thread returns at once. A queued job holds g_LockCount until it
+// finishes, which keeps the surrogate (and this DLL) loaded.
+
+// A throwing job must not take the thread (and Explorer's surrogate) down
+// with it, nor keep g_LockCount raised: report it and carry on.
+static void RunJob(const std::function<void()>& job) {
+    const wchar_t* what = nullptr;
+    std::wstring detail;
+    try {
+        RefreshWorkerCount();
+        job();
+    } catch (const std::bad_alloc&) {
+        what = L"Out of memory.";
+    } catch (const std::exception& e) {
+        detail = FromUtf8(e.what()); // the standard library's messages are ASCII
+        what = detail.c_str();
+    } catch (...) {
+        what = L"Unknown error.";
+    }
+    if (what)
+        MessageBoxW(nullptr, (std::wstring(L"The command stopped because of an error:\n\n") + what).c_str(),
+                    L"7-Zip", MB_OK | MB_ICONERROR);
+}
+static JobQueue g_jobs({
+    [] { InterlockedIncrement(&g_LockCount); },
+    [] { InterlockedDecrement(&g_LockCount); },
+    // ShellExecuteEx and the common dialogs want an STA.
+    [] { return SUCCEEDED(CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE)); },
+    [] { CoUninitialize(); },
+    RunJob,
+    ReleaseThreads,
+});
+
+static void PostJob(std::function<void()> job) { g_jobs.Post(std::move(job)); }
+
+// ---------- Pipeline ----------
+// Building blocks for read -> transform -> aggregate jobs. Channels are
+// bounded, so a slow stage blocks the ones feeding it instead of letting
+// queues grow; buffers come from a fixed pool and go back to it when the last
+// stage drops them; each stage runs on as many threads as it is given. Stages
+// count items and bytes, channels their peak depth and how often a producer
+// had to wait. Summary() formats the totals once the pipeline has ended; with
+// TracePipelines = 1 they also go to the debugger output. Channel<T> is in
+// Concurrency.h.
+
+// A bounded share of the block cache: holds `count` blocks and Acquire blocks
+// until one is returned, which caps a pipeline's memory.
+class BufferPool {
+public:
+    struct Return { BufferPool* pool{ nullptr }; void operator()(uint8_t* p) const { pool->Release(p); } };
+    using Buffer = std::unique_ptr<uint8_t[], Return>;
+
+    explicit BufferPool(size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            m_storage.push_back(BlockCache::Take());
+            m_free.push_back(m_storage.back().get());
+        }
+    }
+    Buffer Acquire() {
+        std::unique_lock<std::mutex> lk(m_lock);
+        m_returned.wait(lk, [this] { return !m_free.empty(); });
+        uint8_t* p = m_free.back();
+        m_free.pop_back();
+        return Buffer(p, Return{ this });
+    }
+    static constexpr size_t BlockSize() { return BlockCache::kSize; }
+private:
+    void Release(uint8_t* p) {
+        { std::lock_guard<std::mutex> g(m_lock); m_free.push_back(p); }
+        m_returned.notify_one();
+    }
+    std::vector<BlockCache::Block> m_storage;
+    std::vector<uint8_t*> m_free;
+    std::mutex m_lock;
+    std::condition_variable m_returned;
+};
+
+class Pipeline {
+public:
+    struct Stage {
+        std::wstring name;
+        std::atomic<uint64_t> items{ 0 }, bytes{ 0 };
+        double started{ 0 }, finished{ 0 };
+        void Count(uint64_t n) { items.fetch_add(1, std::memory_order_relaxed); bytes.fetch_add(n, std::memory_order_relaxed); }
+    };
+    explicit Pipeline(std::wstring name) : m_name(std::move(name)) {}
+    ~Pipeline() { Wait(); }
+
+    // Runs body(stage) on `threads` threads; `done` runs once after the last of
+    // them returns, typically to close the stage's output channel.
+    Stage& Add(const wchar_t* name, unsigned threads, std::function<void(Stage&)> body, std::function<void()> done = {}) {
+        m_stages.push_back(std::make_unique<Stage>());
+        Stage& st = *m_stages.back();
+        st.name = name;
+        st.started = NowSeconds();
+        auto left = std::make_shared<std::atomic<unsigned>>(std::max(threads, 1u));
+        auto shared = std::make_shared<std::function<void(Stage&)>>(std::move(body));
+        for (unsigned t = 0; t < *left; ++t) {
+            m_threads.emplace_back([&st, left, shared, done] {
+                (*shared)(st);
+                if (left->fetch_sub(1) == 1) {
+                    st.finished = NowSeconds();
+                    if (done) done();
+                }
+            });
+        }
+        return st;
+    }
+    // Includes the channel's peak depth and producer stalls in the summary.
+    template<class T> void Watch(const wchar_t* name, Channel<T>& c) {
+        m_channels.push_back([name, &c] {
+            wchar_t line[160];
+            swprintf_s(line, L"  queue %-12ls peak %zu, producer waits %llu\r\n", name, c.Peak(), (unsigned long long)c.Stalls());
+            return std::wstring(line);
+        });
+    }
+    void Wait() {
+        if (m_threads.empty()) return;
+        for (auto& t : m_threads) t.join();
+        m_threads.clear();
+        static const bool trace = ReadSetting(L"TracePipelines", 0) != 0;
+        if (trace) OutputDebugStringW(Summary().c_str());
+    }
+    // Per-stage throughput and per-channel pressure, after Wait().
+    std::wstring Summary() const {
+        std::wstring log = L"[7-Zip pipeline] " + m_name + L"\r\n";
+        for (auto& st : m_stages) {
+            double secs = std::max(st->finished - st->started, 1e-6);
+            wchar_t line[160];
+            swprintf_s(line, L"  stage %-12ls %llu items, %.1f MB, %.1f MB/s\r\n", st->name.c_str(),
+                       (unsigned long long)st->items.load(), double(st->bytes.load()) / 1e6, double(st->bytes.load()) / 1e6 / secs);
+            log += line;
+        }
+        for (auto& c : m_channels) log += c();
+        return log;
+    }
+private:
+    std::wstring m_name;
+    std::vector<std::unique_ptr<Stage>> m_stages;
+    std::vector<std::function<std::wstring()>> m_channels;
+    std::vector<std::thread> m_threads;
+};
+
+// ---------- File scanning ----------
+struct FileRecord {
+    std::wstring path;
+    uint64_t size{ 0 };
+    uint64_t mtime{ 0 }; // FILETIME ticks
+};
+static uint64_t FileTimeTicks(const FILETIME& ft) {
+    return (uint64_t(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+}
+// With `budget`, each file listed takes one from it and listing stops once it runs out.
+static void ListDirectory(const std::wstring& dir, std::vector<FileRecord>& files, std::vector<std::wstring>& subdirs,
+                          std::atomic<int64_t>* budget = nullptr) {
+    WIN32_FIND_DATAW fd;
+    HANDLE h = FindFirstFileExW((dir + L"\\*").c_str(), FindExInfoBasic, &fd,
+                                FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+    if (h == INVALID_HANDLE_VALUE) return;
+    do {
+        if (fd.cFileName[0] == L'.' && (!fd.cFileName[1] || (fd.cFileName[1] == L'.' && !fd.cFileName[2])))
+            continue;
+        if (fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) continue;
+        std::wstring p = dir + L"\\" + fd.cFileName;
+        if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) { subdirs.push_back(std::move(p)); continue; }
+        if (budget && budget->fetch_sub(1) <= 0) break;
+        files.push_back({ std::move(p), (uint64_t(fd.nFileSizeHigh) << 32) | fd.nFileSizeLow,
+                          FileTimeTicks(fd.ftLastWriteTime) });
+    } while (FindNextFileW(h, &fd));
+    FindClose(h);
+}
+// Expands the selection into plain files, one directory level at a time with
+// the directories of each level listed in parallel. Reparse points are not followed.
+// Stops as soon as `limit` files are found, in the middle of a level or of a
+// directory if need be.
+static void ScanFiles(const PathArena& roots, std::vector<FileRecord>& out,
+                      size_t limit = SIZE_MAX) {
+    std::vector<std::wstring> dirs;
+    for (auto& r : roots) {
+        if (out.size() >= limit) return;
+        WIN32_FILE_ATTRIBUTE_DATA fad{};
+        if (!GetFileAttributesExW(r.c_str(), GetFileExInfoStandard, &fad)) continue;
+        if (fad.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) { dirs.push_back(r); continue; }
+        out.push_back({ r, (uint64_t(fad.nFileSizeHigh) << 32) | fad.nFileSizeLow, FileTimeTicks(fad.ftLastWriteTime) });
+    }
+    std::atomic<int64_t> budget{ limit == SIZE_MAX ? INT64_MAX : int64_t(limit - out.size()) };
+    while (!dirs.empty() && budget.load() > 0) {
+        std::vector<std::vector<FileRecord>> files(dirs.size());
+        std::vector<std::vector<std::wstring>> subdirs(dirs.size());
+        ParallelFor(dirs.size(), [&](size_t i) {
+            if (budget.load(std::memory_order_relaxed) > 0) ListDirectory(dirs[i], files[i], subdirs[i], &budget);
+        });
+        dirs.clear();
+        for (size_t i = 0; i < files.size(); ++i) {
+            for (auto& f : files[i]) out.push_back(std::move(f));
+            for (auto& d : subdirs[i]) dirs.push_back(std::move(d));
+        }
+    }
+}
+
+// ---------- Hashing ----------
+using Digest256 = std::array<uint8_t, 32>;
+
+// SHA-256 through CNG; the algorithm handle is shared, hash objects are per call.
+static BCRYPT_ALG_HANDLE Sha256Provider() {
+    static BCRYPT_ALG_HANDLE h = [] {
+        BCRYPT_ALG_HANDLE a = nullptr;
+        if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&a, BCRYPT_SHA256_ALGORITHM, nullptr, 0))) a = nullptr;
+        return a;
+    }();
+    return h;
+}
+static BCRYPT_ALG_HANDLE Sha512Provider() {
+    static BCRYPT_ALG_HANDLE h = [] {
+        BCRYPT_ALG_HANDLE a = nullptr;
+        if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&a, BCRYPT_SHA512_ALGORITHM, nullptr, 0))) a = nullptr;
+        return a;
+    }();
+    return h;
+}
+static bool ReadAt(HANDLE f, uint64_t off, void* buf, DWORD len, DWORD& got) {
+    OVERLAPPED ov{};
+    ov.Offset = DWORD(off);
+    ov.OffsetHigh = DWORD(off >> 32);
+    return ReadFile(f, buf, len, &got, &ov) != FALSE;
+}
+// Hashes the first and last `edge` bytes (the whole file when it is small).
+// Full-file hashing when edge == 0.
+static bool HashFile(const std::wstring& path, uint64_t size, uint32_t edge, Digest256& out) {
+    BCRYPT_ALG_HANDLE alg = Sha256Provider();
+    if (!alg) return false;
+    HANDLE f = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                           nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (f == INVALID_HANDLE_VALUE) return false;
+    BCRYPT_HASH_HANDLE h = nullptr;
+    bool ok = BCRYPT_SUCCESS(BCryptCreateHash(alg, &h, nullptr, 0, nullptr, 0, 0));
+
+    auto buf = BlockCache::Take();
+    auto feed = [&](uint64_t off, uint64_t len) {
+        while (ok && len) {
+            DWORD want = DWORD(std::min<uint64_t>(len, BlockCache::kSize)), got = 0;
+            ok = ReadAt(f, off, buf.get(), want, got) && got == want &&
+                 BCRYPT_SUCCESS(BCryptHashData(h, buf.get(), got, 0));
+            off += got; len -= got;
+        }
+    };
+    if (edge == 0 || size <= 2ull * edge) {
+        feed(0, size);
+    } else {
+        feed(0, edge);
+        feed(size - edge, edge);
+    }
+    if (ok) ok = BCRYPT_SUCCESS(BCryptFinishHash(h, out.data(), ULONG(out.size()), 0));
+    if (h) BCryptDestroyHash(h);
+    CloseHandle(f);
+    return ok;
+}
+
+// ---------- CRC-32 ----------
+// Zip/7z CRC-32 (reflected 0xEDB88320), slicing-by-8.
+struct Crc32Tables {
+    uint32_t t[8][256];
+    explicit Crc32Tables(uint32_t poly) {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c >> 1) ^ (poly & (0u - (c & 1)));
+            t[0][i] = c;
+        }
+        for (int k = 1; k < 8; ++k)
+            for (uint32_t i = 0; i < 256; ++i) t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+    }
+};
+static uint32_t Crc32Slice(const Crc32Tables& tables, uint32_t crc, const uint8_t* p, size_t n) {
+    const auto& t = tables.t;
+    crc = ~crc;
+    for (; n && (uintptr_t(p) & 7); --n) crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+    for (; n >= 8; n -= 8, p += 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    }
+    for (; n; --n) crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+    return ~crc;
+}
+static uint32_t Crc32Update(uint32_t crc, const uint8_t* p, size_t n) {
+    static const Crc32Tables tables(0xEDB88320u);
+    return Crc32Slice(tables, crc, p, n);
+}
+
+// ---------- CRC-32C ----------
+// Castagnoli CRC (iSCSI, ext4, Btrfs). With SSE4.2 the crc32 instruction runs
+// on three independent streams at once to hide its latency; the three partial
+// CRCs are joined by shifting them over the following data with zero-operator
+// tables (after Mark Adler's crc32c.c). Without it, slicing-by-8.
+static constexpr uint32_t kCrc32cPoly = 0x82F63B78u;
+static uint32_t Crc32cSoft(uint32_t crc, const uint8_t* p, size_t n) {
+    static const Crc32Tables tables(kCrc32cPoly);
+    return Crc32Slice(tables, crc, p, n);
+}
+
+#if defined(_M_X64) || defined(__x86_64__)
+// Multiplies by x^(8*len) modulo the polynomial, a byte of the CRC at a time.
+struct Crc32cShift {
+    uint32_t t[4][256];
+    explicit Crc32cShift(size_t len) {
+        uint32_t op[32];
+        ZerosOperator(op, len);
+        for (uint32_t n = 0; n < 256; ++n)
+            for (int k = 0; k < 4; ++k) t[k][n] = Times(op, n << (8 * k));
+    }
+    uint32_t operator()(uint32_t crc) const {
+        return t[0][crc & 0xFF] ^ t[1][(crc >> 8) & 0xFF] ^ t[2][(crc >> 16) & 0xFF] ^ t[3][crc >> 24];
+    }
+private:
+    static uint32_t Times(const uint32_t* mat, uint32_t vec) {
+        uint32_t sum = 0;
+        for (; vec; vec >>= 1, ++mat) if (vec & 1) sum ^= *mat;
+        return sum;
+    }
+    static void Square(uint32_t* sq, const uint32_t* mat) {
+        for (int n = 0; n < 32; ++n) sq[n] = Times(mat, mat[n]);
+    }
+    // `len` must be a power of two.
+    static void ZerosOperator(uint32_t* even, size_t len) {
+        uint32_t odd[32];
+        odd[0] = kCrc32cPoly; // one zero bit
+        for (int n = 1; n < 32; ++n) odd[n] = 1u << (n - 1);
+        Square(even, odd); // two zero bits
+        Square(odd, even); // four zero bits
+        for (;;) {
+            Square(even, odd); // first pass: one zero byte
+            if ((len >>= 1) == 0) return;
+            Square(odd, even);
+            if ((len >>= 1) == 0) break;
+        }
+        memcpy(even, odd, sizeof(odd));
+    }
+};
+
+static uint32_t Crc32cHard(uint32_t crc, const uint8_t* p, size_t n) {
+    constexpr size_t kLong = 8192, kShort = 256;
+    static const Crc32cShift longShift(kLong), shortShift(kShort);
+    uint64_t c0 = ~crc;
+    for (; n && (uintptr_t(p) & 7); --n) c0 = _mm_crc32_u8(uint32_t(c0), *p++);
+    auto threeWay = [&](size_t len, const Crc32cShift& shift) {
+        while (n >= 3 * len) {
+            uint64_t c1 = 0, c2 = 0;
+            for (const uint8_t* end = p + len; p < end; p += 8) {
+                uint64_t a, b, c;
+                memcpy(&a, p, 8);
+                memcpy(&b, p + len, 8);
+                memcpy(&c, p + 2 * len, 8);
+                c0 = _mm_crc32_u64(c0, a);
+                c1 = _mm_crc32_u64(c1, b);
+                c2 = _mm_crc32_u64(c2, c);
+            }
+            c0 = shift(uint32_t(c0)) ^ uint32_t(c1);
+            c0 = shift(uint32_t(c0)) ^ uint32_t(c2);
+            p += 2 * len;
+            n -= 3 * len;
+        }
+    };
+    threeWay(kLong, longShift);
+    threeWay(kShort, shortShift);
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c0 = _mm_crc32_u64(c0, v);
+    }
+    for (; n; --n) c0 = _mm_crc32_u8(uint32_t(c0), *p++);
+    return ~uint32_t(c0);
+}
+#endif
+
+static uint32_t Crc32cUpdate(uint32_t crc, const uint8_t* p, size_t n) {
+#if defined(_M_X64) || defined(__x86_64__)
+    static const bool hard = IsProcessorFeaturePresent(PF_SSE4_2_INSTRUCTIONS_AVAILABLE) != FALSE;
+    if (hard) return Crc32cHard(crc, p, n);
+#endif
+    return Crc32cSoft(crc, p, n);
+}
+
+// ---------- XXH3-128 ----------
+// XXH3 128-bit with the default secret and seed, streamed the same way as
+// xxhash's XXH3_128bits_update so the result matches `xxhsum -H2`. Stripes
+// are accumulated with AVX2 when the CPU has it, otherwise with SSE2 (plain
+// C off x64).
+static const uint8_t kXxhSecret[192] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+static constexpr uint64_t kXxhP32_1 = 0x9E3779B1u, kXxhP32_2 = 0x85EBCA77u, kXxhP32_3 = 0xC2B2AE3Du;
+static constexpr uint64_t kXxhP64_1 = 0x9E3779B185EBCA87ull, kXxhP64_2 = 0xC2B2AE3D27D4EB4Full,
+                          kXxhP64_3 = 0x165667B19E3779F9ull, kXxhP64_4 = 0x85EBCA77C2B2AE63ull,
+                          kXxhP64_5 = 0x27D4EB2F165667C5ull;
+
+static uint32_t Le32(const uint8_t* p) { uint32_t v; memcpy(&v, p, 4); return v; }
+static uint64_t Le64(const uint8_t* p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static uint32_t Swap32(uint32_t v) { return (v >> 24) | ((v >> 8) & 0xFF00) | ((v << 8) & 0xFF0000) | (v << 24); }
+static uint64_t Swap64(uint64_t v) { return (uint64_t(Swap32(uint32_t(v))) << 32) | Swap32(uint32_t(v >> 32)); }
+
+struct U128 { uint64_t lo, hi; };
+static U128 Mul64To128(uint64_t a, uint64_t b) {
+#if defined(_M_X64)
+    U128 r;
+    r.lo = _umul128(a, b, &r.hi);
+    return r;
+#else
+    const uint64_t lolo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF), hilo = (a >> 32) * (b & 0xFFFFFFFF);
+    const uint64_t lohi = (a & 0xFFFFFFFF) * (b >> 32), hihi = (a >> 32) * (b >> 32);
+    const uint64_t cross = (lolo >> 32) + (hilo & 0xFFFFFFFF) + lohi;
+    return { (cross << 32) | (lolo & 0xFFFFFFFF), (hilo >> 32) + (cross >> 32) + hihi };
+#endif
+}
+static uint64_t Mul128Fold64(uint64_t a, uint64_t b) { U128 r = Mul64To128(a, b); return r.lo ^ r.hi; }
+static uint64_t Xxh64Avalanche(uint64_t h) {
+    h ^= h >> 33; h *= kXxhP64_2;
+    h ^= h >> 29; h *= kXxhP64_3;
+    return h ^ (h >> 32);
+}
+static uint64_t Xxh3Avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ull;
+    return h ^ (h >> 32);
+}
+
+// One 64-byte stripe into the eight accumulators, and the per-block scramble.
+using XxhAccumulate = void (*)(uint64_t* acc, const uint8_t* in, const uint8_t* secret);
+using XxhScramble = void (*)(uint64_t* acc, const uint8_t* secret);
+#if defined(_M_X64) || defined(__x86_64__)
+static void XxhAccumulateSse2(uint64_t* acc, const uint8_t* in, const uint8_t* secret) {
+    for (int i = 0; i < 4; ++i) {
+        __m128i* a = reinterpret_cast<__m128i*>(acc) + i;
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in) + i);
+        const __m128i k = _mm_xor_si128(v, _mm_loadu_si128(reinterpret_cast<const __m128i*>(secret) + i));
+        const __m128i product = _mm_mul_epu32(k, _mm_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1)));
+        const __m128i sum = _mm_add_epi64(_mm_load_si128(a), _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+        _mm_store_si128(a, _mm_add_epi64(product, sum));
+    }
+}
+static void XxhScrambleSse2(uint64_t* acc, const uint8_t* secret) {
+    const __m128i prime = _mm_set1_epi32(int(kXxhP32_1));
+    for (int i = 0; i < 4; ++i) {
+        __m128i* a = reinterpret_cast<__m128i*>(acc) + i;
+        __m128i v = _mm_load_si128(a);
+        v = _mm_xor_si128(_mm_xor_si128(v, _mm_srli_epi64(v, 47)),
+                          _mm_loadu_si128(reinterpret_cast<const __m128i*>(secret) + i));
+        const __m128i lo = _mm_mul_epu32(v, prime);
+        const __m128i hi = _mm_mul_epu32(_mm_shuffle_epi32(v, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+        _mm_store_si128(a, _mm_add_epi64(lo, _mm_slli_epi64(hi, 32)));
+    }
+}
+static void XxhAccumulateAvx2(uint64_t* acc, const uint8_t* in, const uint8_t* secret) {
+    for (int i = 0; i < 2; ++i) {
+        __m256i* a = reinterpret_cast<__m256i*>(acc) + i;
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in) + i);
+        const __m256i k = _mm256_xor_si256(v, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(secret) + i));
+        const __m256i product = _mm256_mul_epu32(k, _mm256_srli_epi64(k, 32));
+        const __m256i sum = _mm256_add_epi64(_mm256_load_si256(a), _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+        _mm256_store_si256(a, _mm256_add_epi64(product, sum));
+    }
+}
+static void XxhScrambleAvx2(uint64_t* acc, const uint8_t* secret) {
+    const __m256i prime = _mm256_set1_epi32(int(kXxhP32_1));
+    for (int i = 0; i < 2; ++i) {
+        __m256i* a = reinterpret_cast<__m256i*>(acc) + i;
+        __m256i v = _mm256_load_si256(a);
+        v = _mm256_xor_si256(_mm256_xor_si256(v, _mm256_srli_epi64(v, 47)),
+                             _mm256_loadu_si256(reinterpret_cast<const __m256i*>(secret) + i));
+        const __m256i lo = _mm256_mul_epu32(v, prime);
+        const __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(v, 32), prime);
+        _mm256_store_si256(a, _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32)));
+    }
+}
+#endif
+// The reference the vector kernels are checked against (SelfTest), and the
+// kernels off x64.
+static void XxhAccumulateScalar(uint64_t* acc, const uint8_t* in, const uint8_t* secret) {
+    for (int i = 0; i < 8; ++i) {
+        const uint64_t v = Le64(in + 8 * i), k = v ^ Le64(secret + 8 * i);
+        acc[i ^ 1] += v;
+        acc[i] += (k & 0xFFFFFFFF) * (k >> 32);
+    }
+}
+static void XxhScrambleScalar(uint64_t* acc, const uint8_t* secret) {
+    for (int i = 0; i < 8; ++i) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= Le64(secret + 8 * i);
+        acc[i] = a * kXxhP32_1;
+    }
+}
+struct XxhKernels { XxhAccumulate accumulate; XxhScramble scramble; };
+static const XxhKernels& Xxh3Kernels() {
+    static const XxhKernels k = [] {
+#if defined(_M_X64) || defined(__x86_64__)
+        if (IsProcessorFeaturePresent(PF_AVX2_INSTRUCTIONS_AVAILABLE)) return XxhKernels{ XxhAccumulateAvx2, XxhScrambleAvx2 };
+        return XxhKernels{ XxhAccumulateSse2, XxhScrambleSse2 };
+#else
+        return XxhKernels{ XxhAccumulateScalar, XxhScrambleScalar };
+#endif
+    }();
+    return k;
+}
+
+class Xxh3Hasher {
+public:
+    explicit Xxh3Hasher(const XxhKernels& kernels = Xxh3Kernels()) : m_kernels(kernels) {}
+    void Update(const uint8_t* p, size_t n) {
+        m_total += n;
+        if (n <= kBuffer - m_buffered) { // still fits: wait for more
+            memcpy(m_buf + m_buffered, p, n);
+            m_buffered += n;
+            return;
+        }
+        const uint8_t* end = p + n;
+        if (m_buffered) {
+            const size_t take = kBuffer - m_buffered;
+            memcpy(m_buf + m_buffered, p, take);
+            p += take;
+            Consume(m_kernels, m_acc, m_stripes, m_buf, kBuffer / kStripe);
+            m_buffered = 0;
+        }
+        if (size_t(end - p) > kBuffer) {
+            p = Consume(m_kernels, m_acc, m_stripes, p, size_t(end - 1 - p) / kStripe);
+            memcpy(m_buf + kBuffer - kStripe, p - kStripe, kStripe); // the last stripe, for Final
+        }
+        memcpy(m_buf, p, size_t(end - p)); // never empty: the last stripe is consumed by Final
+        m_buffered = size_t(end - p);
+    }
+    // Canonical form: high half then low half, big-endian.
+    std::array<uint8_t, 16> Final() const {
+        const U128 h = m_total > kMidMax ? FinalLong() : Short(m_buf, size_t(m_total));
+        std::array<uint8_t, 16> out;
+        for (int i = 0; i < 8; ++i) {
+            out[i] = uint8_t(h.hi >> (56 - 8 * i));
+            out[8 + i] = uint8_t(h.lo >> (56 - 8 * i));
+        }
+        return out;
+    }
+
+private:
+    static constexpr size_t kStripe = 64, kBuffer = 256, kMidMax = 240;
+    static constexpr size_t kSecretLimit = sizeof(kXxhSecret) - kStripe;
+    static constexpr size_t kStripesPerBlock = kSecretLimit / 8;
+
+    static const uint8_t* Consume(const XxhKernels& k, uint64_t* acc, size_t& soFar, const uint8_t* in, size_t stripes) {
+        const uint8_t* secret = kXxhSecret + soFar * 8;
+        if (stripes >= kStripesPerBlock - soFar) {
+            size_t now = kStripesPerBlock - soFar;
+            do {
+                for (size_t s = 0; s < now; ++s) k.accumulate(acc, in + s * kStripe, secret + s * 8);
+                k.scramble(acc, kXxhSecret + kSecretLimit);
+                in += now * kStripe;
+                stripes -= now;
+                now = kStripesPerBlock;
+                secret = kXxhSecret;
+            } while (stripes >= kStripesPerBlock);
+            soFar = 0;
+        }
+        for (size_t s = 0; s < stripes; ++s) k.accumulate(acc, in + s * kStripe, secret + s * 8);
+        soFar += stripes;
+        return in + stripes * kStripe;
+    }
+    static uint64_t MergeAccs(const uint64_t* acc, const uint8_t* secret, uint64_t start) {
+        for (int i = 0; i < 4; ++i)
+            start += Mul128Fold64(acc[2 * i] ^ Le64(secret + 16 * i), acc[2 * i + 1] ^ Le64(secret + 16 * i + 8));
+        return Xxh3Avalanche(start);
+    }
+    U128 FinalLong() const {
+        alignas(32) uint64_t acc[8];
+        memcpy(acc, m_acc, sizeof(acc));
+        uint8_t tail[kStripe];
+        const uint8_t* last;
+        if (m_buffered >= kStripe) {
+            size_t soFar = m_stripes;
+            Consume(m_kernels, acc, soFar, m_buf, (m_buffered - 1) / kStripe);
+            last = m_buf + m_buffered - kStripe;
+        } else {
+            const size_t catchup = kStripe - m_buffered;
+            memcpy(tail, m_buf + kBuffer - catchup, catchup);
+            memcpy(tail + catchup, m_buf, m_buffered);
+            last = tail;
+        }
+        m_kernels.accumulate(acc, last, kXxhSecret + kSecretLimit - 7);
+        return { MergeAccs(acc, kXxhSecret + 11, m_total * kXxhP64_1),
+                 MergeAccs(acc, kXxhSecret + sizeof(kXxhSecret) - 64 - 11, ~(m_total * kXxhP64_2)) };
+    }
+
+    static uint64_t Mix16(const uint8_t* in, const uint8_t* secret) {
+        return Mul128Fold64(Le64(in) ^ Le64(secret), Le64(in + 8) ^ Le64(secret + 8));
+    }
+    static void Mix32(U128& acc, const uint8_t* a, const uint8_t* b, const uint8_t* secret) {
+        acc.lo += Mix16(a, secret);
+        acc.lo ^= Le64(b) + Le64(b + 8);
+        acc.hi += Mix16(b, secret + 16);
+        acc.hi ^= Le64(a) + Le64(a + 8);
+    }
+    static U128 FinishMid(const U128& acc, size_t len) {
+        const uint64_t lo = acc.lo + acc.hi;
+        const uint64_t hi = acc.lo * kXxhP64_1 + acc.hi * kXxhP64_4 + uint64_t(len) * kXxhP64_2;
+        return { Xxh3Avalanche(lo), 0 - Xxh3Avalanche(hi) };
+    }
+    // Inputs up to 240 bytes, hashed in one go.
+    static U128 Short(const uint8_t* in, size_t len) {
+        const uint8_t* s = kXxhSecret;
+        if (len == 0)
+            return { Xxh64Avalanche(Le64(s + 64) ^ Le64(s + 72)), Xxh64Avalanche(Le64(s + 80) ^ Le64(s + 88)) };
+        if (len <= 3) {
+            const uint32_t lo = (uint32_t(in[0]) << 16) | (uint32_t(in[len >> 1]) << 24) | in[len - 1] | (uint32_t(len) << 8);
+            const uint32_t sw = Swap32(lo), hi = (sw << 13) | (sw >> 19);
+            return { Xxh64Avalanche(lo ^ uint64_t(Le32(s) ^ Le32(s + 4))),
+                     Xxh64Avalanche(hi ^ uint64_t(Le32(s + 8) ^ Le32(s + 12))) };
+        }
+        if (len <= 8) {
+            const uint64_t v = Le32(in) + (uint64_t(Le32(in + len - 4)) << 32);
+            U128 m = Mul64To128(v ^ (Le64(s + 16) ^ Le64(s + 24)), kXxhP64_1 + (uint64_t(len) << 2));
+            m.hi += m.lo << 1;
+            m.lo ^= m.hi >> 3;
+            m.lo ^= m.lo >> 35;
+            m.lo *= 0x9FB21C651E98DF25ull;
+            m.lo ^= m.lo >> 28;
+            m.hi = Xxh3Avalanche(m.hi);
+            return m;
+        }
+        if (len <= 16) {
+            const uint64_t flipLo = Le64(s + 32) ^ Le64(s + 40), flipHi = Le64(s + 48) ^ Le64(s + 56);
+            const uint64_t lo = Le64(in);
+            uint64_t hi = Le64(in + len - 8);
+            U128 m = Mul64To128(lo ^ hi ^ flipLo, kXxhP64_1);
+            m.lo += uint64_t(len - 1) << 54;
+            hi ^= flipHi;
+            m.hi += hi + uint64_t(uint32_t(hi)) * (kXxhP32_2 - 1);
+            m.lo ^= Swap64(m.hi);
+            U128 h = Mul64To128(m.lo, kXxhP64_2);
+            h.hi += m.hi * kXxhP64_2;
+            return { Xxh3Avalanche(h.lo), Xxh3Avalanche(h.hi) };
+        }
+        U128 acc{ uint64_t(len) * kXxhP64_1, 0 };
+        if (len <= 128) {
+            if (len > 32) {
+                if (len > 64) {
+                    if (len > 96) Mix32(acc, in + 48, in + len - 64, s + 96);
+                    Mix32(acc, in + 32, in + len - 48, s + 64);
+                }
+                Mix32(acc, in + 16, in + len - 32, s + 32);
+            }
+            Mix32(acc, in, in + len - 16, s);
+            return FinishMid(acc, len);
+        }
+        for (size_t i = 32; i < 160; i += 32) Mix32(acc, in + i - 32, in + i - 16, s + i - 32);
+        acc.lo = Xxh3Avalanche(acc.lo);
+        acc.hi = Xxh3Avalanche(acc.hi);
+        for (size_t i = 160; i <= len; i += 32) Mix32(acc, in + i - 32, in + i - 16, s + 3 + i - 160);
+        Mix32(acc, in + len - 16, in + len - 32, s + 136 - 17 - 16);
+        return FinishMid(acc, len);
+    }
+
+    XxhKernels m_kernels;
+    alignas(32) uint64_t m_acc[8] = { kXxhP32_3, kXxhP64_1, kXxhP64_2, kXxhP64_3, kXxhP64_4, kXxhP32_2, kXxhP64_5, kXxhP32_1 };
+    uint8_t m_buf[kBuffer];
+    size_t m_buffered{ 0 };
+    size_t m_stripes{ 0 }; // stripes into the current block
+    uint64_t m_total{ 0 };
+};
+
+// ---------- BLAKE3 ----------
+// BLAKE3-256 (unkeyed). Whole 1 KB chunks are compressed four at a time, one
+// per SSE2 lane; a large update is split into power-of-two subtrees that are
+// hashed in parallel on the executor, so one big file uses every core. Partial
+// chunks and the chaining-value stack follow the reference implementation.
+using Blake3Cv = std::array<uint32_t, 8>;
+static const uint32_t kBlake3IV[8] = { 0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+                                       0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19 };
+static constexpr uint32_t kBlake3ChunkStart = 1, kBlake3ChunkEnd = 2, kBlake3Parent = 4, kBlake3Root = 8;
+static constexpr size_t kBlake3Block = 64, kBlake3Chunk = 1024;
+
+// Message word order for each of the seven rounds.
+struct Blake3Schedule {
+    uint8_t s[7][16];
+    Blake3Schedule() {
+        static const uint8_t perm[16] = { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 };
+        for (int i = 0; i < 16; ++i) s[0][i] = uint8_t(i);
+        for (int r = 1; r < 7; ++r)
+            for (int i = 0; i < 16; ++i) s[r][i] = s[r - 1][perm[i]];
+    }
+};
+static const Blake3Schedule kBlake3Schedule;
+
+static uint32_t Rotr32(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+static void Blake3Compress(const uint32_t cv[8], const uint8_t block[kBlake3Block], uint64_t counter,
+                           uint32_t len, uint32_t flags, uint32_t out[8]) {
+    uint32_t m[16], v[16];
+    for (int i = 0; i < 16; ++i) m[i] = Le32(block + 4 * i);
+    for (int i = 0; i < 8; ++i) v[i] = cv[i];
+    for (int i = 0; i < 4; ++i) v[8 + i] = kBlake3IV[i];
+    v[12] = uint32_t(counter);
+    v[13] = uint32_t(counter >> 32);
+    v[14] = len;
+    v[15] = flags;
+    auto g = [&](int a, int b, int c, int d, uint32_t x, uint32_t y) {
+        v[a] += v[b] + x; v[d] = Rotr32(v[d] ^ v[a], 16);
+        v[c] += v[d];     v[b] = Rotr32(v[b] ^ v[c], 12);
+        v[a] += v[b] + y; v[d] = Rotr32(v[d] ^ v[a], 8);
+        v[c] += v[d];     v[b] = Rotr32(v[b] ^ v[c], 7);
+    };
+    for (const auto& s : kBlake3Schedule.s) {
+        g(0, 4, 8, 12, m[s[0]], m[s[1]]);
+        g(1, 5, 9, 13, m[s[2]], m[s[3]]);
+        g(2, 6, 10, 14, m[s[4]], m[s[5]]);
+        g(3, 7, 11, 15, m[s[6]], m[s[7]]);
+        g(0, 5, 10, 15, m[s[8]], m[s[9]]);
+        g(1, 6, 11, 12, m[s[10]], m[s[11]]);
+        g(2, 7, 8, 13, m[s[12]], m[s[13]]);
+        g(3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+    for (int i = 0; i < 8; ++i) out[i] = v[i] ^ v[i + 8];
+}
+static Blake3Cv Blake3ParentCv(const Blake3Cv& left, const Blake3Cv& right, uint32_t flags = 0) {
+    uint8_t block[kBlake3Block];
+    memcpy(block, left.data(), 32);
+    memcpy(block + 32, right.data(), 32);
+    Blake3Cv out;
+    Blake3Compress(kBlake3IV, block, 0, kBlake3Block, kBlake3Parent | flags, out.data());
+    return out;
+}
+static Blake3Cv Blake3ChunkCv(const uint8_t* p, uint64_t counter) {
+    Blake3Cv cv;
+    memcpy(cv.data(), kBlake3IV, sizeof(kBlake3IV));
+    for (size_t b = 0; b < kBlake3Chunk / kBlake3Block; ++b) {
+        const uint32_t flags = (b == 0 ? kBlake3ChunkStart : 0) | (b == 15 ? kBlake3ChunkEnd : 0);
+        Blake3Compress(cv.data(), p + b * kBlake3Block, counter, kBlake3Block, flags, cv.data());
+    }
+    return cv;
+}
+
+#if defined(_M_X64) || defined(__SSE2__)
+// Four whole chunks (consecutive in memory, counters counter..counter+3), one per lane.
+template<int n> static __m128i Rotr4(__m128i x) { return _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - n)); }
+template<> __m128i Rotr4<16>(__m128i x) { return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xB1), 0xB1); }
+static void Blake3Chunks4(const uint8_t* p, uint64_t counter, Blake3Cv out[4]) {
+    __m128i h[8], m[16], v[16];
+    for (int i = 0; i < 8; ++i) h[i] = _mm_set1_epi32(int(kBlake3IV[i]));
+    const __m128i ctrLo = _mm_set_epi32(int(uint32_t(counter + 3)), int(uint32_t(counter + 2)),
+                                        int(uint32_t(counter + 1)), int(uint32_t(counter)));
+    const __m128i ctrHi = _mm_set_epi32(int(uint32_t((counter + 3) >> 32)), int(uint32_t((counter + 2) >> 32)),
+                                        int(uint32_t((counter + 1) >> 32)), int(uint32_t(counter >> 32)));
+    auto g = [&](int a, int b, int c, int d, __m128i x, __m128i y) {
+        v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), x); v[d] = Rotr4<16>(_mm_xor_si128(v[d], v[a]));
+        v[c] = _mm_add_epi32(v[c], v[d]);                   v[b] = Rotr4<12>(_mm_xor_si128(v[b], v[c]));
+        v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), y); v[d] = Rotr4<8>(_mm_xor_si128(v[d], v[a]));
+        v[c] = _mm_add_epi32(v[c], v[d]);                   v[b] = Rotr4<7>(_mm_xor_si128(v[b], v[c]));
+    };
+    for (size_t b = 0; b < kBlake3Chunk / kBlake3Block; ++b) {
+        // Transpose: m[w] holds word w of this block from each of the four chunks.
+        for (int q = 0; q < 4; ++q) {
+            const size_t off = b * kBlake3Block + 16 * q;
+            const __m128i r0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + off));
+            const __m128i r1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + kBlake3Chunk + off));
+            const __m128i r2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 2 * kBlake3Chunk + off));
+            const __m128i r3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 3 * kBlake3Chunk + off));
+            const __m128i t0 = _mm_unpacklo_epi32(r0, r1), t1 = _mm_unpacklo_epi32(r2, r3);
+            const __m128i t2 = _mm_unpackhi_epi32(r0, r1), t3 = _mm_unpackhi_epi32(r2, r3);
+            m[4 * q] = _mm_unpacklo_epi64(t0, t1);
+            m[4 * q + 1] = _mm_unpackhi_epi64(t0, t1);
+            m[4 * q + 2] = _mm_unpacklo_epi64(t2, t3);
+            m[4 * q + 3] = _mm_unpackhi_epi64(t2, t3);
+        }
+        const uint32_t flags = (b == 0 ? kBlake3ChunkStart : 0) | (b == 15 ? kBlake3ChunkEnd : 0);
+        for (int i = 0; i < 8; ++i) v[i] = h[i];
+        for (int i = 0; i < 4; ++i) v[8 + i] = _mm_set1_epi32(int(kBlake3IV[i]));
+        v[12] = ctrLo;
+        v[13] = ctrHi;
+        v[14] = _mm_set1_epi32(int(kBlake3Block));
+        v[15] = _mm_set1_epi32(int(flags));
+        for (const auto& s : kBlake3Schedule.s) {
+            g(0, 4, 8, 12, m[s[0]], m[s[1]]);
+            g(1, 5, 9, 13, m[s[2]], m[s[3]]);
+            g(2, 6, 10, 14, m[s[4]], m[s[5]]);
+            g(3, 7, 11, 15, m[s[6]], m[s[7]]);
+            g(0, 5, 10, 15, m[s[8]], m[s[9]]);
+            g(1, 6, 11, 12, m[s[10]], m[s[11]]);
+            g(2, 7, 8, 13, m[s[12]], m[s[13]]);
+            g(3, 4, 9, 14, m[s[14]], m[s[15]]);
+        }
+        for (int i = 0; i < 8; ++i) h[i] = _mm_xor_si128(v[i], v[i + 8]);
+    }
+    alignas(16) uint32_t lanes[8][4];
+    for (int i = 0; i < 8; ++i) _mm_store_si128(reinterpret_cast<__m128i*>(lanes[i]), h[i]);
+    for (int l = 0; l < 4; ++l)
+        for (int i = 0; i < 8; ++i) out[l][i] = lanes[i][l];
+}
+#endif
+
+// Chaining value of a complete subtree of `chunks` whole chunks (a power of two).
+static Blake3Cv Blake3SubtreeCv(const uint8_t* p, size_t chunks, uint64_t counter) {
+    constexpr size_t kMax = 64;
+    if (chunks > kMax) {
+        const size_t half = chunks / 2;
+        return Blake3ParentCv(Blake3SubtreeCv(p, half, counter),
+                              Blake3SubtreeCv(p + half * kBlake3Chunk, half, counter + half));
+    }
+    Blake3Cv cvs[kMax];
+    size_t i = 0;
+#if defined(_M_X64) || defined(__SSE2__)
+    for (; i + 4 <= chunks; i += 4) Blake3Chunks4(p + i * kBlake3Chunk, counter + i, cvs + i);
+#endif
+    for (; i < chunks; ++i) cvs[i] = Blake3ChunkCv(p + i * kBlake3Chunk, counter + i);
+    for (size_t n = chunks; n > 1; n /= 2)
+        for (size_t k = 0; k < n / 2; ++k) cvs[k] = Blake3ParentCv(cvs[2 * k], cvs[2 * k + 1]);
+    return cvs[0];
+}
+
+class Blake3Hasher {
+public:
+    void Update(const uint8_t* p, size_t n) {
+        if (m_chunkLen) {
+            const size_t take = std::min(kBlake3Chunk - m_chunkLen, n);
+            ChunkUpdate(p, take);
+            p += take;
+            n -= take;
+            if (!n) return; // this chunk may still be the root
+            PushCv(ChunkOutput().Cv(), m_counter);
+            ResetChunk(m_counter + 1);
+        }
+        while (n > kBlake3Chunk) {
+            size_t len = kBlake3Chunk;
+            while (len * 2 <= n) len *= 2;
+            while ((uint64_t(len / kBlake3Chunk) - 1) & m_counter) len /= 2; // keep subtrees aligned
+            const size_t chunks = len / kBlake3Chunk;
+            if (chunks == 1) {
+                PushCv(Blake3ChunkCv(p, m_counter), m_counter);
+            } else {
+                // Both halves go on the stack: the subtree itself could turn out to be the root.
+                Blake3Cv halves[2];
+                SubtreeHalves(p, chunks, m_counter, halves);
+                PushCv(halves[0], m_counter);
+                PushCv(halves[1], m_counter + chunks / 2);
+            }
+            m_counter += chunks;
+            p += len;
+            n -= len;
+        }
+        if (n) {
+            ChunkUpdate(p, n);
+            MergeStack(m_counter);
+        }
+    }
+    std::array<uint8_t, 32> Final() const {
+        Output out;
+        size_t left = m_stack.size();
+        if (left == 0 || m_chunkLen) {
+            out = ChunkOutput();
+        } else {
+            out = ParentOutput(m_stack[left - 2], m_stack[left - 1]);
+            left -= 2;
+        }
+        for (; left; --left) out = ParentOutput(m_stack[left - 1], out.Cv());
+        Blake3Cv root;
+        Blake3Compress(out.cv.data(), out.block, 0, out.len, out.flags | kBlake3Root, root.data());
+        std::array<uint8_t, 32> digest;
+        memcpy(digest.data(), root.data(), digest.size());
+        return digest;
+    }
+
+private:
+    // Everything but the last compression of a node, which differs for the root.
+    struct Output {
+        Blake3Cv cv;
+        uint8_t block[kBlake3Block];
+        uint64_t counter;
+        uint32_t len, flags;
+        Blake3Cv Cv() const { Blake3Cv r; Blake3Compress(cv.data(), block, counter, len, flags, r.data()); return r; }
+    };
+    static Output ParentOutput(const Blake3Cv& left, const Blake3Cv& right) {
+        Output o;
+        memcpy(o.cv.data(), kBlake3IV, sizeof(kBlake3IV));
+        memcpy(o.block, left.data(), 32);
+        memcpy(o.block + 32, right.data(), 32);
+        o.counter = 0;
+        o.len = kBlake3Block;
+        o.flags = kBlake3Parent;
+        return o;
+    }
+    // Splits into pieces hashed on the executor, then reduces to the two halves.
+    static void SubtreeHalves(const uint8_t* p, size_t chunks, uint64_t counter, Blake3Cv halves[2]) {
+        constexpr size_t kPiece = 64; // chunks per task: 64 KB
+        const size_t piece = std::min(chunks / 2, kPiece), count = chunks / piece;
+        std::vector<Blake3Cv> cvs(count);
+        auto one = [&](size_t i) { cvs[i] = Blake3SubtreeCv(p + i * piece * kBlake3Chunk, piece, counter + i * piece); };
+        if (count > 2) ParallelFor(count, one);
+        else for (size_t i = 0; i < count; ++i) one(i);
+        for (size_t n = count; n > 2; n /= 2)
+            for (size_t k = 0; k < n / 2; ++k) cvs[k] = Blake3ParentCv(cvs[2 * k], cvs[2 * k + 1]);
+        halves[0] = cvs[0];
+        halves[1] = cvs[1];
+    }
+
+    void ResetChunk(uint64_t counter) {
+        memcpy(m_cv.data(), kBlake3IV, sizeof(kBlake3IV));
+        m_counter = counter;
+        m_chunkLen = 0;
+        m_blockLen = 0;
+    }
+    uint32_t StartFlag() const { return m_chunkLen <= kBlake3Block ? kBlake3ChunkStart : 0; }
+    void ChunkUpdate(const uint8_t* p, size_t n) {
+        while (n) {
+            if (m_blockLen == kBlake3Block) { // full and more follows: not the chunk's last block
+                Blake3Compress(m_cv.data(), m_block, m_counter, kBlake3Block, StartFlag(), m_cv.data());
+                m_blockLen = 0;
+            }
+            const size_t take = std::min(kBlake3Block - m_blockLen, n);
+            memcpy(m_block + m_blockLen, p, take);
+            m_blockLen += take;
+            m_chunkLen += take;
+            p += take;
+            n -= take;
+        }
+    }
+    Output ChunkOutput() const {
+        Output o;
+        o.cv = m_cv;
+        memset(o.block, 0, sizeof(o.block));
+        memcpy(o.block, m_block, m_blockLen);
+        o.counter = m_counter;
+        o.len = uint32_t(m_blockLen);
+        o.flags = StartFlag() | kBlake3ChunkEnd;
+        return o;
+    }
+    // The stack holds one entry per set bit of the chunk count once merged.
+    void MergeStack(uint64_t total) {
+        size_t keep = 0;
+        for (uint64_t t = total; t; t &= t - 1) ++keep;
+        while (m_stack.size() > keep) {
+            Blake3Cv right = m_stack.back();
+            m_stack.pop_back();
+            m_stack.back() = Blake3ParentCv(m_stack.back(), right);
+        }
+    }
+    void PushCv(const Blake3Cv& cv, uint64_t counter) {
+        MergeStack(counter);
+        m_stack.push_back(cv);
+    }
+
+    Blake3Cv m_cv{ { kBlake3IV[0], kBlake3IV[1], kBlake3IV[2], kBlake3IV[3],
+                     kBlake3IV[4], kBlake3IV[5], kBlake3IV[6], kBlake3IV[7] } };
+    uint8_t m_block[kBlake3Block]{};
+    size_t m_blockLen{ 0 }, m_chunkLen{ 0 };
+    uint64_t m_counter{ 0 };
+    std::vector<Blake3Cv> m_stack;
+};
+
+// ---------- BLAKE2sp ----------
+// BLAKE2sp-256 as used by 7-Zip (and RAR5): eight BLAKE2s leaves take the
+// 64-byte blocks of the input round-robin and a root BLAKE2s hashes their
+// digests. The leaves advance in lockstep, so with AVX2 one 512-byte stripe
+// is a single eight-lane compression, one leaf per lane.
+static const uint32_t kBlake2sIV[8] = { 0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+                                        0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19 };
+static const uint8_t kBlake2sSigma[10][16] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 }, { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+    { 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 }, { 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
+    { 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 }, { 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
+    { 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 }, { 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
+    { 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 }, { 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 },
+};
+static void Blake2sCompress(uint32_t h[8], const uint8_t block[64], uint64_t t, bool last, bool lastNode) {
+    uint32_t m[16], v[16];
+    for (int i = 0; i < 16; ++i) m[i] = Le32(block + 4 * i);
+    for (int i = 0; i < 8; ++i) { v[i] = h[i]; v[8 + i] = kBlake2sIV[i]; }
+    v[12] ^= uint32_t(t);
+    v[13] ^= uint32_t(t >> 32);
+    if (last) v[14] = ~v[14];
+    if (lastNode) v[15] = ~v[15];
+    auto g = [&](int a, int b, int c, int d, uint32_t x, uint32_t y) {
+        v[a] += v[b] + x; v[d] = Rotr32(v[d] ^ v[a], 16);
+        v[c] += v[d];     v[b] = Rotr32(v[b] ^ v[c], 12);
+        v[a] += v[b] + y; v[d] = Rotr32(v[d] ^ v[a], 8);
+        v[c] += v[d];     v[b] = Rotr32(v[b] ^ v[c], 7);
+    };
+    for (const auto& s : kBlake2sSigma) {
+        g(0, 4, 8, 12, m[s[0]], m[s[1]]);
+        g(1, 5, 9, 13, m[s[2]], m[s[3]]);
+        g(2, 6, 10, 14, m[s[4]], m[s[5]]);
+        g(3, 7, 11, 15, m[s[6]], m[s[7]]);
+        g(0, 5, 10, 15, m[s[8]], m[s[9]]);
+        g(1, 6, 11, 12, m[s[10]], m[s[11]]);
+        g(2, 7, 8, 13, m[s[12]], m[s[13]]);
+        g(3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+    for (int i = 0; i < 8; ++i) h[i] ^= v[i] ^ v[i + 8];
+}
+
+#if defined(_M_X64) || defined(__x86_64__)
+// One whole stripe, not the last block of any leaf: lane j takes the 64 bytes at j*64.
+template<int n> static __m256i Rotr8(__m256i x) { return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n)); }
+static void Blake2sStripeAvx2(uint32_t h[8][8], const uint8_t* stripe, uint64_t t) {
+    const __m256i index = _mm256_setr_epi32(0, 64, 128, 192, 256, 320, 384, 448);
+    const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                           2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12,
+                                          1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+    __m256i m[16], v[16], hv[8];
+    for (int w = 0; w < 16; ++w) m[w] = _mm256_i32gather_epi32(reinterpret_cast<const int*>(stripe + 4 * w), index, 1);
+    for (int i = 0; i < 8; ++i) {
+        hv[i] = _mm256_setr_epi32(int(h[0][i]), int(h[1][i]), int(h[2][i]), int(h[3][i]),
+                                  int(h[4][i]), int(h[5][i]), int(h[6][i]), int(h[7][i]));
+        v[i] = hv[i];
+        v[8 + i] = _mm256_set1_epi32(int(kBlake2sIV[i]));
+    }
+    v[12] = _mm256_xor_si256(v[12], _mm256_set1_epi32(int(uint32_t(t))));
+    v[13] = _mm256_xor_si256(v[13], _mm256_set1_epi32(int(uint32_t(t >> 32))));
+    auto g = [&](int a, int b, int c, int d, __m256i x, __m256i y) {
+        v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), x); v[d] = _mm256_shuffle_epi8(_mm256_xor_si256(v[d], v[a]), rot16);
+        v[c] = _mm256_add_epi32(v[c], v[d]);                      v[b] = Rotr8<12>(_mm256_xor_si256(v[b], v[c]));
+        v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), y); v[d] = _mm256_shuffle_epi8(_mm256_xor_si256(v[d], v[a]), rot8);
+        v[c] = _mm256_add_epi32(v[c], v[d]);                      v[b] = Rotr8<7>(_mm256_xor_si256(v[b], v[c]));
+    };
+    for (const auto& s : kBlake2sSigma) {
+        g(0, 4, 8, 12, m[s[0]], m[s[1]]);
+        g(1, 5, 9, 13, m[s[2]], m[s[3]]);
+        g(2, 6, 10, 14, m[s[4]], m[s[5]]);
+        g(3, 7, 11, 15, m[s[6]], m[s[7]]);
+        g(0, 5, 10, 15, m[s[8]], m[s[9]]);
+        g(1, 6, 11, 12, m[s[10]], m[s[11]]);
+        g(2, 7, 8, 13, m[s[12]], m[s[13]]);
+        g(3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+    alignas(32) uint32_t lanes[8][8];
+    for (int i = 0; i < 8; ++i)
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes[i]), _mm256_xor_si256(hv[i], _mm256_xor_si256(v[i], v[i + 8])));
+    for (int j = 0; j < 8; ++j)
+        for (int i = 0; i < 8; ++i) h[j][i] = lanes[i][j];
+}
+#endif
+
+class Blake2spHasher {
+public:
+    Blake2spHasher() {
+        for (uint32_t j = 0; j < kLeaves; ++j) Init(m_h[j], j, 0);
+    }
+    void Update(const uint8_t* p, size_t n) {
+        if (m_len + n <= sizeof(m_buf)) {
+            memcpy(m_buf + m_len, p, n);
+            m_len += n;
+            return;
+        }
+        if (m_len) { // complete the buffered stripe(s); more than kSafe bytes follow the first
+            const size_t take = (m_len < kStripe ? kStripe : 2 * kStripe) - m_len;
+            memcpy(m_buf + m_len, p, take);
+            p += take;
+            n -= take;
+            Stripe(m_buf);
+            if (m_len + take == kStripe) {
+                m_len = 0;
+            } else if (n > kSafe - kStripe) {
+                Stripe(m_buf + kStripe);
+                m_len = 0;
+            } else {
+                memcpy(m_buf, m_buf + kStripe, kStripe);
+                m_len = kStripe;
+            }
+        }
+        if (m_len == 0)
+            for (; n > kSafe; p += kStripe, n -= kStripe) Stripe(p);
+        memcpy(m_buf + m_len, p, n);
+        m_len += n;
+    }
+    std::array<uint8_t, 32> Final() const {
+        uint8_t digests[kLeaves * 32];
+        for (uint32_t j = 0; j < kLeaves; ++j) {
+            uint32_t h[8];
+            memcpy(h, m_h[j], sizeof(h));
+            uint64_t t = m_stripes * kBlock;
+            size_t off = j * kBlock;
+            uint8_t block[kBlock]{};
+            size_t len = 0;
+            for (; off < m_len; off += kStripe) { // every piece but the leaf's last is whole
+                if (len) Blake2sCompress(h, block, t, false, false);
+                len = std::min(kBlock, m_len - off);
+                memset(block, 0, sizeof(block));
+                memcpy(block, m_buf + off, len);
+                t += len;
+            }
+            Blake2sCompress(h, block, t, true, j == kLeaves - 1);
+            memcpy(digests + 32 * j, h, 32);
+        }
+        uint32_t root[8];
+        Init(root, 0, 1);
+        for (uint32_t b = 0; b < 4; ++b) Blake2sCompress(root, digests + kBlock * b, kBlock * (b + 1), b == 3, b == 3);
+        std::array<uint8_t, 32> out;
+        memcpy(out.data(), root, out.size());
+        return out;
+    }
+
+private:
+    static constexpr uint32_t kLeaves = 8;
+    static constexpr size_t kBlock = 64, kStripe = kLeaves * kBlock;
+    // A stripe is compressed only when every leaf has data after it, i.e. more
+    // than seven blocks follow; the leaves' last blocks are left for Final.
+    static constexpr size_t kSafe = kStripe + (kLeaves - 1) * kBlock;
+
+    // Parameter block: 32-byte digest, fanout 8, depth 2, inner length 32.
+    static void Init(uint32_t h[8], uint32_t offset, uint32_t depth) {
+        memcpy(h, kBlake2sIV, sizeof(kBlake2sIV));
+        h[0] ^= 32u | (kLeaves << 16) | (2u << 24);
+        h[2] ^= offset;
+        h[3] ^= (depth << 16) | (32u << 24);
+    }
+    void Stripe(const uint8_t* p) {
+        const uint64_t t = (m_stripes + 1) * kBlock;
+#if defined(_M_X64) || defined(__x86_64__)
+        static const bool avx2 = IsProcessorFeaturePresent(PF_AVX2_INSTRUCTIONS_AVAILABLE) != FALSE;
+        if (avx2) { Blake2sStripeAvx2(m_h, p, t); ++m_stripes; return; }
+#endif
+        for (uint32_t j = 0; j < kLeaves; ++j) Blake2sCompress(m_h[j], p + j * kBlock, t, false, false);
+        ++m_stripes;
+    }
+
+    uint32_t m_h[kLeaves][8];
+    uint64_t m_stripes{ 0 };
+    uint8_t m_buf[2 * kStripe];
+    size_t m_len{ 0 };
+};
+
+// ---------- Streaming file hashes ----------
+// Whole-file digests on the pipeline: reader threads stream files into pooled
+// 1 MB blocks and hasher lanes consume them. Every block of a file goes to the
+// same lane (file index modulo lane count), so a lane sees them in order.
+// Results are kept in the shared cache keyed by path, size and mtime, so a
+// file is only read again once it changes.
+enum class HashKind : uint32_t { Crc32 = 1, Sha256, Crc32c, Xxh3, Blake3, Sha512, Blake2sp };
+struct HashState {
+    virtual ~HashState() = default;
+    virtual void Update(const uint8_t* p, size_t n) = 0;
+    virtual std::vector<uint8_t> Final() = 0; // digest bytes as 7z h prints them; empty on failure
+};
+
+struct Crc32State : HashState {
+    uint32_t crc{ 0 };
+    void Update(const uint8_t* p, size_t n) override { crc = Crc32Update(crc, p, n); }
+    std::vector<uint8_t> Final() override { return { uint8_t(crc >> 24), uint8_t(crc >> 16), uint8_t(crc >> 8), uint8_t(crc) }; }
+};
+// SHA-256/SHA-512 through CNG, which picks the SHA-NI/AVX2 code paths itself.
+struct CngState : HashState {
+    BCRYPT_HASH_HANDLE h{ nullptr };
+    size_t size;
+    bool ok;
+    CngState(BCRYPT_ALG_HANDLE alg, size_t digestSize) : size(digestSize) {
+        ok = alg && BCRYPT_SUCCESS(BCryptCreateHash(alg, &h, nullptr, 0, nullptr, 0, 0));
+    }
+    ~CngState() override { if (h) BCryptDestroyHash(h); }
+    void Update(const uint8_t* p, size_t n) override {
+        if (ok) ok = BCRYPT_SUCCESS(BCryptHashData(h, const_cast<uint8_t*>(p), ULONG(n), 0));
+    }
+    std::vector<uint8_t> Final() override {
+        std::vector<uint8_t> d(size);
+        if (!ok || !BCRYPT_SUCCESS(BCryptFinishHash(h, d.data(), ULONG(d.size()), 0))) d.clear();
+        return d;
+    }
+};
+struct Crc32cState : HashState {
+    uint32_t crc{ 0 };
+    void Update(const uint8_t* p, size_t n) override { crc = Crc32cUpdate(crc, p, n); }
+    std::vector<uint8_t> Final() override { return { uint8_t(crc >> 24), uint8_t(crc >> 16), uint8_t(crc >> 8), uint8_t(crc) }; }
+};
+// Xxh3Hasher, Blake3Hasher, Blake2spHasher.
+template<class H> struct HasherState : HashState {
+    H h;
+    void Update(const uint8_t* p, size_t n) override { h.Update(p, n); }
+    std::vector<uint8_t> Final() override { auto d = h.Final(); return { d.begin(), d.end() }; }
+};
+static std::unique_ptr<HashState> NewHash(HashKind kind) {
+    switch (kind) {
+    case HashKind::Crc32: return std::make_unique<Crc32State>();
+    case HashKind::Sha256: return std::make_unique<CngState>(Sha256Provider(), 32);
+    case HashKind::Sha512: return std::make_unique<CngState>(Sha512Provider(), 64);
+    case HashKind::Crc32c: return std::make_unique<Crc32cState>();
+    case HashKind::Xxh3: return std::make_unique<HasherState<Xxh3Hasher>>();
+    case HashKind::Blake3: return std::make_unique<HasherState<Blake3Hasher>>();
+    case HashKind::Blake2sp: return std::make_unique<HasherState<Blake2spHasher>>();
+    }
+    return nullptr;
+}
+// Column title, as `7z h` prints it.
+static const wchar_t* HashName(HashKind kind) {
+    switch (kind) {
+    case HashKind::Crc32: return L"CRC32";
+    case HashKind::Sha256: return L"SHA256";
+    case HashKind::Crc32c: return L"CRC32C";
+    case HashKind::Xxh3: return L"XXH128";
+    case HashKind::Blake3: return L"BLAKE3";
+    case HashKind::Sha512: return L"SHA512";
+    case HashKind::Blake2sp: return L"BLAKE2sp";
+    }
+    return L"";
+}
+
+struct FileDigest { std::vector<uint8_t> digest; bool ok{ false }; };
+static uint32_t DigestU32(const std::vector<uint8_t>& d) {
+    return d.size() < 4 ? 0 : (uint32_t(d[0]) << 24) | (uint32_t(d[1]) << 16) | (uint32_t(d[2]) << 8) | d[3];
+}
+
+static std::vector<FileDigest> HashFiles(const std::vector<std::wstring>& paths, HashKind kind) {
+    constexpr size_t kBlock = BufferPool::BlockSize();
+    std::vector<FileDigest> out(paths.size());
+    struct Stamp { uint64_t key, size, mtime; bool ok; };
+    std::vector<Stamp> stamps(paths.size());
+    ParallelFor(paths.size(), [&](size_t i) {
+        WIN32_FILE_ATTRIBUTE_DATA fad;
+        if (!GetFileAttributesExW(paths[i].c_str(), GetFileExInfoStandard, &fad)) return;
+        stamps[i] = { NameHashI(paths[i]), (uint64_t(fad.nFileSizeHigh) << 32) | fad.nFileSizeLow,
+                      FileTimeTicks(fad.ftLastWriteTime), true };
+        out[i].ok = SharedDigestGet(uint32_t(kind), stamps[i].key, stamps[i].size, stamps[i].mtime, out[i].digest);
+    });
+    std::vector<size_t> todo;
+    for (size_t i = 0; i < paths.size(); ++i) if (!out[i].ok) todo.push_back(i);
+    if (todo.empty()) return out;
+    const unsigned lanes = (unsigned)std::min<size_t>(WorkerCount(), todo.size());
+    const unsigned readers = (unsigned)std::min<size_t>(std::min(lanes, 4u), todo.size());
+
+    struct Block { size_t file; BufferPool::Buffer data; size_t size; bool last, failed; };
+    BufferPool pool(2 * size_t(readers + lanes));
+    std::vector<std::unique_ptr<Channel<Block>>> lane;
+    for (unsigned i = 0; i < lanes; ++i) lane.push_back(std::make_unique<Channel<Block>>(4));
+    std::atomic<size_t> nextFile{ 0 };
+    std::atomic<unsigned> nextLane{ 0 };
+
+    Pipeline pipe(L"hash " + std::to_wstring(todo.size()) + L" files");
+    pipe.Add(L"read", readers, [&](Pipeline::Stage& st) {
+        for (size_t n; (n = nextFile.fetch_add(1)) < todo.size(); ) {
+            const size_t f = todo[n];
+            HANDLE h = CreateFileW(paths[f].c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                   nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            bool ok = h != INVALID_HANDLE_VALUE, last = false;
+            while (!last) {
+                Block b{ f, pool.Acquire(), 0, false, false };
+                DWORD got = 0;
+                if (ok) ok = ReadFile(h, b.data.get(), DWORD(kBlock), &got, nullptr) != FALSE;
+                b.size = got;
+                b.failed = !ok;
+                b.last = last = !ok || got < kBlock; // a short read on a disk file is the end
+                st.Count(got);
+                lane[n % lanes]->Push(std::move(b));
+            }
+            if (h != INVALID_HANDLE_VALUE) CloseHandle(h);
+        }
+    }, [&] { for (auto& c : lane) c->Close(); });
+    pipe.Add(L"hash", lanes, [&](Pipeline::Stage& st) {
+        Channel<Block>& in = *lane[nextLane.fetch_add(1)];
+        std::unordered_map<size_t, std::unique_ptr<HashState>> open; // one per reader at most
+        Block b;
+        while (in.Pop(b)) {
+            auto& state = open[b.file];
+            if (!state) state = NewHash(kind);
+            state->Update(b.data.get(), b.size);
+            st.Count(b.size);
+            if (b.last) {
+                if (!b.failed) { out[b.file].digest = state->Final(); out[b.file].ok = !out[b.file].digest.empty(); }
+                open.erase(b.file);
+            }
+        }
+    });
+    for (auto& c : lane) pipe.Watch(L"hash lane", *c);
+    pipe.Wait();
+    for (size_t f : todo)
+        if (out[f].ok && stamps[f].ok) SharedDigestPut(uint32_t(kind), stamps[f].key, stamps[f].size, stamps[f].mtime, out[f].digest);
+    return out;
+}
+
+// ---------- Reports ----------
+// Writes text to %TEMP%\<name> (UTF-8 with BOM) and opens it in Notepad.
+static void ShowReport(const wchar_t* name, const std::wstring& text) {
+    wchar_t tmp[MAX_PATH]{};
+    GetTempPathW(MAX_PATH, tmp);
+    std::wstring file = Combine(tmp, name);
+    HANDLE f = CreateFileW(file.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (f == INVALID_HANDLE_VALUE) return;
+    std::string data = "\xEF\xBB\xBF" + ToUtf8(text);
+    DWORD written = 0;
+    WriteFile(f, data.data(), DWORD(data.size()), &written, nullptr);
+    CloseHandle(f);
+    ShellRun(L"notepad.exe", L"\"" + file + L"\"");
+}
+
+// ---------- Checksums ----------
+// In-process counterpart of `7z h`: same table layout, digests and "for data"
+// sum. Digests of up to 8 bytes are numbers (upper-case hex), longer ones
+// byte strings (lower-case); the sum adds the raw digests with carry.
+static std::wstring DigestHex(const std::vector<uint8_t>& d) {
+    static const wchar_t upper[] = L"0123456789ABCDEF", lower[] = L"0123456789abcdef";
+    const wchar_t* digits = d.size() <= 8 ? upper : lower;
+    std::wstring s;
+    for (uint8_t b : d) { s += digits[b >> 4]; s += digits[b & 15]; }
+    return s;
+}
+static void AddDigest(std::vector<uint8_t>& sum, std::vector<uint8_t> d) {
+    if (d.size() <= 8) std::reverse(d.begin(), d.end()); // numbers are summed little-endian
+    if (sum.empty()) sum.assign(d.size(), 0);
+    unsigned carry = 0;
+    for (size_t i = 0; i < d.size(); ++i) {
+        carry += unsigned(sum[i]) + d[i];
+        sum[i] = uint8_t(carry);
+        carry >>= 8;
+    }
+}
+static void ChecksumCommand(const PathArena& paths, HashKind kind) {
+    std::vector<FileRecord> files;
+    ScanFiles(paths, files);
+    std::vector<std::wstring> fullPaths;
+    for (auto& f : files) fullPaths.push_back(f.path);
+    auto digests = HashFiles(fullPaths, kind);
+
+    std::wstring base = paths.empty() ? L"" : std::filesystem::path(paths[0]).parent_path().wstring();
+    if (!base.empty() && base.back() != L'\\') base += L'\\';
+    const std::wstring name = HashName(kind);
+    size_t width = name.size();
+    for (auto& d : digests) width = std::max(width, d.digest.size() * 2);
+    auto pad = [](std::wstring s, size_t w, bool right) {
+        if (s.size() < w) s.insert(right ? 0 : s.size(), w - s.size(), L' ');
+        return s;
+    };
+    const std::wstring rule = std::wstring(width, L'-') + L" ------------- ------------\r\n";
+
+    std::wstring text = name + L" " + pad(L"Size", 13, true) + L"  Name\r\n" + rule, errors;
+    std::vector<uint8_t> sum;
+    uint64_t total = 0;
+    size_t hashed = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        const std::wstring& p = files[i].path;
+        std::wstring rel = p.compare(0, base.size(), base) == 0 ? p.substr(base.size()) : p;
+        if (!digests[i].ok) { errors += L"ERROR: cannot read " + p + L"\r\n"; continue; }
+        text += pad(DigestHex(digests[i].digest), width, false) + L" " + pad(std::to_wstring(files[i].size), 13, true) +
+                L"  " + rel + L"\r\n";
+        AddDigest(sum, digests[i].digest);
+        total += files[i].size;
+        ++hashed;
+    }
+    if (sum.size() <= 8) std::reverse(sum.begin(), sum.end());
+    text += rule + pad(DigestHex(sum), width, false) + L" " + pad(std::to_wstring(total), 13, true) + L"\r\n\r\n";
+    text += L"Files: " + std::to_wstring(hashed) + L"\r\nSize: " + std::to_wstring(total) + L"\r\n\r\n";
+    text += pad(name, 6, false) + L" for data:              " + DigestHex(sum) + L"\r\n\r\n";
+    text += errors.empty() ? L"Everything is Ok\r\n" : errors;
+    ShowReport((L"7-Zip " + name + L".txt").c_str(), text);
+}
+
+// ---------- Duplicate finder ----------
+// Exact duplicates in three passes, each touching only what the previous one
+// could not rule out: equal size -> equal first/last 4 KB -> equal full SHA-256.
+// Empty files are ignored. Returns groups of indices into `files`.
+static std::vector<std::vector<size_t>> FindDuplicates(const std::vector<FileRecord>& files) {
+    constexpr uint32_t kEdge = 4096;
+    struct Cand { size_t idx; Digest256 key; bool ok; };
+
+    // Pass 1: size buckets.
+    std::vector<size_t> order;
+    for (size_t i = 0; i < files.size(); ++i) if (files[i].size) order.push_back(i);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return files[a].size < files[b].size; });
+    std::vector<Cand> cands;
+    for (size_t i = 0; i < order.size(); ) {
+        size_t j = i;
+        while (j < order.size() && files[order[j]].size == files[order[i]].size) ++j;
+        if (j - i > 1) for (size_t k = i; k < j; ++k) cands.push_back({ order[k], {}, false });
+        i = j;
+    }
+
+    // Groups candidates by (size, key), dropping failed reads and singletons.
+    auto regroup = [&](std::vector<Cand>& c) {
+        c.erase(std::remove_if(c.begin(), c.end(), [](const Cand& x) { return !x.ok; }), c.end());
+        std::sort(c.begin(), c.end(), [&](const Cand& a, const Cand& b) {
+            if (files[a.idx].size != files[b.idx].size) return files[a.idx].size < files[b.idx].size;
+            return a.key < b.key;
+        });
+        std::vector<std::vector<size_t>> groups;
+        for (size_t i = 0; i < c.size(); ) {
+            size_t j = i;
+            while (j < c.size() && files[c[j].idx].size == files[c[i].idx].size && c[j].key == c[i].key) ++j;
+            if (j - i > 1) {
+                groups.emplace_back();
+                for (size_t k = i; k < j; ++k) groups.back().push_back(c[k].idx);
+            }
+            i = j;
+        }
+        return groups;
+    };
+
+    // Pass 2: first/last 4 KB. For files up to 8 KB this already covers everything.
+    ParallelFor(cands.size(), [&](size_t i) {
+        cands[i].ok = HashFile(files[cands[i].idx].path, files[cands[i].idx].size, kEdge, cands[i].key);
+    });
+    std::vector<std::vector<size_t>> result;
+    std::vector<Cand> full;
+    for (auto& g : regroup(cands)) {
+        if (files[g[0]].size <= 2ull * kEdge) result.push_back(std::move(g));
+        else for (size_t idx : g) full.push_back({ idx, {}, false });
+    }
+
+    // Pass 3: full content.
+    std::vector<std::wstring> fullPaths;
+    for (auto& c : full) fullPaths.push_back(files[c.idx].path);
+    auto digests = HashFiles(fullPaths, HashKind::Sha256);
+    for (size_t i = 0; i < full.size(); ++i) {
+        full[i].ok = digests[i].ok && digests[i].digest.size() == full[i].key.size();
+        if (full[i].ok) memcpy(full[i].key.data(), digests[i].digest.data(), full[i].key.size());
+    }
+    for (auto& g : regroup(full)) result.push_back(std::move(g));
+    return result;
+}
+
+static void FindDuplicatesCommand(const PathArena& paths) {
+    std::vector<FileRecord> files;
+    ScanFiles(paths, files);
+    auto groups = FindDuplicates(files);
+
+    // Largest reclaimable space first.
+    auto wasted = [&](const std::vector<size_t>& g) { return files[g[0]].size * (g.size() - 1); };
+    std::sort(groups.begin(), groups.end(), [&](auto& a, auto& b) { return wasted(a) > wasted(b); });
+    uint64_t total = 0;
+    for (auto& g : groups) total += wasted(g);
+
+    std::wstring text = L"Scanned " + std::to_wstring(files.size()) + L" files\r\n" +
+        std::to_wstring(groups.size()) + L" duplicate groups, " + std::to_wstring(total) + L" bytes reclaimable\r\n";
+    for (auto& g : groups) {
+        text += L"\r\n" + std::to_wstring(files[g[0]].size) + L" bytes x " + std::to_wstring(g.size()) + L"\r\n";
+        for (size_t idx : g) text += L"  " + files[idx].path + L"\r\n";
+    }
+    ShowReport(L"7-Zip Duplicates.txt", text);
+}
+
+// ---------- Archive listing ----------
+struct ArchiveEntry {
+    std::wstring path;   // as stored, relative
+    uint64_t size{ 0 };
+    uint64_t mtime{ 0 }; // FILETIME ticks, UTC; 0 if absent
+    uint32_t crc{ 0 };
+    bool hasCrc{ false };
+    bool hasSize{ false }; // .gz/.xz listings often have no unpacked size
+    bool isDir{ false };
+};
+// "2024-05-01 13:45:10[.1234567]" in local time, as printed by 7z l.
+static uint64_t ParseListTime(const std::string& v) {
+    SYSTEMTIME st{};
+    unsigned y, mo, d, h, mi, sec;
+    if (sscanf_s(v.c_str(), "%u-%u-%u %u:%u:%u", &y, &mo, &d, &h, &mi, &sec) != 6) return 0;
+    st.wYear = WORD(y); st.wMonth = WORD(mo); st.wDay = WORD(d);
+    st.wHour = WORD(h); st.wMinute = WORD(mi); st.wSecond = WORD(sec);
+    FILETIME local, utc;
+    if (!SystemTimeToFileTime(&st, &local) || !LocalFileTimeToFileTime(&local, &utc)) return 0;
+    uint64_t t = FileTimeTicks(utc);
+    auto dot = v.find('.');
+    if (dot != std::string::npos) {
+        uint64_t frac = 0; int digits = 0;
+        for (size_t i = dot + 1; i < v.size() && digits < 7 && v[i] >= '0' && v[i] <= '9'; ++i, ++digits)
+            frac = frac * 10 + unsigned(v[i] - '0');
+        for (; digits < 7; ++digits) frac *= 10;
+        t += frac;
+    }
+    return t;
+}
+// ---------- In-process 7z.dll ----------
+// Optional backend that drives 7z.dll's archive handlers directly instead of
+// spawning 7z.exe for every job. The library is loaded once per surrogate from
+// the folder the tools were resolved from and kept until the DLL unloads.
+// Callers fall back to 7z.exe whenever this returns false: SDK headers absent
+// at build time, "InProcess" set to 0, 7z.dll missing, or no handler for the
+// archive (split volumes, for instance, need a volume callback we don't offer).
+#if SEVENZIP_INPROC
+typedef HRESULT (WINAPI* CreateObjectFn)(const GUID*, const GUID*, void**);
+typedef HRESULT (WINAPI* GetNumberOfFormatsFn)(UInt32*);
+typedef HRESULT (WINAPI* GetHandlerProperty2Fn)(UInt32, PROPID, PROPVARIANT*);
+
+struct ArchiveFormat { GUID clsid; std::vector<std::wstring> exts; };
+struct SevenZipLibrary {
+    HMODULE mod{ nullptr };
+    CreateObjectFn create{ nullptr };
+    std::vector<ArchiveFormat> formats;
+};
+static std::mutex g_libLock;
+static std::unique_ptr<SevenZipLibrary> g_lib;
+static bool g_libTried = false;
+
+static const SevenZipLibrary* Library() {
+    if (!ReadSetting(L"InProcess", 1)) return nullptr;
+    std::lock_guard<std::mutex> g(g_libLock);
+    if (g_libTried) return g_lib.get();
+    g_libTried = true;
+
+    const std::wstring& dir = Tools().dir;
+    if (dir.empty()) return nullptr; // never load a codec DLL off the search path
+    HMODULE mod = LoadLibraryExW(Combine(dir, L"7z.dll").c_str(), nullptr, LOAD_WITH_ALTERED_SEARCH_PATH);
+    if (!mod) return nullptr;
+    auto create = (CreateObjectFn)GetProcAddress(mod, "CreateObject");
+    auto count = (GetNumberOfFormatsFn)GetProcAddress(mod, "GetNumberOfFormats");
+    auto prop = (GetHandlerProperty2Fn)GetProcAddress(mod, "GetHandlerProperty2");
+    UInt32 n = 0;
+    if (!create || !count || !prop || FAILED(count(&n))) { FreeLibrary(mod); return nullptr; }
+
+    auto lib = std::make_unique<SevenZipLibrary>();
+    lib->mod = mod;
+    lib->create = create;
+    for (UInt32 i = 0; i < n; ++i) {
+        ArchiveFormat f{};
+        PROPVARIANT v{};
+        bool ok = SUCCEEDED(prop(i, NArchive::NHandlerPropID::kClassID, &v)) && v.vt == VT_BSTR &&
+                  SysStringByteLen(v.bstrVal) == sizeof(GUID);
+        if (ok) memcpy(&f.clsid, v.bstrVal, sizeof(GUID));
+        PropVariantClear(&v);
+        if (ok && SUCCEEDED(prop(i, NArchive::NHandlerPropID::kExtension, &v)) && v.vt == VT_BSTR) {
+            std::wstring_view list(v.bstrVal);
+            for (size_t a = 0, b; a < list.size(); a = b + 1) { // space-separated, e.g. "tar ova"
+                b = list.find(L' ', a);
+                if (b == std::wstring_view::npos) b = list.size();
+                if (b > a) f.exts.emplace_back(list.substr(a, b - a));
+            }
+        }
+        PropVariantClear(&v);
+        if (ok && !f.exts.empty()) lib->formats.push_back(std::move(f));
+    }
+    g_lib = std::move(lib);
+    return g_lib.get();
+}
+// Called from DllCanUnloadNow, when no job can be inside the library any more.
+static void ShutdownLibrary() {
+    std::lock_guard<std::mutex> g(g_libLock);
+    if (g_lib) FreeLibrary(g_lib->mod);
+    g_lib.reset();
+    g_libTried = false;
+}
+
+// IInStream over a Win32 file handle (7-Zip's seek origins match FILE_BEGIN/CURRENT/END).
+struct InFileStream : IInStream {
+    explicit InFileStream(HANDLE h) : m_h(h) {}
+    ~InFileStream() { CloseHandle(m_h); }
+    IFACEMETHODIMP QueryInterface(REFIID riid, void** ppv) override {
+        if (!ppv) return E_POINTER;
+        if (riid == IID_IUnknown || riid == IID_ISequentialInStream || riid == IID_IInStream) { *ppv = this; AddRef(); return S_OK; }
+        *ppv = nullptr; return E_NOINTERFACE;
+    }
+    IFACEMETHODIMP_(ULONG) AddRef() override { return InterlockedIncrement(&m_ref); }
+    IFACEMETHODIMP_(ULONG) Release() override { ULONG c = InterlockedDecrement(&m_ref); if (!c) delete this; return c; }
+    IFACEMETHODIMP Read(void* data, UInt32 size, UInt32* processed) override {
+        DWORD got = 0;
+        BOOL ok = ReadFile(m_h, data, size, &got, nullptr);
+        if (processed) *processed = got;
+        return ok ? S_OK : HRESULT_FROM_WIN32(GetLastError());
+    }
+    IFACEMETHODIMP Seek(Int64 offset, UInt32 origin, UInt64* newPosition) override {
+        LARGE_INTEGER d, p{};
+        d.QuadPart = offset;
+        if (!SetFilePointerEx(m_h, d, &p, origin)) return HRESULT_FROM_WIN32(GetLastError());
+        if (newPosition) *newPosition = UInt64(p.QuadPart);
+        return S_OK;
+    }
+private:
+    LONG m_ref{ 1 };
+    HANDLE m_h;
+};
+
+// Open/extract callbacks. Password prompts are declined: encrypted archives
+// fail here and take the 7z.exe path, which behaves the same without a console.
+// A raised `cancel` makes the handler give up opening with E_ABORT.
+struct OpenCallback : IArchiveOpenCallback, ICryptoGetTextPassword {
+    explicit OpenCallback(const std::atomic<bool>* cancel = nullptr) : m_cancel(cancel) {}
+    IFACEMETHODIMP QueryInterface(REFIID riid, void** ppv) override {
+        if (!ppv) return E_POINTER;
+        if (riid == IID_IUnknown || riid == IID_IArchiveOpenCallback) { *ppv = (IArchiveOpenCallback*)this; AddRef(); return S_OK; }
+        if (riid == IID_ICryptoGetTextPassword) { *ppv = (ICryptoGetTextPassword*)this; AddRef(); return S_OK; }
+        *ppv = nullptr; return E_NOINTERFACE;
+    }
+    IFACEMETHODIMP_(ULONG) AddRef() override { return InterlockedIncrement(&m_ref); }
+    IFACEMETHODIMP_(ULONG) Release() override { ULONG c = InterlockedDecrement(&m_ref); if (!c) delete this; return c; }
+    IFACEMETHODIMP SetTotal(const UInt64*, const UInt64*) override { return Cancelled() ? E_ABORT : S_OK; }
+    IFACEMETHODIMP SetCompleted(const UInt64*, const UInt64*) override { return Cancelled() ? E_ABORT : S_OK; }
+    IFACEMETHODIMP CryptoGetTextPassword(BSTR*) override { return E_ABORT; }
+    bool Cancelled() const { return m_cancel && m_cancel->load(std::memory_order_relaxed); }
+private:
+    LONG m_ref{ 1 };
+    const std::atomic<bool>* m_cancel;
+};
+
+// Receives decoded bytes of one entry; a false return from the sink aborts extraction.
+using EntrySink = std::function<bool(UInt32 index, const char* data, size_t size)>;
+struct SinkStream : ISequentialOutStream {
+    SinkStream(UInt32 index, const EntrySink& sink) : m_index(index), m_sink(sink) {}
+    IFACEMETHODIMP QueryInterface(REFIID riid, void** ppv) override {
+        if (!ppv) return E_POINTER;
+        if (riid == IID_IUnknown || riid == IID_ISequentialOutStream) { *ppv = this; AddRef(); return S_OK; }
+        *ppv = nullptr; return E_NOINTERFACE;
+    }
+    IFACEMETHODIMP_(ULONG) AddRef() override { return InterlockedIncrement(&m_ref); }
+    IFACEMETHODIMP_(ULONG) Release() override { ULONG c = InterlockedDecrement(&m_ref); if (!c) delete this; return c; }
+    IFACEMETHODIMP Write(const void* data, UInt32 size, UInt32* processed) override {
+        if (processed) *processed = 0;
+        if (!m_sink(m_index, static_cast<const char*>(data), size)) return E_ABORT;
+        if (processed) *processed = size;
+        return S_OK;
+    }
+private:
+    LONG m_ref{ 1 };
+    UInt32 m_index;
+    const EntrySink& m_sink;
+};
+
+struct ExtractCallback : IArchiveExtractCallback, ICryptoGetTextPassword {
+    explicit ExtractCallback(const EntrySink& sink) : m_sink(sink) {}
+    IFACEMETHODIMP QueryInterface(REFIID riid, void** ppv) override {
+        if (!ppv) return E_POINTER;
+        if (riid == IID_IUnknown || riid == IID_IProgress || riid == IID_IArchiveExtractCallback) { *ppv = (IArchiveExtractCallback*)this; AddRef(); return S_OK; }
+        if (riid == IID_ICryptoGetTextPassword) { *ppv = (ICryptoGetTextPassword*)this; AddRef(); return S_OK; }
+        *ppv = nullptr; return E_NOINTERFACE;
+    }
+    IFACEMETHODIMP_(ULONG) AddRef() override { return InterlockedIncrement(&m_ref); }
+    IFACEMETHODIMP_(ULONG) Release() override { ULONG c = InterlockedDecrement(&m_ref); if (!c) delete this; return c; }
+    IFACEMETHODIMP SetTotal(UInt64) override { return S_OK; }
+    IFACEMETHODIMP SetCompleted(const UInt64*) override { return S_OK; }
+    IFACEMETHODIMP GetStream(UInt32 index, ISequentialOutStream** out, Int32 askExtractMode) override {
+        *out = nullptr;
+        if (askExtractMode == NArchive::NExtract::NAskMode::kExtract) *out = new SinkStream(index, m_sink);
+        return S_OK;
+    }
+    IFACEMETHODIMP PrepareOperation(Int32) override { return S_OK; }
+    IFACEMETHODIMP SetOperationResult(Int32 result) override {
+        if (result != NArchive::NExtract::NOperationResult::kOK) m_failed = true;
+        return S_OK;
+    }
+    IFACEMETHODIMP CryptoGetTextPassword(BSTR*) override { return E_ABORT; }
+    bool m_failed{ false };
+private:
+    LONG m_ref{ 1 };
+    const EntrySink& m_sink;
+};
+
+// Tries the handlers registered for the file's extension; caller Close()s and Release()s.
+static IInArchive* OpenInProcess(const std::wstring& archive, const std::atomic<bool>* cancel = nullptr) {
+    const SevenZipLibrary* lib = Library();
+    if (!lib) return nullptr;
+    const wchar_t* dot = PathFindExtensionW(archive.c_str());
+    std::wstring_view ext(*dot ? dot + 1 : dot);
+    HANDLE h = CreateFileW(archive.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+                           OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (h == INVALID_HANDLE_VALUE) return nullptr;
+    auto* stream = new InFileStream(h);
+    auto* cb = new OpenCallback(cancel);
+    IInArchive* result = nullptr;
+    const UInt64 maxCheck = 1 << 22;
+    for (const ArchiveFormat& f : lib->formats) {
+        if (std::none_of(f.exts.begin(), f.exts.end(), [&](const std::wstring& e) { return NamesEqualI(e, ext); }))
+            continue;
+        if (cb->Cancelled()) break;
+        IInArchive* arc = nullptr;
+        if (FAILED(lib->create(&f.clsid, &IID_IInArchive, (void**)&arc)) || !arc) continue;
+        if (SUCCEEDED(stream->Seek(0, FILE_BEGIN, nullptr)) && arc->Open(stream, &maxCheck, cb) == S_OK) {
+            result = arc;
+            break;
+        }
+        arc->Release();
+    }
+    cb->Release();
+    stream->Release(); // the handler holds its own reference
+    return result;
+}
+
+static bool ItemU64(IInArchive* arc, UInt32 i, PROPID id, uint64_t& value) {
+    PROPVARIANT v{};
+    if (FAILED(arc->GetProperty(i, id, &v))) return false;
+    bool ok = true;
+    switch (v.vt) {
+    case VT_UI1: value = v.bVal; break;
+    case VT_UI2: value = v.uiVal; break;
+    case VT_UI4: value = v.ulVal; break;
+    case VT_UI8: value = v.uhVal.QuadPart; break;
+    case VT_FILETIME: value = (uint64_t(v.filetime.dwHighDateTime) << 32) | v.filetime.dwLowDateTime; break;
+    default: ok = false;
+    }
+    PropVariantClear(&v);
+    return ok;
+}
+
+// Same entries as the 7z.exe listing, indexed by handler item number. Stops
+// early, with a partial list, once `cancel` is raised.
+static bool ListInProcess(const std::wstring& archive, std::vector<ArchiveEntry>& out,
+                          const std::atomic<bool>* cancel) {
+    IInArchive* arc = OpenInProcess(archive, cancel);
+    if (!arc) return false;
+    UInt32 n = 0;
+    arc->GetNumberOfItems(&n);
+    out.clear();
+    out.reserve(n);
+    for (UInt32 i = 0; i < n; ++i) {
+        if (cancel && cancel->load(std::memory_order_relaxed)) break;
+        ArchiveEntry e;
+        PROPVARIANT v{};
+        if (SUCCEEDED(arc->GetProperty(i, kpidPath, &v)) && v.vt == VT_BSTR) e.path = v.bstrVal;
+        PropVariantClear(&v);
+        if (SUCCEEDED(arc->GetProperty(i, kpidIsDir, &v)) && v.vt == VT_BOOL) e.isDir = v.boolVal != 0;
+        PropVariantClear(&v);
+        if (e.path.empty()) e.path = BaseName(archive); // single-stream formats (.gz, .xz) without a stored name
+        e.hasSize = ItemU64(arc, i, kpidSize, e.size);
+        ItemU64(arc, i, kpidMTime, e.mtime);
+        uint64_t crc = 0;
+        if (ItemU64(arc, i, kpidCRC, crc)) { e.crc = uint32_t(crc); e.hasCrc = true; }
+        out.push_back(std::move(e));
+    }
+    arc->Close();
+    arc->Release();
+    return true;
+}
+
+// Decodes every entry in archive order into sink. Returns false only when the
+// archive couldn't be opened in-process; decode errors just end the stream.
+static bool ExtractInProcess(const std::wstring& archive, const EntrySink& sink) {
+    IInArchive* arc = OpenInProcess(archive);
+    if (!arc) return false;
+    auto* cb = new ExtractCallback(sink);
+    arc->Extract(nullptr, UInt32(-1), 0, cb);
+    cb->Release();
+    arc->Close();
+    arc->Release();
+    return true;
+}
+
+// In-memory streams for coding whole buffers; the output side fails once full.
+struct MemInStream : ISequentialInStream {
+    MemInStream(const uint8_t* p, size_t n) : m_p(p), m_left(n) {}
+    IFACEMETHODIMP QueryInterface(REFIID riid, void** ppv) override {
+        if (!ppv) return E_POINTER;
+        if (riid == IID_IUnknown || riid == IID_ISequentialInStream) { *ppv = this; AddRef(); return S_OK; }
+        *ppv = nullptr; return E_NOINTERFACE;
+    }
+    IFACEMETHODIMP_(ULONG) AddRef() override { return InterlockedIncrement(&m_ref); }
+    IFACEMETHODIMP_(ULONG) Release() override { ULONG c = InterlockedDecrement(&m_ref); if (!c) delete this; return c; }
+    IFACEMETHODIMP Read(void* data, UInt32 size, UInt32* processed) override {
+        const size_t n = std::min<size_t>(size, m_left);
+        memcpy(data, m_p, n);
+        m_p += n;
+        m_left -= n;
+        if (processed) *processed = UInt32(n);
+        return S_OK;
+    }
+private:
+    LONG m_ref{ 1 };
+    const uint8_t* m_p;
+    size_t m_left;
+};
+struct MemOutStream : ISequentialOutStream {
+    MemOutStream(uint8_t* p, size_t capacity) : m_p(p), m_capacity(capacity) {}
+    IFACEMETHODIMP QueryInterface(REFIID riid, void** ppv) override {
+        if (!ppv) return E_POINTER;
+        if (riid == IID_IUnknown || riid == IID_ISequentialOutStream) { *ppv = this; AddRef(); return S_OK; }
+        *ppv = nullptr; return E_NOINTERFACE;
+    }
+    IFACEMETHODIMP_(ULONG) AddRef() override { return InterlockedIncrement(&m_ref); }
+    IFACEMETHODIMP_(ULONG) Release() override { ULONG c = InterlockedDecrement(&m_ref); if (!c) delete this; return c; }
+    IFACEMETHODIMP Write(const void* data, UInt32 size, UInt32* processed) override {
+        if (processed) *processed = 0;
+        if (size > m_capacity - m_size) return E_OUTOFMEMORY;
+        memcpy(m_p + m_size, data, size);
+        m_size += size;
+        if (processed) *processed = size;
+        return S_OK;
+    }
+    size_t Size() const { return m_size; }
+private:
+    LONG m_ref{ 1 };
+    uint8_t* m_p;
+    size_t m_capacity, m_size{ 0 };
+};
+
+// One encoder/decoder pair of a 7z.dll codec, reused for many buffers. Coder
+// CLSIDs are {23170F69-40C1-2791-<method id>} for encoders, 2790 for decoders.
+// A zero dictionary, thread count or model memory (PPMd) leaves the codec's
+// default in place.
+class InProcessCodec {
+public:
+    InProcessCodec(uint64_t method, UInt32 level, UInt32 dictionary, UInt32 threads, UInt32 memory = 0) {
+        m_encoder = Create(method, true);
+        m_decoder = Create(method, false);
+        if (!m_encoder || !m_decoder) return;
+        PROPID ids[4];
+        PROPVARIANT props[4]{};
+        UInt32 n = 0;
+        auto add = [&](PROPID id, UInt32 v) { ids[n] = id; props[n].vt = VT_UI4; props[n].ulVal = v; ++n; };
+        add(NCoderPropID::kLevel, level);
+        if (dictionary) add(NCoderPropID::kDictionarySize, dictionary);
+        if (threads) add(NCoderPropID::kNumThreads, threads);
+        if (memory) add(NCoderPropID::kUsedMemorySize, memory);
+        ICompressSetCoderProperties* set = nullptr;
+        if (SUCCEEDED(m_encoder->QueryInterface(IID_ICompressSetCoderProperties, (void**)&set))) {
+            m_ok = SUCCEEDED(set->SetCoderProperties(ids, props, n));
+            set->Release();
+        } else {
+            m_ok = true; // no tunables
+        }
+    }
+    ~InProcessCodec() {
+        if (m_encoder) m_encoder->Release();
+        if (m_decoder) m_decoder->Release();
+    }
+    InProcessCodec(const InProcessCodec&) = delete;
+    InProcessCodec& operator=(const InProcessCodec&) = delete;
+
+    bool Ok() const { return m_ok; }
+    // Packs p[0..n) into packed (resized to the packed size); false on failure.
+    bool Encode(const uint8_t* p, size_t n, std::vector<uint8_t>& packed) {
+        packed.resize(n + n / 2 + (64 << 10));
+        auto* in = new MemInStream(p, n);
+        auto* out = new MemOutStream(packed.data(), packed.size());
+        const UInt64 size = n;
+        bool ok = m_ok && m_encoder->Code(in, out, &size, nullptr, nullptr) == S_OK;
+        packed.resize(out->Size());
+        in->Release();
+        out->Release();
+        ICompressWriteCoderProperties* write = nullptr;
+        if (ok && m_props.empty() && SUCCEEDED(m_encoder->QueryInterface(IID_ICompressWriteCoderProperties, (void**)&write))) {
+            m_props.resize(256);
+            auto* ps = new MemOutStream(m_props.data(), m_props.size());
+            ok = SUCCEEDED(write->WriteCoderProperties(ps));
+            m_props.resize(ps->Size());
+            ps->Release();
+            write->Release();
+        }
+        return ok;
+    }
+    // Unpacks exactly n bytes into out.
+    bool Decode(const std::vector<uint8_t>& packed, uint8_t* out, size_t n) {
+        ICompressSetDecoderProperties2* set = nullptr;
+        if (SUCCEEDED(m_decoder->QueryInterface(IID_ICompressSetDecoderProperties2, (void**)&set))) {
+            HRESULT hr = set->SetDecoderProperties2(m_props.data(), UInt32(m_props.size()));
+            set->Release();
+            if (FAILED(hr)) return false;
+        }
+        auto* in = new MemInStream(packed.data(), packed.size());
+        auto* os = new MemOutStream(out, n);
+        const UInt64 size = n;
+        bool ok = m_decoder->Code(in, os, nullptr, &size, nullptr) == S_OK && os->Size() == n;
+        in->Release();
+        os->Release();
+        return ok;
+    }
+
+private:
+    static ICompressCoder* Create(uint64_t method, bool encoder) {
+        const SevenZipLibrary* lib = Library();
+        if (!lib) return nullptr;
+        GUID clsid{ 0x23170F69, 0x40C1, WORD(encoder ? 0x2791 : 0x2790), {} };
+        memcpy(clsid.Data4, &method, sizeof(method));
+        ICompressCoder* coder = nullptr;
+        if (FAILED(lib->create(&clsid, &IID_ICompressCoder, (void**)&coder))) return nullptr;
+        return coder;
+    }
+
+    ICompressCoder* m_encoder{ nullptr };
+    ICompressCoder* m_decoder{ nullptr };
+    std::vector<uint8_t> m_props;
+    bool m_ok{ false };
+};
+#else
+using EntrySink = std::function<bool(uint32_t index, const char* data, size_t size)>;
+static bool ListInProcess(const std::wstring&, std::vector<ArchiveEntry>&, const std::atomic<bool>*) { return false; }
+static bool ExtractInProcess(const std::wstring&, const EntrySink&) { return false; }
+static void ShutdownLibrary() {}
+class InProcessCodec {
+public:
+    InProcessCodec(uint64_t, uint32_t, uint32_t, uint32_t, uint32_t = 0) {}
+    bool Ok() const { return false; }
+    bool Encode(const uint8_t*, size_t, std::vector<uint8_t>&) { return false; }
+    bool Decode(const std::vector<uint8_t>&, uint8_t*, size_t) { return false; }
+};
+#endif
+
+// Reads the archive's header, in-process when possible, else through
+// "7z l -slt"; nothing is decompressed either way. Raising `cancel` stops
+// the listing either way (the handler is told E_ABORT, 7z.exe is terminated)
+// and makes it return false.
+static bool ListArchive(const std::wstring& archive, std::vector<ArchiveEntry>& out,
+                        const std::atomic<bool>* cancel = nullptr) {
+    auto cancelled = [&] { return cancel && cancel->load(std::memory_order_relaxed); };
+    if (ListInProcess(archive, out, cancel)) return !cancelled();
+    out.clear();
+    if (cancelled()) return false;
+    std::string text;
+    DWORD code = 0;
+    if (!RunCapture(Find7zTool(L"7z.exe"), L"l -slt -sccUTF-8 \"" + archive + L"\"", text, &code, cancel) ||
+        code != 0 || cancelled())
+        return false;
+
+    // The archive's own properties come first; entries follow the "----------" line.
+    size_t pos = text.find("\n----------");
+    if (pos == std::string::npos) return true; // empty archive
+    pos = text.find('\n', pos + 1);
+    ArchiveEntry cur;
+    bool any = false;
+    auto flush = [&] {
+        if (any && !cur.path.empty()) out.push_back(std::move(cur));
+        cur = ArchiveEntry{};
+        any = false;
+    };
+    while (pos != std::string::npos && pos < text.size()) {
+        size_t eol = text.find('\n', pos + 1);
+        std::string line = text.substr(pos + 1, (eol == std::string::npos ? text.size() : eol) - pos - 1);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        pos = eol;
+        if (line.empty()) { flush(); continue; }
+        size_t eq = line.find(" = ");
+        if (eq == std::string::npos) continue;
+        std::string key = line.substr(0, eq), val = line.substr(eq + 3);
+        any = true;
+        if (key == "Path") cur.path = FromUtf8(val);
+        else if (key == "Size" && !val.empty()) { cur.size = std::strtoull(val.c_str(), nullptr, 10); cur.hasSize = true; }
+        else if (key == "Modified") cur.mtime = ParseListTime(val);
+        else if (key == "CRC" && !val.empty()) { cur.crc = uint32_t(std::strtoul(val.c_str(), nullptr, 16)); cur.hasCrc = true; }
+        else if (key == "Folder") cur.isDir = (val == "+");
+        else if (key == "Attributes") cur.isDir = cur.isDir || (!val.empty() && val[0] == 'D');
+    }
+    flush();
+    return true;
+}
+
+// ---------- Benchmark ----------
+// In-memory throughput of the hash kernels and transcoders in this DLL, plus
+// 7z.dll's main codecs when it loads in-process; no file is read or written.
+// Every measurement runs once on a single instance and once on one instance
+// per worker thread, and each ISA variant the CPU supports gets its own row,
+// once SelfTest has checked it.
+// Speeds are KiB/s as in `7z b`. Results are also stored as DWORDs under
+// HKCU\Software\7-Zip\ShellExtension\Benchmark ("<Method> <ISA>" for one
+// thread, "... MT" for all of them, plus "Threads") for jobs to size work by.
+static constexpr double kBenchSeconds = 0.25;  // per measurement
+static constexpr size_t kBenchBytes = 1 << 20; // per pass; small enough to stay in cache, like `7z b -mm=*`
+
+struct BenchKernel {
+    const wchar_t* method;
+    const wchar_t* isa;
+    uint64_t (*run)(const uint8_t* p, size_t n);
+    const std::vector<uint8_t>* input;
+};
+static uint64_t BenchCrc32(const uint8_t* p, size_t n) { return Crc32Update(0, p, n); }
+static uint64_t BenchCrc32cSoft(const uint8_t* p, size_t n) { return Crc32cSoft(0, p, n); }
+// XXH3's long-input loop: 16 stripes per block, then a scramble.
+template<XxhAccumulate accumulate, XxhScramble scramble> static uint64_t BenchXxh3(const uint8_t* p, size_t n) {
+    uint64_t acc[8]{};
+    for (size_t s = 0; s + 64 <= n; s += 64) {
+        const size_t i = (s / 64) % 16;
+        accumulate(acc, p + s, kXxhSecret + i * 8);
+        if (i == 15) scramble(acc, kXxhSecret + sizeof(kXxhSecret) - 64);
+    }
+    return acc[0];
+}
+static uint64_t BenchBlake3(const uint8_t* p, size_t n) {
+    Blake3Cv cv{};
+    for (size_t i = 0; (i + 1) * kBlake3Chunk <= n; ++i) cv = Blake3ChunkCv(p + i * kBlake3Chunk, i);
+    return cv[0];
+}
+static uint64_t BenchBlake2sp(const uint8_t* p, size_t n) {
+    uint32_t h[8][8];
+    for (auto& leaf : h) memcpy(leaf, kBlake2sIV, sizeof(kBlake2sIV));
+    for (size_t s = 0; s + 512 <= n; s += 512)
+        for (int j = 0; j < 8; ++j) Blake2sCompress(h[j], p + s + j * 64, (s / 512 + 1) * 64, false, false);
+    return h[0][0];
+}
+#if defined(_M_X64) || defined(__x86_64__)
+static uint64_t BenchCrc32cHard(const uint8_t* p, size_t n) { return Crc32cHard(0, p, n); }
+static uint64_t BenchBlake2spAvx2(const uint8_t* p, size_t n) {
+    uint32_t h[8][8];
+    for (auto& leaf : h) memcpy(leaf, kBlake2sIV, sizeof(kBlake2sIV));
+    for (size_t s = 0; s + 512 <= n; s += 512) Blake2sStripeAvx2(h, p + s, (s / 512 + 1) * 64);
+    return h[0][0];
+}
+#endif
+#if defined(_M_X64) || defined(__SSE2__)
+static uint64_t BenchBlake3Sse2(const uint8_t* p, size_t n) {
+    Blake3Cv cv[4]{};
+    for (size_t i = 0; (i + 4) * kBlake3Chunk <= n; i += 4) Blake3Chunks4(p + i * kBlake3Chunk, i, cv);
+    return cv[0][0];
+}
+#endif
+template<BCRYPT_ALG_HANDLE (*provider)(), size_t size> static uint64_t BenchCng(const uint8_t* p, size_t n) {
+    CngState st(provider(), size);
+    st.Update(p, n);
+    auto d = st.Final();
+    return d.empty() ? 0 : d[0];
+}
+static uint64_t BenchToUtf8(const uint8_t* p, size_t n) {
+    thread_local std::string out;
+    out.resize(n / sizeof(wchar_t) * 3);
+    return Utf16ToUtf8(reinterpret_cast<const wchar_t*>(p), n / sizeof(wchar_t), out.data());
+}
+static uint64_t BenchFromUtf8(const uint8_t* p, size_t n) {
+    thread_local std::wstring out;
+    out.resize(n);
+    return Utf8ToUtf16(reinterpret_cast<const char*>(p), n, out.data());
+}
+
+// Test data: incompressible bytes for the hashes, mixed-script text for the
+// transcoders, and LZ-friendly data (literal runs and repeats) for the codecs.
+struct BenchRandom {
+    uint64_t s{ 0x9E3779B97F4A7C15ull };
+    uint64_t Next() { s ^= s << 13; s ^= s >> 7; s ^= s << 17; return s; }
+};
+static std::vector<uint8_t> BenchRandomBytes(size_t n) {
+    BenchRandom r;
+    std::vector<uint8_t> d(n);
+    for (size_t i = 0; i + 8 <= n; i += 8) { uint64_t v = r.Next(); memcpy(&d[i], &v, 8); }
+    return d;
+}
+static std::wstring BenchText(size_t chars) {
+    static const wchar_t* const words[] = { L"archive", L"folder", L"déjà", L"файл",
+                                            L"文件夹", L"圧縮", L"\U0001F4E6", L"2024-05-01" };
+    BenchRandom r;
+    std::wstring t;
+    while (t.size() < chars) { t += words[r.Next() % 8]; t += L' '; }
+    t.resize(chars);
+    return t;
+}
+static std::vector<uint8_t> BenchCompressible(size_t n) {
+    BenchRandom r;
+    std::vector<uint8_t> d(n);
+    for (size_t i = 0; i < n; ) {
+        const uint64_t v = r.Next();
+        size_t len = 2 + (v >> 8) % 30;
+        if (i > 64 && (v & 3)) { // three in four: repeat something seen up to 32 KB back
+            const size_t dist = 1 + (v >> 20) % std::min<size_t>(i, 32 << 10);
+            for (; len && i < n; --len, ++i) d[i] = d[i - dist];
+        } else {
+            for (; len && i < n; --len, ++i) d[i] = uint8_t('a' + r.Next() % 26);
+        }
+    }
+    return d;
+}
+
+// Known answers before timing: the published test vectors of the hashes this
+// DLL implements itself (RFC 3720 for CRC-32C, xxHash's sanity buffer for
+// XXH3-128, the BLAKE3 repository's test_vectors.json inputs), each hashed in
+// one go and in uneven pieces, plus every vector kernel against its scalar
+// twin on random data. Returns what failed, as "<Method> <ISA>" row names or
+// a bare method name when the whole hasher is wrong; those rows aren't timed.
+static std::vector<std::wstring> SelfTest() {
+    std::vector<std::wstring> failed;
+    auto fail = [&](const std::wstring& what) {
+        if (std::find(failed.begin(), failed.end(), what) == failed.end()) failed.push_back(what);
+    };
+    auto hex = [](const uint8_t* p, size_t n) {
+        std::string s;
+        for (size_t i = 0; i < n; ++i) { s += "0123456789abcdef"[p[i] >> 4]; s += "0123456789abcdef"[p[i] & 15]; }
+        return s;
+    };
+    // Feeds `n` bytes to update() in one call, or in pieces of 1, 63, 64, 1000 and 4097 bytes.
+    auto feed = [](const uint8_t* p, size_t n, bool pieces, const std::function<void(const uint8_t*, size_t)>& update) {
+        static const size_t sizes[] = { 1, 63, 64, 1000, 4097 };
+        for (size_t k = 0, take; n; p += take, n -= take, ++k)
+            update(p, take = pieces ? std::min(n, sizes[k % 5]) : n);
+    };
+    const std::vector<uint8_t> random = BenchRandomBytes(kBenchBytes);
+
+    // CRC-32 and CRC-32C.
+    static const uint8_t check[] = { '1', '2', '3', '4', '5', '6', '7', '8', '9' };
+    if (Crc32Update(0, check, 9) != 0xCBF43926u) fail(L"CRC32 slice-8");
+    uint8_t zeros[32] = {}, ones[32], up[32], down[32];
+    for (int i = 0; i < 32; ++i) { ones[i] = 0xFF; up[i] = uint8_t(i); down[i] = uint8_t(31 - i); }
+    struct { const uint8_t* p; size_t n; uint32_t crc; } const crc32c[] = {
+        { check, 9, 0xE3069283u }, { zeros, 32, 0x8A9136AAu }, { ones, 32, 0x62A8AB43u },
+        { up, 32, 0x46DD794Eu },   { down, 32, 0x113FDB5Cu },
+    };
+    std::vector<std::pair<const wchar_t*, uint32_t (*)(uint32_t, const uint8_t*, size_t)>> crcs = { { L"CRC32C slice-8", Crc32cSoft } };
+#if defined(_M_X64) || defined(__x86_64__)
+    if (IsProcessorFeaturePresent(PF_SSE4_2_INSTRUCTIONS_AVAILABLE)) crcs.push_back({ L"CRC32C SSE4.2", Crc32cHard });
+#endif
+    for (const auto& [name, crc] : crcs) {
+        for (const auto& v : crc32c)
+            if (crc(0, v.p, v.n) != v.crc) fail(name);
+        // Lengths around the three-way blocks (3 x 256 and 3 x 8192 bytes), odd starts, chained calls.
+        for (size_t n : { size_t(0), size_t(7), size_t(767), size_t(768), size_t(769), size_t(24575), size_t(24576),
+                          size_t(24577), size_t(100003), kBenchBytes - 3 }) {
+            const uint8_t* p = random.data() + 3;
+            const uint32_t whole = Crc32cSoft(0, p, n);
+            if (crc(0, p, n) != whole || crc(crc(0, p, n / 3), p + n / 3, n - n / 3) != whole) fail(name);
+        }
+    }
+
+    // XXH3-128, once per accumulate/scramble pair.
+    std::vector<uint8_t> sanity(200000);
+    for (uint64_t i = 0, gen = 2654435761u; i < sanity.size(); ++i, gen *= 11400714785074694797ull) sanity[i] = uint8_t(gen >> 56);
+    static const struct { size_t n; const char* hex; } xxh128[] = {
+        { 0, "99aa06d3014798d86001c324468d497f" },      { 1, "a6cd5e9392000f6ac44bdff4074eecdb" },
+        { 6, "082afe0b8162d12a3e7039bdda43cfc6" },      { 12, "6e3efd8fc7802b18061a192713f69ad9" },
+        { 24, "0ce966e4678d37611e7044d28b1b901d" },     { 48, "a002ac4e5478227ef942219aed80f67b" },
+        { 80, "fdf2cefde9eaac8a454ae6bf7a8a532d" },     { 195, "7729543a26b207ee3fb593c086a66075" },
+        { 2048, "f736557fd47073a5dd59e2c3a5f038e0" },   { 2240, "ccb134fbfa7ce49d6e73a90539cf2948" },
+        { 2367, "e89c0f6ff369b427cb37aeb9e5d361ed" },   { 4096, "b9cfaea2ca5626a4e91206429d1f48f9" },
+        { 100000, "351330331bc078fb34d658192a014311" }, { 200000, "2b6fe08822dd5f9e813794d4fbda666a" },
+    };
+    std::vector<std::pair<const wchar_t*, XxhKernels>> xxhs = { { L"XXH128 scalar", { XxhAccumulateScalar, XxhScrambleScalar } } };
+#if defined(_M_X64) || defined(__x86_64__)
+    xxhs.push_back({ L"XXH128 SSE2", { XxhAccumulateSse2, XxhScrambleSse2 } });
+    if (IsProcessorFeaturePresent(PF_AVX2_INSTRUCTIONS_AVAILABLE)) xxhs.push_back({ L"XXH128 AVX2", { XxhAccumulateAvx2, XxhScrambleAvx2 } });
+#endif
+    Xxh3Hasher reference(xxhs[0].second);
+    reference.Update(random.data(), random.size());
+    for (const auto& [name, kernels] : xxhs) {
+        for (const auto& v : xxh128)
+            for (bool pieces : { false, true }) {
+                Xxh3Hasher h(kernels);
+                feed(sanity.data(), v.n, pieces, [&](const uint8_t* p, size_t n) { h.Update(p, n); });
+                if (hex(h.Final().data(), 16) != v.hex) fail(name);
+            }
+        Xxh3Hasher h(kernels);
+        h.Update(random.data(), random.size());
+        if (h.Final() != reference.Final()) fail(name);
+    }
+
+    // BLAKE3: whole-chunk kernels against the scalar compression (counters
+    // crossing 2^32 included), then the hasher, whose updates of 256 KB and
+    // more are split into subtrees hashed in parallel.
+#if defined(_M_X64) || defined(__SSE2__)
+    for (uint64_t counter : { uint64_t(0), uint64_t(5), uint64_t(0xFFFFFFFEu) }) {
+        Blake3Cv lanes[4];
+        Blake3Chunks4(random.data(), counter, lanes);
+        for (int l = 0; l < 4; ++l)
+            if (lanes[l] != Blake3ChunkCv(random.data() + l * kBlake3Chunk, counter + l)) fail(L"BLAKE3 SSE2x4");
+    }
+#endif
+    std::vector<uint8_t> pattern(size_t(1) << 21);
+    for (size_t i = 0; i < pattern.size(); ++i) pattern[i] = uint8_t(i % 251);
+    static const struct { size_t n; const char* hex; } blake3[] = {
+        { 0, "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262" },
+        { 1, "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213" },
+        { 1023, "10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11" },
+        { 1024, "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7" },
+        { 1025, "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444" },
+        { 2048, "e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a" },
+        { 2049, "5f4d72f40d7a5f82b15ca2b2e44b1de3c2ef86c426c95c1af0b6879522563030" },
+        { 3072, "b98cb0ff3623be03326b373de6b9095218513e64f1ee2edd2525c7ad1e5cffd2" },
+        { 3073, "7124b49501012f81cc7f11ca069ec9226cecb8a2c850cfe644e327d22d3e1cd3" },
+        { 4096, "015094013f57a5277b59d8475c0501042c0b642e531b0a1c8f58d2163229e969" },
+        { 4097, "9b4052b38f1c5fc8b1f9ff7ac7b27cd242487b3d890d15c96a1c25b8aa0fb995" },
+        { 5120, "9cadc15fed8b5d854562b26a9536d9707cadeda9b143978f319ab34230535833" },
+        { 5121, "628bd2cb2004694adaab7bbd778a25df25c47b9d4155a55f8fbd79f2fe154cff" },
+        { 6144, "3e2e5b74e048f3add6d21faab3f83aa44d3b2278afb83b80b3c35164ebeca205" },
+        { 6145, "f1323a8631446cc50536a9f705ee5cb619424d46887f3c376c695b70e0f0507f" },
+        { 7168, "61da957ec2499a95d6b8023e2b0e604ec7f6b50e80a9678b89d2628e99ada77a" },
+        { 7169, "a003fc7a51754a9b3c7fae0367ab3d782dccf28855a03d435f8cfe74605e7817" },
+        { 8192, "aae792484c8efe4f19e2ca7d371d8c467ffb10748d8a5a1ae579948f718a2a63" },
+        { 8193, "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b" },
+        { 16384, "f875d6646de28985646f34ee13be9a576fd515f76b5b0a26bb324735041ddde4" },
+        { 31744, "62b6960e1a44bcc1eb1a611a8d6235b6b4b78f32e7abc4fb4c6cdcce94895c47" },
+        { 102400, "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085" },
+        { 262145, "531c319935cf78f34869faebd865e5748266b1799039103bfb851a680d9ed30c" },
+        { 2097152, "96fbba37478c16b7614c890b26832f67b541cf14e69ab8ebf0c739818588c9f1" },
+    };
+    for (const auto& v : blake3)
+        for (bool pieces : { false, true }) {
+            Blake3Hasher h;
+            feed(pattern.data(), v.n, pieces, [&](const uint8_t* p, size_t n) { h.Update(p, n); });
+            if (hex(h.Final().data(), 32) != v.hex) fail(L"BLAKE3");
+        }
+
+    // BLAKE2sp: the AVX2 stripe against eight scalar compressions.
+#if defined(_M_X64) || defined(__x86_64__)
+    if (IsProcessorFeaturePresent(PF_AVX2_INSTRUCTIONS_AVAILABLE)) {
+        uint32_t scalar[8][8], avx2[8][8];
+        for (int j = 0; j < 8; ++j) { memcpy(scalar[j], kBlake2sIV, sizeof(kBlake2sIV)); memcpy(avx2[j], kBlake2sIV, sizeof(kBlake2sIV)); }
+        for (size_t s = 0; s < 64; ++s) {
+            for (int j = 0; j < 8; ++j) Blake2sCompress(scalar[j], random.data() + s * 512 + j * 64, (s + 1) * 64, false, false);
+            Blake2sStripeAvx2(avx2, random.data() + s * 512, (s + 1) * 64);
+        }
+        if (memcmp(scalar, avx2, sizeof(scalar)) != 0) fail(L"BLAKE2sp AVX2");
+    }
+#endif
+    return failed;
+}
+
+// Bytes per second of pass(instance), repeated on `instances` instances at
+// once until the time is up. Each instance gets its own thread (not the
+// executor, where an instance could wait for a worker past the deadline), and
+// the clock starts once every thread is up.
+static double BenchRate(size_t instances, size_t bytesPerPass, const std::function<bool(size_t)>& pass) {
+    std::atomic<uint64_t> bytes{ 0 };
+    std::atomic<bool> failed{ false };
+    std::atomic<size_t> ready{ 0 };
+    std::atomic<double> end{ 0 };
+    auto run = [&](size_t i) {
+        ready.fetch_add(1);
+        double stop;
+        while ((stop = end.load()) == 0) std::this_thread::yield();
+        uint64_t done = 0;
+        do {
+            if (!pass(i)) { failed = true; return; }
+            done += bytesPerPass;
+        } while (NowSeconds() < stop);
+        bytes += done;
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < instances; ++i) threads.emplace_back(run, i);
+    while (ready.load() < instances - 1) std::this_thread::yield();
+    const double t0 = NowSeconds();
+    end.store(t0 + kBenchSeconds);
+    run(0);
+    for (auto& t : threads) t.join();
+    return failed ? 0 : double(bytes.load()) / (NowSeconds() - t0);
+}
+
+// Runs everything, stores the results and returns the report.
+static std::wstring RunBenchmark() {
+    const unsigned threads = WorkerCount();
+    const bool avx2 = IsProcessorFeaturePresent(PF_AVX2_INSTRUCTIONS_AVAILABLE) != FALSE;
+    const bool sse42 = IsProcessorFeaturePresent(PF_SSE4_2_INSTRUCTIONS_AVAILABLE) != FALSE;
+    const std::vector<uint8_t> random = BenchRandomBytes(kBenchBytes);
+    const std::wstring sample = BenchText(kBenchBytes / sizeof(wchar_t));
+    const std::vector<uint8_t> text16(reinterpret_cast<const uint8_t*>(sample.data()),
+                                      reinterpret_cast<const uint8_t*>(sample.data() + sample.size()));
+    const std::string utf8 = ToUtf8(sample);
+    const std::vector<uint8_t> text8(utf8.begin(), utf8.end());
+
+    std::vector<BenchKernel> kernels;
+    kernels.push_back({ L"CRC32", L"slice-8", BenchCrc32, &random });
+    kernels.push_back({ L"CRC32C", L"slice-8", BenchCrc32cSoft, &random });
+#if defined(_M_X64) || defined(__x86_64__)
+    if (sse42) kernels.push_back({ L"CRC32C", L"SSE4.2", BenchCrc32cHard, &random });
+    kernels.push_back({ L"XXH128", L"SSE2", BenchXxh3<XxhAccumulateSse2, XxhScrambleSse2>, &random });
+    if (avx2) kernels.push_back({ L"XXH128", L"AVX2", BenchXxh3<XxhAccumulateAvx2, XxhScrambleAvx2>, &random });
+#else
+    kernels.push_back({ L"XXH128", L"scalar", BenchXxh3<XxhAccumulateScalar, XxhScrambleScalar>, &random });
+#endif
+    kernels.push_back({ L"BLAKE3", L"scalar", BenchBlake3, &random });
+#if defined(_M_X64) || defined(__SSE2__)
+    kernels.push_back({ L"BLAKE3", L"SSE2x4", BenchBlake3Sse2, &random });
+#endif
+    kernels.push_back({ L"BLAKE2sp", L"scalar", BenchBlake2sp, &random });
+#if defined(_M_X64) || defined(__x86_64__)
+    if (avx2) kernels.push_back({ L"BLAKE2sp", L"AVX2", BenchBlake2spAvx2, &random });
+#endif
+    if (Sha256Provider()) kernels.push_back({ L"SHA256", L"CNG", BenchCng<Sha256Provider, 32>, &random });
+    if (Sha512Provider()) kernels.push_back({ L"SHA512", L"CNG", BenchCng<Sha512Provider, 64>, &random });
+    kernels.push_back({ L"UTF-16>8", L"SSE2", BenchToUtf8, &text16 });
+    kernels.push_back({ L"UTF-8>16", L"SSE2", BenchFromUtf8, &text8 });
+
+    const std::wstring benchKey = std::wstring(kSettingsKey) + L"\\Benchmark";
+    RegDeleteTreeW(HKEY_CURRENT_USER, benchKey.c_str()); // rows this CPU lacks must not linger
+    auto save = [&](const std::wstring& name, double rate) {
+        const DWORD kib = DWORD(std::min(rate / 1024, 4e9));
+        RegSetKeyValueW(HKEY_CURRENT_USER, benchKey.c_str(), name.c_str(), REG_DWORD, &kib, sizeof(kib));
+    };
+    auto pad = [](std::wstring s, size_t w, bool right) {
+        if (s.size() < w) s.insert(right ? 0 : s.size(), w - s.size(), L' ');
+        return s;
+    };
+    auto speed = [&](double rate) { return pad(rate > 0 ? std::to_wstring(uint64_t(rate / 1024)) : L"-", 12, true); };
+    const std::wstring mt = std::to_wstring(threads) + L"T";
+
+    std::wstring text = L"7-Zip shell extension benchmark: " + std::to_wstring(threads) + L" threads";
+    text += sse42 ? L", SSE4.2" : L"";
+    text += avx2 ? L", AVX2" : L"";
+    text += L", " + std::to_wstring(kBenchBytes >> 10) + L" KB buffers\r\n";
+    const std::vector<std::wstring> failed = SelfTest();
+    if (failed.empty()) {
+        text += L"Self-test: every kernel matches the published test vectors.\r\n\r\n";
+    } else {
+        text += L"Self-test FAILED:";
+        for (const std::wstring& f : failed) text += L" " + f + (&f == &failed.back() ? L"." : L",");
+        text += L" Those rows are not timed.\r\n\r\n";
+    }
+    text += L"Method   ISA           1T KiB/s " + pad(mt + L" KiB/s", 12, true) + L"  Scale\r\n";
+    text += L"-------- -------- ------------ ------------ ------\r\n";
+    for (const BenchKernel& k : kernels) {
+        const std::wstring name = std::wstring(k.method) + L" " + k.isa;
+        if (std::find_if(failed.begin(), failed.end(), [&](const std::wstring& f) { return f == name || f == k.method; }) != failed.end()) {
+            text += pad(k.method, 8, false) + L" " + pad(k.isa, 8, false) + L"       FAILED\r\n";
+            continue;
+        }
+        const std::vector<uint8_t>& in = *k.input;
+        std::atomic<uint64_t> sink{ 0 }; // keeps the results observable
+        auto pass = [&](size_t) { sink += k.run(in.data(), in.size()); return true; };
+        const double one = BenchRate(1, in.size(), pass);
+        const double all = threads > 1 ? BenchRate(threads, in.size(), pass) : one;
+        save(name, one);
+        save(name + L" MT", all);
+        wchar_t scale[16];
+        swprintf_s(scale, L"%6.2f", one > 0 ? all / one : 0.0);
+        text += pad(k.method, 8, false) + L" " + pad(k.isa, 8, false) + L" " + speed(one) + L" " + speed(all) + L" " +
+                scale + L"\r\n";
+    }
+
+    // Codecs: level 5 with one coder thread each, so the multi-thread column
+    // scales by instances like `7z b`'s; LZMA gets a 1 MB dictionary to keep
+    // one instance per thread affordable.
+    struct BenchCodec { const wchar_t* name; uint64_t method; uint32_t dictionary, threads; };
+    static const BenchCodec codecs[] = {
+        { L"LZMA", 0x030101, 1u << 20, 1 }, { L"Deflate", 0x040108, 0, 0 },
+        { L"BZip2", 0x040202, 0, 1 },       { L"PPMd", 0x030401, 0, 0 },
+    };
+    const std::vector<uint8_t> data = BenchCompressible(kBenchBytes);
+    std::wstring codecText;
+    for (const BenchCodec& c : codecs) {
+        std::vector<std::unique_ptr<InProcessCodec>> coders;
+        for (unsigned i = 0; i < threads; ++i) coders.push_back(std::make_unique<InProcessCodec>(c.method, 5, c.dictionary, c.threads));
+        if (!coders[0]->Ok()) continue;
+        std::vector<std::vector<uint8_t>> packed(threads), unpacked(threads, std::vector<uint8_t>(data.size()));
+        auto encode = [&](size_t i) { return coders[i]->Encode(data.data(), data.size(), packed[i]); };
+        auto decode = [&](size_t i) { return coders[i]->Decode(packed[i], unpacked[i].data(), data.size()); };
+        double rates[4];
+        rates[0] = BenchRate(1, data.size(), encode);
+        rates[1] = threads > 1 ? BenchRate(threads, data.size(), encode) : rates[0];
+        rates[2] = BenchRate(1, data.size(), decode);
+        rates[3] = threads > 1 ? BenchRate(threads, data.size(), decode) : rates[2];
+        if (unpacked[0] != data) rates[2] = rates[3] = 0; // a broken round trip must not look fast
+        const std::wstring name = std::wstring(c.name) + L":x5";
+        save(name + L" Encode", rates[0]);
+        save(name + L" Encode MT", rates[1]);
+        save(name + L" Decode", rates[2]);
+        save(name + L" Decode MT", rates[3]);
+        wchar_t ratio[16];
+        swprintf_s(ratio, L"%6.2f", packed[0].empty() ? 0.0 : double(data.size()) / double(packed[0].size()));
+        codecText += pad(name, 10, false) + L" " + ratio;
+        for (double r : rates) codecText += L" " + speed(r);
+        codecText += L"\r\n";
+    }
+    const DWORD saved = threads;
+    RegSetKeyValueW(HKEY_CURRENT_USER, benchKey.c_str(), L"Threads", REG_DWORD, &saved, sizeof(saved));
+
+    text += L"\r\n";
+    if (codecText.empty()) {
+        text += L"Codecs: 7z.dll is not available in-process; `7z b` measures them.\r\n";
+    } else {
+        text += L"                 Compressing KiB/s         Decompressing KiB/s\r\n";
+        text += L"Codec       Ratio           1T " + pad(mt, 12, true) + L"           1T " + pad(mt, 12, true) + L"\r\n";
+        text += L"---------- ------ ------------ ------------ ------------ ------------\r\n" + codecText;
+    }
+    return text;
+}
+
+// ---------- Update archive ----------
+// Keeps the DLL loaded until `process` exits, then deletes the temp `file`.
+static void DeleteWhenDone(HANDLE process, std::wstring file) {
+    InterlockedIncrement(&g_LockCount);
+    std::thread([process, file = std::move(file)] {
+        WaitForSingleObject(process, INFINITE);
+        CloseHandle(process);
+        DeleteFileW(file.c_str());
+        InterlockedDecrement(&g_LockCount);
+    }).detach();
+}
+static std::wstring SlashPath(std::wstring s) {
+    std::replace(s.begin(), s.end(), L'/', L'\\');
+    return s;
+}
+// Re-adds only what changed: the header is diffed against a scan of the
+// selection by relative path, size and mtime, and the result is handed to
+// "7zG u" as a list file. Falls back to plain "u" when the items do not share
+// one parent folder (relative names in a list file need a single base).
+static void UpdateArchiveCommand(const PathArena& paths, const std::wstring& archive) {
+    const auto sevenZG = Find7zTool(L"7zG.exe");
+    const std::wstring parent = std::filesystem::path(paths[0]).parent_path().wstring();
+
+    std::vector<ArchiveEntry> entries;
+    if (!paths.SameParent() || !ListArchive(archive, entries)) {
+        std::wstring args = L"u \"" + archive + L"\"";
+        for (auto& p : paths) args += L" \"" + p + L"\"";
+        ShellRun(sevenZG, args);
+        return;
+    }
+
+    std::vector<FileRecord> files;
+    ScanFiles(paths, files);
+
+    NameMap<const ArchiveEntry*> stored;
+    stored.reserve(entries.size());
+    for (auto& e : entries) if (!e.isDir) stored.emplace(SlashPath(e.path), &e);
+
+    // Zip keeps DOS times (2 s resolution); 7z keeps 100 ns.
+    constexpr uint64_t kTimeSlack = 2 * 10000000ull;
+    const size_t base = parent.size() + (parent.empty() || parent.back() == L'\\' ? 0 : 1);
+    std::wstring list;
+    size_t changed = 0;
+    for (auto& f : files) {
+        std::wstring rel = f.path.substr(base);
+        auto it = stored.find(SlashPath(rel));
+        if (it != stored.end()) {
+            const ArchiveEntry& e = *it->second;
+            uint64_t dt = e.mtime > f.mtime ? e.mtime - f.mtime : f.mtime - e.mtime;
+            if (e.size == f.size && e.mtime && dt <= kTimeSlack) continue;
+        }
+        list += rel + L"\r\n";
+        ++changed;
+    }
+    if (!changed) {
+        MessageBoxW(nullptr, (archive + L"\n\nThe archive is up to date.").c_str(), L"7-Zip", MB_OK | MB_ICONINFORMATION);
+        return;
+    }
+
+    wchar_t tmp[MAX_PATH]{}, listFile[MAX_PATH]{};
+    GetTempPathW(MAX_PATH, tmp);
+    GetTempFileNameW(tmp, L"7zu", 0, listFile);
+    HANDLE h = CreateFileW(listFile, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, nullptr);
+    if (h == INVALID_HANDLE_VALUE) return;
+    std::string data = ToUtf8(list);
+    DWORD written = 0;
+    WriteFile(h, data.data(), DWORD(data.size()), &written, nullptr);
+    CloseHandle(h);
+
+    HANDLE proc = ShellRunProcess(sevenZG, L"u -scsUTF-8 \"" + archive + L"\" @\"" + listFile + L"\"", parent);
+    if (proc) DeleteWhenDone(proc, listFile);
+    else DeleteFileW(listFile);
+}
+
+// ---------- Prompt ----------
+// Single-line text prompt built from an in-memory dialog template.
+struct PromptState { const wchar_t* label; std::wstring* value; };
+static INT_PTR CALLBACK PromptProc(HWND dlg, UINT msg, WPARAM wp, LPARAM lp) {
+    switch (msg) {
+    case WM_INITDIALOG: {
+        auto* st = reinterpret_cast<PromptState*>(lp);
+        SetWindowLongPtrW(dlg, GWLP_USERDATA, lp);
+        SetDlgItemTextW(dlg, 100, st->label);
+        SetDlgItemTextW(dlg, 101, st->value->c_str());
+        return TRUE;
+    }
+    case WM_COMMAND:
+        if (LOWORD(wp) == IDOK) {
+            auto* st = reinterpret_cast<PromptState*>(GetWindowLongPtrW(dlg, GWLP_USERDATA));
+            HWND edit = GetDlgItem(dlg, 101);
+            std::wstring v(size_t(GetWindowTextLengthW(edit)) + 1, L'\0');
+            v.resize(size_t(GetWindowTextW(edit, v.data(), int(v.size()))));
+            *st->value = std::move(v);
+            EndDialog(dlg, IDOK);
+            return TRUE;
+        }
+        if (LOWORD(wp) == IDCANCEL) { EndDialog(dlg, IDCANCEL); return TRUE; }
+        break;
+    }
+    return FALSE;
+}
+static bool PromptText(const wchar_t* title, const wchar_t* label, std::wstring& value) {
+    std::vector<WORD> t;
+    auto dw = [&](DWORD v) { t.push_back(LOWORD(v)); t.push_back(HIWORD(v)); };
+    auto str = [&](const wchar_t* s) { do t.push_back(WORD(*s)); while (*s++); };
+    auto item = [&](DWORD style, short x, short y, short cx, short cy, WORD id, WORD cls, const wchar_t* text) {
+        if (t.size() % 2) t.push_back(0); // items are DWORD aligned
+        dw(WS_CHILD | WS_VISIBLE | style); dw(0);
+        for (short v : { x, y, cx, cy }) t.push_back(WORD(v));
+        t.push_back(id);
+        t.push_back(0xFFFF); t.push_back(cls); // predefined class atom
+        str(text);
+        t.push_back(0); // no creation data
+    };
+    dw(WS_POPUP | WS_CAPTION | WS_SYSMENU | DS_MODALFRAME | DS_CENTER | DS_SETFONT); dw(0);
+    t.push_back(4);
+    for (short v : { 0, 0, 220, 62 }) t.push_back(WORD(v));
+    t.push_back(0); t.push_back(0); // no menu, default class
+    str(title);
+    t.push_back(9); str(L"Segoe UI");
+    item(SS_LEFT, 7, 7, 206, 9, 100, 0x0082, L"");
+    item(WS_BORDER | WS_TABSTOP | ES_AUTOHSCROLL, 7, 19, 206, 14, 101, 0x0081, L"");
+    item(WS_TABSTOP | BS_DEFPUSHBUTTON, 109, 40, 50, 14, IDOK, 0x0080, L"OK");
+    item(WS_TABSTOP | BS_PUSHBUTTON, 163, 40, 50, 14, IDCANCEL, 0x0080, L"Cancel");
+
+    PromptState st{ label, &value };
+    return DialogBoxIndirectParamW(g_hMod, reinterpret_cast<const DLGTEMPLATE*>(t.data()), GetForegroundWindow(),
+                                   PromptProc, reinterpret_cast<LPARAM>(&st)) == IDOK;
+}
+
+// ---------- Archive index ----------
+// "<folder>\7-Zip.index" lists every archive below the folder and every entry
+// in them, UTF-8 text:
+//   7ZINDEX 3
+//   <archive count>
+//   <size>\t<mtime>\t<archive path relative to folder>        (one per archive)
+//   <folded leaf name>\t<archive #>\t<size>\t<crc>\t<entry path>   (sorted)
+// Entry lines sort by their folded name so lookups are a binary search over
+// the mapped file. Rebuilding reuses the entries of archives whose size and
+// mtime are unchanged. Names are stored escaped (tab, CR, LF and '%' as %09,
+// %0D, %0A and %25): archives made elsewhere can hold any of them. Escaping
+// keeps prefixes prefixes, so the search escapes its query the same way.
+static const wchar_t kIndexName[] = L"7-Zip.index";
+
+static std::string IndexEscape(std::wstring_view name) {
+    std::string in = ToUtf8(name), out;
+    out.reserve(in.size());
+    for (char c : in) {
+        switch (c) {
+        case '\t': out += "%09"; break;
+        case '\n': out += "%0A"; break;
+        case '\r': out += "%0D"; break;
+        case '%': out += "%25"; break;
+        default: out += c;
+        }
+    }
+    return out;
+}
+static std::wstring IndexUnescape(std::string_view v) {
+    std::string out;
+    out.reserve(v.size());
+    for (size_t i = 0; i < v.size(); ++i) {
+        if (v[i] == '%' && i + 2 < v.size() && isxdigit(uint8_t(v[i + 1])) && isxdigit(uint8_t(v[i + 2]))) {
+            out += char(std::strtoul(std::string(v.substr(i + 1, 2)).c_str(), nullptr, 16));
+            i += 2;
+        } else {
+            out += v[i];
+        }
+    }
+    return FromUtf8(out);
+}
+
+static std::wstring LeafName(const std::wstring& p) {
+    size_t slash = p.find_last_of(L"\\/");
+    return slash == std::wstring::npos ? p : p.substr(slash + 1);
+}
+struct IndexedArchive {
+    std::wstring rel;
+    uint64_t size{ 0 }, mtime{ 0 };
+    std::vector<ArchiveEntry> entries;
+};
+static std::vector<std::string_view> SplitTabs(std::string_view line) {
+    std::vector<std::string_view> f;
+    for (size_t pos = 0;;) {
+        size_t tab = line.find('\t', pos);
+        f.push_back(line.substr(pos, tab == std::string_view::npos ? std::string_view::npos : tab - pos));
+        if (tab == std::string_view::npos) return f;
+        pos = tab + 1;
+    }
+}
+static uint64_t ParseU64(std::string_view v, int base = 10) {
+    return std::strtoull(std::string(v).c_str(), nullptr, base);
+}
+// Maps a file read-only; the view stays valid until the object is destroyed.
+struct MappedFile {
+    HANDLE file{ INVALID_HANDLE_VALUE }, map{ nullptr };
+    const char* data{ nullptr };
+    size_t size{ 0 };
+    explicit MappedFile(const std::wstring& path) {
+        file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, 0, nullptr);
+        LARGE_INTEGER sz{};
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &sz) || sz.QuadPart == 0) return;
+        map = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (map) data = static_cast<const char*>(MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0));
+        if (data) size = size_t(sz.QuadPart);
+    }
+    ~MappedFile() {
+        if (data) UnmapViewOfFile(data);
+        if (map) CloseHandle(map);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    std::string_view view() const { return { data, size }; }
+};
+// Parses the header of an index; `entriesAt` receives the offset of the sorted section.
+static bool ReadIndexHeader(std::string_view text, std::vector<IndexedArchive>& archives, size_t& entriesAt) {
+    auto nextLine = [&](size_t& pos) {
+        size_t eol = text.find('\n', pos);
+        if (eol == std::string_view::npos) eol = text.size();
+        std::string_view line = text.substr(pos, eol - pos);
+        pos = std::min(eol + 1, text.size());
+        return line;
+    };
+    size_t pos = 0;
+    if (nextLine(pos) != "7ZINDEX 3") return false; // older indexes are rebuilt from scratch
+    size_t count = size_t(ParseU64(nextLine(pos)));
+    archives.resize(count);
+    for (auto& a : archives) {
+        auto f = SplitTabs(nextLine(pos));
+        if (f.size() != 3) return false;
+        a.size = ParseU64(f[0]);
+        a.mtime = ParseU64(f[1]);
+        a.rel = IndexUnescape(f[2]);
+    }
+    entriesAt = pos;
+    return true;
+}
+static void LoadIndex(const std::wstring& file, std::vector<IndexedArchive>& archives) {
+    MappedFile m(file);
+    std::string_view text = m.view();
+    size_t pos = 0;
+    archives.clear();
+    if (!ReadIndexHeader(text, archives, pos)) { archives.clear(); return; }
+    while (pos < text.size()) {
+        size_t eol = text.find('\n', pos);
+        if (eol == std::string_view::npos) eol = text.size();
+        auto f = SplitTabs(text.substr(pos, eol - pos));
+        pos = eol + 1;
+        if (f.size() != 5) continue;
+        size_t idx = size_t(ParseU64(f[1]));
+        if (idx >= archives.size()) continue;
+        ArchiveEntry e;
+        e.size = ParseU64(f[2]);
+        e.hasCrc = !f[3].empty();
+        e.crc = uint32_t(ParseU64(f[3], 16));
+        e.path = IndexUnescape(f[4]);
+        archives[idx].entries.push_back(std::move(e));
+    }
+}
+static bool WriteFileAtomic(const std::wstring& path, const std::string& data) {
+    std::wstring tmp = path + L".tmp";
+    HANDLE h = CreateFileW(tmp.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (h == INVALID_HANDLE_VALUE) return false;
+    DWORD written = 0;
+    bool ok = WriteFile(h, data.data(), DWORD(data.size()), &written, nullptr) && written == data.size();
+    CloseHandle(h);
+    if (ok) ok = MoveFileExW(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != FALSE;
+    if (!ok) DeleteFileW(tmp.c_str());
+    return ok;
+}
+static void BuildArchiveIndexCommand(const std::wstring& folder) {
+    const std::wstring indexFile = Combine(folder, kIndexName);
+    std::vector<IndexedArchive> previous;
+    LoadIndex(indexFile, previous);
+    NameMap<IndexedArchive*> byRel;
+    for (auto& a : previous) byRel.emplace(a.rel, &a);
+
+    std::vector<FileRecord> files;
+    ScanFiles(PathArena({ folder }), files);
+    std::vector<IndexedArchive> archives;
+    const size_t base = folder.size() + (folder.back() == L'\\' ? 0 : 1);
+    for (auto& f : files) {
+        if (!IsArchiveExt(std::filesystem::path(f.path).extension().wstring())) continue;
+        archives.push_back({ f.path.substr(base), f.size, f.mtime, {} });
+    }
+
+    std::atomic<size_t> reused{ 0 };
+    ParallelFor(archives.size(), [&](size_t i) {
+        auto& a = archives[i];
+        auto it = byRel.find(a.rel);
+        if (it != byRel.end() && it->second->size == a.size && it->second->mtime == a.mtime) {
+            a.entries = std::move(it->second->entries);
+            ++reused;
+            return;
+        }
+        ListArchive(Combine(folder, a.rel), a.entries);
+    });
+
+    std::vector<std::string> rows;
+    for (size_t i = 0; i < archives.size(); ++i) {
+        for (auto& e : archives[i].entries) {
+            if (e.isDir) continue;
+            char num[64];
+            snprintf(num, sizeof(num), "\t%zu\t%llu\t", i, (unsigned long long)e.size);
+            std::string row = IndexEscape(FoldName(LeafName(e.path))) + num;
+            if (e.hasCrc) { snprintf(num, sizeof(num), "%08X", e.crc); row += num; }
+            row += '\t';
+            row += IndexEscape(e.path);
+            rows.push_back(std::move(row));
+        }
+    }
+    std::sort(rows.begin(), rows.end());
+
+    std::string out = "7ZINDEX 3\n" + std::to_string(archives.size()) + "\n";
+    for (auto& a : archives)
+        out += std::to_string(a.size) + "\t" + std::to_string(a.mtime) + "\t" + IndexEscape(a.rel) + "\n";
+    for (auto& r : rows) { out += r; out += '\n'; }
+
+    std::wstring text = WriteFileAtomic(indexFile, out)
+        ? L"Indexed " + std::to_wstring(archives.size()) + L" archives (" + std::to_wstring(reused.load()) +
+          L" unchanged), " + std::to_wstring(rows.size()) + L" entries.\n\n" + indexFile
+        : L"Could not write " + indexFile;
+    MessageBoxW(nullptr, text.c_str(), L"7-Zip", MB_OK | MB_ICONINFORMATION);
+}
+// Lists entries whose file name starts with `prefix` (case-insensitive).
+static void SearchArchiveIndexCommand(const std::wstring& folder) {
+    std::wstring query;
+    if (!PromptText(L"Search archive index", L"File name starts with:", query) || query.empty()) return;
+
+    MappedFile m(Combine(folder, kIndexName));
+    std::string_view text = m.view();
+    std::vector<IndexedArchive> archives;
+    size_t lo = 0;
+    if (!ReadIndexHeader(text, archives, lo)) return;
+    const std::string prefix = IndexEscape(FoldName(query));
+    auto keyAt = [&](size_t line) {
+        size_t tab = text.find('\t', line);
+        return text.substr(line, (tab == std::string_view::npos ? text.size() : tab) - line);
+    };
+
+    // Lower bound over lines: first line whose key is >= prefix.
+    size_t hi = text.size();
+    while (lo < hi) {
+        size_t line = lo + (hi - lo) / 2;
+        while (line > lo && text[line - 1] != '\n') --line;
+        if (keyAt(line) < prefix) {
+            size_t eol = text.find('\n', line);
+            lo = eol == std::string_view::npos ? text.size() : eol + 1;
+        } else {
+            hi = line;
+        }
+    }
+
+    std::wstring report = L"Entries starting with \"" + query + L"\" in " + folder + L"\r\n\r\n";
+    size_t hits = 0;
+    for (size_t pos = lo; pos < text.size(); ) {
+        size_t eol = text.find('\n', pos);
+        if (eol == std::string_view::npos) eol = text.size();
+        auto f = SplitTabs(text.substr(pos, eol - pos));
+        pos = eol + 1;
+        if (f.size() != 5 || f[0].substr(0, prefix.size()) != prefix) break;
+        size_t idx = size_t(ParseU64(f[1]));
+        if (idx >= archives.size()) continue;
+        report += archives[idx].rel + L" : " + IndexUnescape(f[4]) +
+                  L"  (" + FromUtf8(std::string(f[2])) + L" bytes)\r\n";
+        ++hits;
+    }
+    report += L"\r\n" + std::to_wstring(hits) + L" matches\r\n";
+    ShowReport(L"7-Zip Index Search.txt", report);
+}
+
+// ---------- Extract pre-flight ----------
+// Before "Extract Here" runs 7zG with -y, sum the unpacked sizes from each
+// header and check them against free space on the destination volume, and
+// look for names that already exist: one listing of the destination folder
+// into a hash set covers top-level names; only entries below an existing
+// top-level folder are probed individually. Each archive's plan then decides
+// its own 7zG switches. The checks share PreflightBudgetMs (default 1000):
+// an archive whose check has not finished by then (a 1M-entry listing through
+// 7z.exe can take longer) is extracted without -y, so 7zG asks about each
+// conflict itself instead of the extension guessing.
+struct ExtractPlan {
+    std::wstring archive, dest;
+    bool listed{ false };
+    uint64_t bytes{ 0 };
+    std::vector<std::wstring> collided; // entry paths that exist under dest
+};
+static std::wstring FormatSize(uint64_t bytes) {
+    wchar_t buf[32];
+    if (bytes >= (1ull << 30)) swprintf_s(buf, L"%.1f GB", double(bytes) / double(1ull << 30));
+    else swprintf_s(buf, L"%.1f MB", double(bytes) / double(1ull << 20));
+    return buf;
+}
+// `late` is raised once nobody waits for the result any more; it also stops
+// the listing, so a late check gives its job thread back promptly.
+static void PreflightExtract(ExtractPlan& plan, const std::atomic<bool>& late) {
+    std::vector<ArchiveEntry> entries;
+    if (!ListArchive(plan.archive, entries, &late)) return;
+    plan.listed = true;
+    for (auto& e : entries) plan.bytes += e.size;
+    if (!IsDirectoryPath(plan.dest)) return;
+
+    NameMap<bool> existing; // name -> is directory
+    std::vector<FileRecord> files;
+    std::vector<std::wstring> dirs;
+    ListDirectory(plan.dest, files, dirs);
+    for (auto& f : files) existing.emplace(LeafName(f.path), false);
+    for (auto& d : dirs) existing.emplace(LeafName(d), true);
+
+    for (auto& e : entries) {
+        if (e.isDir) continue;
+        if (late) { plan.listed = false; return; }
+        size_t slash = e.path.find_first_of(L"\\/");
+        auto it = existing.find(e.path.substr(0, slash));
+        if (it == existing.end()) continue;
+        if (slash != std::wstring::npos && it->second && !FileExists(Combine(plan.dest, e.path))) continue;
+        plan.collided.push_back(e.path);
+    }
+}
+// Checks every plan within the budget; returns, per plan, whether its check
+// finished in time (only those plans are filled in).
+static std::vector<bool> PreflightAll(std::vector<ExtractPlan>& plans, double budget) {
+    struct Shared {
+        std::vector<ExtractPlan> plans;
+        std::vector<std::atomic<bool>> done;
+        std::atomic<bool> late{ false };
+        std::mutex lock;
+        std::condition_variable finished;
+        size_t left;
+        explicit Shared(std::vector<ExtractPlan> p) : plans(std::move(p)), done(plans.size()), left(plans.size()) {}
+    };
+    auto sh = std::make_shared<Shared>(std::move(plans));
+    for (size_t i = 0; i < sh->plans.size(); ++i) {
+        PostJob([sh, i] {
+            PreflightExtract(sh->plans[i], sh->late);
+            sh->done[i].store(true, std::memory_order_release);
+            std::lock_guard<std::mutex> g(sh->lock);
+            if (--sh->left == 0) sh->finished.notify_all();
+        });
+    }
+    {
+        std::unique_lock<std::mutex> lk(sh->lock);
+        sh->finished.wait_for(lk, std::chrono::duration<double>(budget), [&] { return sh->left == 0; });
+        sh->late = true;
+    }
+    // Late checks still write into their own plan: copy only the finished ones.
+    std::vector<bool> ok(sh->plans.size());
+    plans.resize(sh->plans.size());
+    for (size_t i = 0; i < ok.size(); ++i) {
+        ok[i] = sh->done[i].load(std::memory_order_acquire) && sh->plans[i].listed;
+        plans[i].archive = sh->plans[i].archive;
+        plans[i].dest = sh->plans[i].dest;
+        if (ok[i]) plans[i] = sh->plans[i];
+    }
+    return ok;
+}
+static void ExtractHereCommand(const PathArena& paths) {
+    const auto sevenZG = Find7zTool(L"7zG.exe");
+    std::vector<ExtractPlan> plans(paths.size());
+    size_t n = 0;
+    for (auto& archive : paths) {
+        std::filesystem::path parent = std::filesystem::path(archive).parent_path();
+        plans[n].archive = archive;
+        // Classic single-archive behavior: extract into parent folder of the archive.
+        // SMART multi-archive behavior: each archive into its own folder.
+        plans[n++].dest = paths.size() == 1 ? parent.wstring() : (parent / BaseName(archive)).wstring();
+    }
+    const auto checked = PreflightAll(plans, ReadSetting(L"PreflightBudgetMs", 1000) / 1000.0);
 
-// Export COM entry points on x64 without a .def (harmless if also supplied via .def)
-#if defined(_M_X64) || defined(_WIN64)
-#pragma comment(linker, "/EXPORT:DllGetClassObject")
-#pragma comment(linker, "/EXPORT:DllCanUnloadNow")
-#endif
+    // Free space, per destination volume.
+    std::unordered_map<std::wstring, uint64_t> needed;
+    for (size_t i = 0; i < plans.size(); ++i) {
+        wchar_t vol[MAX_PATH]{};
+        std::wstring parent = std::filesystem::path(plans[i].archive).parent_path().wstring();
+        if (checked[i] && GetVolumePathNameW(parent.c_str(), vol, MAX_PATH)) needed[vol] += plans[i].bytes;
+    }
+    for (auto& [vol, bytes] : needed) {
+        ULARGE_INTEGER avail{};
+        if (GetDiskFreeSpaceExW(vol.c_str(), &avail, nullptr, nullptr) && avail.QuadPart < bytes) {
+            std::wstring msg = L"Not enough free space on " + vol + L"\n\nNeeded: " + FormatSize(bytes) +
+                               L"\nAvailable: " + FormatSize(avail.QuadPart);
+            MessageBoxW(nullptr, msg.c_str(), L"7-Zip", MB_OK | MB_ICONERROR);
+            return;
+        }
+    }
 
-// {7C9F3AA6-4D07-4E1D-8B86-0F5A4E4F44AC}
-static const CLSID CLSID_SevenZipExplorer =
-{ 0x7c9f3aa6, 0x4d07, 0x4e1d, { 0x8b, 0x86, 0x0f, 0x5a, 0x4e, 0x4f, 0x44, 0xac } };
+    size_t collisions = 0;
+    std::wstring examples;
+    for (auto& p : plans) {
+        for (auto& c : p.collided)
+            if (collisions++ < 5) examples += Combine(p.dest, c) + L"\n";
+    }
+    std::wstring overwrite = L"-aoa";
+    if (collisions) {
+        std::wstring msg = std::to_wstring(collisions) + L" file(s) already exist, e.g.\n" + examples +
+            L"\nYes: overwrite them\nNo: keep both (extracted copies are renamed)\nCancel: do nothing";
+        switch (MessageBoxW(nullptr, msg.c_str(), L"7-Zip", MB_YESNOCANCEL | MB_ICONWARNING)) {
+        case IDYES: break;
+        case IDNO: overwrite = L"-aou"; break;
+        default: return;
+        }
+    }
+    for (size_t i = 0; i < plans.size(); ++i) {
+        auto& p = plans[i];
+        // Unchecked: let 7zG ask. Checked without conflicts: never overwrite what
+        // may have appeared since. Otherwise: the user's answer.
+        std::wstring mode = !checked[i] ? L"" : p.collided.empty() ? L"-y -aos " : L"-y " + overwrite + L" ";
+        ShellRun(sevenZG, L"x " + mode + L"-o\"" + p.dest + L"\\\" \"" + p.archive + L"\"");
+    }
+}
 
-static HMODULE g_hMod = nullptr;
-static LONG g_ObjCount = 0;
-static LONG g_LockCount = 0;
+// ---------- Compare with archive ----------
+// Checks the folder "Extract to" would create against the archive header:
+// sizes and stored CRC-32s come from the listing (nothing is decompressed),
+// and only same-size files are read and CRC'd, in parallel.
+static void CompareWithArchiveCommand(const std::wstring& archive) {
+    std::filesystem::path parent = std::filesystem::path(archive).parent_path();
+    const std::wstring folder = (parent / BaseName(archive)).wstring();
+    if (!IsDirectoryPath(folder)) {
+        MessageBoxW(nullptr, (L"Folder not found:\n" + folder).c_str(), L"7-Zip", MB_OK | MB_ICONWARNING);
+        return;
+    }
+    std::vector<ArchiveEntry> entries;
+    if (!ListArchive(archive, entries)) {
+        MessageBoxW(nullptr, (L"Cannot read archive:\n" + archive).c_str(), L"7-Zip", MB_OK | MB_ICONERROR);
+        return;
+    }
+    std::vector<FileRecord> files;
+    ScanFiles(PathArena({ folder }), files);
+    const size_t base = folder.size() + 1;
+    NameMap<size_t> onDisk;
+    onDisk.reserve(files.size());
+    for (size_t i = 0; i < files.size(); ++i) onDisk.emplace(files[i].path.substr(base), i);
 
-// ---------- helpers ----------
-static std::wstring GetModuleDir(HMODULE mod) {
-    wchar_t buf[MAX_PATH]{};
-    GetModuleFileNameW(mod, buf, MAX_PATH);
-    PathRemoveFileSpecW(buf);
-    return buf;
+    enum class State { Same, Missing, Changed, Unverified };
+    std::vector<State> state(entries.size(), State::Same);
+    std::vector<bool> matched(files.size(), false);
+    std::vector<std::pair<size_t, size_t>> toHash; // (entry, file)
+    for (size_t i = 0; i < entries.size(); ++i) {
+        auto& e = entries[i];
+        if (e.isDir) continue;
+        auto it = onDisk.find(SlashPath(e.path));
+        if (it == onDisk.end()) { state[i] = State::Missing; continue; }
+        matched[it->second] = true;
+        if (files[it->second].size != e.size) state[i] = State::Changed;
+        else if (!e.hasCrc) state[i] = State::Unverified;
+        else toHash.push_back({ i, it->second });
+    }
+    std::vector<std::wstring> hashPaths;
+    for (auto& th : toHash) hashPaths.push_back(files[th.second].path);
+    auto crcs = HashFiles(hashPaths, HashKind::Crc32);
+    for (size_t k = 0; k < toHash.size(); ++k)
+        if (!crcs[k].ok || DigestU32(crcs[k].digest) != entries[toHash[k].first].crc)
+            state[toHash[k].first] = State::Changed;
+
+    std::wstring missing, changed, added;
+    size_t same = 0, unverified = 0, nMissing = 0, nChanged = 0, nAdded = 0;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (entries[i].isDir) continue;
+        switch (state[i]) {
+        case State::Same: ++same; break;
+        case State::Unverified: ++unverified; break;
+        case State::Missing: missing += L"  " + entries[i].path + L"\r\n"; ++nMissing; break;
+        case State::Changed: changed += L"  " + entries[i].path + L"\r\n"; ++nChanged; break;
+        }
+    }
+    for (size_t i = 0; i < files.size(); ++i)
+        if (!matched[i]) { added += L"  " + files[i].path.substr(base) + L"\r\n"; ++nAdded; }
+
+    std::wstring report = L"Archive: " + archive + L"\r\nFolder:  " + folder + L"\r\n\r\n" +
+        std::to_wstring(same) + L" identical, " + std::to_wstring(nChanged) + L" changed, " +
+        std::to_wstring(nMissing) + L" missing, " + std::to_wstring(nAdded) + L" added";
+    if (unverified) report += L", " + std::to_wstring(unverified) + L" same size (no CRC stored)";
+    report += L"\r\n";
+    if (nChanged) report += L"\r\nChanged:\r\n" + changed;
+    if (nMissing) report += L"\r\nMissing:\r\n" + missing;
+    if (nAdded) report += L"\r\nAdded:\r\n" + added;
+    ShowReport(L"7-Zip Compare.txt", report);
 }
-static std::wstring Combine(const std::wstring& a, const std::wstring& b) {
-    wchar_t out[MAX_PATH]{};
-    wcscpy_s(out, a.c_str());
-    PathAppendW(out, b.c_str());
+
+// ---------- Search in archives ----------
+// Entries are decoded in-process when 7z.dll is available (each entry arrives
+// on its own stream) or streamed through "7z x -so" (entries come out back to
+// back in header order, so cumulative sizes from the listing map a stream
+// offset back to its entry). Either way decoded data is scanned where it lies;
+// only the last (longest pattern - 1) bytes are kept between pieces so matches
+// spanning two pieces are still seen, but never across two entries. When the
+// listing has no sizes, or 7z.exe reports an error (an entry that fails to
+// decode shortens the stream), stream offsets cannot be mapped back and hits
+// are reported without entry or offset. Archives are processed in parallel.
+struct GrepHit {
+    static constexpr size_t kNoEntry = SIZE_MAX;
+    size_t entry; uint64_t offset; size_t pattern;
+};
+struct GrepResult {
+    std::vector<ArchiveEntry> entries;
+    std::vector<GrepHit> hits;
+    uint64_t streamed{ 0 };
+    bool truncated{ false };
+};
+
+class LiteralMatcher {
+public:
+    explicit LiteralMatcher(const std::vector<std::string>& patterns) : m_patterns(patterns) {
+        for (auto& p : m_patterns) { m_searchers.emplace_back(p.begin(), p.end()); m_longest = std::max(m_longest, p.size()); }
+    }
+    LiteralMatcher(const LiteralMatcher&) = delete;
+    LiteralMatcher& operator=(const LiteralMatcher&) = delete;
+
+    void Reset() { m_tail.clear(); m_pos = 0; }
+    // Calls hit(offset, pattern) for every match ending inside this piece;
+    // offsets count from the last Reset().
+    template<class F> void Feed(const char* data, size_t n, F&& hit) {
+        const size_t keep = m_longest - 1;
+        if (!m_tail.empty()) { // matches starting in the tail and ending in this piece
+            m_seam.assign(m_tail);
+            m_seam.append(data, std::min(n, keep));
+            Scan(m_seam.data(), m_seam.size(), m_pos - m_tail.size(), m_tail.size(), m_tail.size(), hit);
+        }
+        Scan(data, n, m_pos, n, 0, hit);
+        if (n >= keep) m_tail.assign(data + n - keep, keep);
+        else { m_tail.append(data, n); if (m_tail.size() > keep) m_tail.erase(0, m_tail.size() - keep); }
+        m_pos += n;
+    }
+private:
+    // Reports matches in [b, b + n) starting before maxStart and ending after minEnd.
+    template<class F> void Scan(const char* b, size_t n, uint64_t base, size_t maxStart, size_t minEnd, F& hit) {
+        const char* e = b + n;
+        for (size_t k = 0; k < m_searchers.size(); ++k) {
+            for (const char* m = b; ; ++m) {
+                m = std::search(m, e, m_searchers[k]);
+                if (m == e || size_t(m - b) >= maxStart) break;
+                if (size_t(m - b) + m_patterns[k].size() > minEnd) hit(base + uint64_t(m - b), k);
+            }
+        }
+    }
+    std::vector<std::string> m_patterns;
+    std::vector<std::boyer_moore_horspool_searcher<std::string::const_iterator>> m_searchers;
+    size_t m_longest{ 1 };
+    std::string m_tail, m_seam;
+    uint64_t m_pos{ 0 };
+};
+
+static std::vector<std::string> SplitPatterns(const std::wstring& query) {
+    std::vector<std::string> out;
+    size_t start = 0;
+    for (size_t bar; start <= query.size(); start = bar + 1) {
+        bar = query.find(L'|', start);
+        if (bar == std::wstring::npos) bar = query.size();
+        if (bar > start) out.push_back(ToUtf8(query.substr(start, bar - start)));
+    }
     return out;
 }
-static bool FileExists(const std::wstring& p) {
-    DWORD a = GetFileAttributesW(p.c_str());
-    return (a != INVALID_FILE_ATTRIBUTES) && !(a & FILE_ATTRIBUTE_DIRECTORY);
+static void GrepArchive(const std::wstring& archive, const std::vector<std::string>& patterns, GrepResult& r) {
+    constexpr size_t kMaxHits = 1000;
+    auto& entries = r.entries;
+    auto& hits = r.hits;
+    if (!ListArchive(archive, entries)) return;
+    LiteralMatcher matcher(patterns);
+    auto full = [&] { return r.truncated = r.truncated || hits.size() >= kMaxHits; };
+
+    // In-process: item indices match the (in-process) listing.
+    uint32_t current = UINT32_MAX;
+    bool inProcess = ExtractInProcess(archive, [&](uint32_t index, const char* data, size_t n) {
+        if (index >= entries.size()) return false;
+        if (index != current) { current = index; matcher.Reset(); }
+        matcher.Feed(data, n, [&](uint64_t off, size_t k) {
+            if (!full()) hits.push_back({ index, off, k });
+        });
+        r.streamed += n;
+        return !full();
+    });
+    if (inProcess) return;
+
+    // 7z.exe: walk the stream entry by entry using the listed sizes, resetting
+    // the matcher at every boundary so a match never spans two entries.
+    std::vector<size_t> order; // file entries with data, in stream order
+    bool sized = true;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (entries[i].isDir) continue;
+        sized = sized && entries[i].hasSize;
+        if (entries[i].size) order.push_back(i);
+    }
+    size_t at = 0;         // position in order
+    uint64_t left = sized && !order.empty() ? entries[order[0]].size : UINT64_MAX;
+    std::vector<GrepHit> found;
+    DWORD code = 0;
+    bool ran = RunPiped(Find7zTool(L"7z.exe"), L"x -so -bd -y \"" + archive + L"\"", [&](HANDLE rd) {
+        auto buf = BlockCache::Take();
+        DWORD got = 0;
+        while (found.size() < kMaxHits && ReadFile(rd, buf.get(), DWORD(BlockCache::kSize), &got, nullptr) && got) {
+            const char* p = reinterpret_cast<const char*>(buf.get());
+            r.streamed += got;
+            for (size_t n = got; n && found.size() < kMaxHits; ) {
+                if (sized && at >= order.size()) break; // more data than listed: mapping is off
+                size_t take = size_t(std::min<uint64_t>(n, left));
+                const size_t entry = sized ? order[at] : GrepHit::kNoEntry;
+                matcher.Feed(p, take, [&](uint64_t off, size_t k) {
+                    if (found.size() < kMaxHits) found.push_back({ entry, off, k });
+                });
+                p += take; n -= take;
+                if (sized && (left -= take) == 0) {
+                    matcher.Reset();
+                    if (++at < order.size()) left = entries[order[at]].size;
+                }
+            }
+        }
+    }, &code);
+    r.truncated = found.size() >= kMaxHits;
+    // Stopping early closes the pipe, so 7z.exe's exit code only counts when it ran to the end.
+    bool mapped = sized && ran && (r.truncated || (code == 0 && at == order.size()));
+    for (auto& h : found) {
+        if (!mapped) h = { GrepHit::kNoEntry, 0, h.pattern };
+        hits.push_back(h);
+    }
+    std::stable_sort(hits.begin(), hits.end(), [](auto& a, auto& b) { return a.entry != b.entry ? a.entry < b.entry : a.offset < b.offset; });
 }
-static void ShellRun(const std::wstring& exe, const std::wstring& args, const std::wstring& cwd = L"") {
-    SHELLEXECUTEINFOW sei{ sizeof(sei) };
-    sei.fMask = SEE_MASK_NOASYNC | SEE_MASK_FLAG_NO_UI;
-    sei.lpFile = exe.c_str();
-    sei.lpParameters = args.empty() ? nullptr : args.c_str();
-    sei.lpDirectory = cwd.empty() ? nullptr : cwd.c_str();
-    sei.nShow = SW_SHOWNORMAL;
-    ShellExecuteExW(&sei);
+static void SearchInArchivesCommand(const PathArena& archives) {
+    std::wstring query;
+    if (!PromptText(L"Search in archives", L"Text to find (separate alternatives with |):", query)) return;
+    auto patterns = SplitPatterns(query);
+    if (patterns.empty()) return;
+
+    std::vector<GrepResult> results(archives.size());
+    double t0 = NowSeconds();
+    ParallelFor(archives.size(), [&](size_t i) { GrepArchive(archives[i], patterns, results[i]); });
+    double secs = std::max(NowSeconds() - t0, 1e-6);
+
+    std::wstring report = L"Search for \"" + query + L"\"\r\n\r\n";
+    size_t total = 0;
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < archives.size(); ++i) {
+        auto& r = results[i];
+        for (auto& h : r.hits) {
+            report += archives[i] + L" : ";
+            if (h.entry == GrepHit::kNoEntry) report += L"(entry unknown)";
+            else report += r.entries[h.entry].path + L" @ " + std::to_wstring(h.offset);
+            report += L"  [" + FromUtf8(patterns[h.pattern]) + L"]\r\n";
+        }
+        if (r.truncated)
+            report += archives[i] + L" : results truncated after " + std::to_wstring(r.hits.size()) + L" matches\r\n";
+        total += r.hits.size();
+        bytes += r.streamed;
+    }
+    wchar_t rate[64];
+    swprintf_s(rate, L"%.1f MB in %.2f s (%.2f GB/s)", double(bytes) / 1e6, secs, double(bytes) / 1e9 / secs);
+    report += L"\r\n" + std::to_wstring(total) + L" matches; scanned " + rate + L"\r\n";
+    ShowReport(L"7-Zip Search.txt", report);
 }
-static std::wstring Find7zTool(const std::wstring& name) {
-    auto here = GetModuleDir(g_hMod);
-    auto p = Combine(here, name);
-    if (FileExists(p)) return p;
-    return name; // PATH fallback
+
+// ---------- Compression switches ----------
+// Many small, similar files (configs, JSON, sources) compress best when like
+// files sit next to each other in one solid stream, so the LZMA window acts as
+// a shared dictionary. 7z archives are solid by default, so what this adds is
+// -mqs=on: sort by type, so like files do end up next to each other. A sample
+// of at most 4096 files (ScanFiles stops mid-directory) decides whether the
+// selection looks like that; large selections are never scanned in full.
+static bool LooksLikeSmallFileSet(const PathArena& paths) {
+    constexpr size_t kSample = 4096, kMinFiles = 256;
+    constexpr uint64_t kSmall = 64 * 1024;
+    std::vector<FileRecord> files;
+    ScanFiles(paths, files, kSample);
+    if (files.size() < kMinFiles) return false;
+    size_t small = 0;
+    for (auto& f : files) if (f.size <= kSmall) ++small;
+    return small * 5 >= files.size() * 4; // >= 80% small
 }
-static std::wstring GetItemPath(IShellItem* it) {
-    LPWSTR s = nullptr; std::wstring out;
-    if (SUCCEEDED(it->GetDisplayName(SIGDN_FILESYSPATH, &s)) && s) { out = s; CoTaskMemFree(s); }
+// Extra "a" switches for a .7z built from this selection.
+static std::wstring SevenZipAddSwitches(const PathArena& paths) {
+    return LooksLikeSmallFileSet(paths) ? L"-mqs=on " : L"";
+}
+
+// ---------- Automatic compression level ----------
+// Opt-in (AutoLevel = 1): among the -mx levels whose projected time for the
+// whole selection fits AutoBudgetSeconds (default 300), pick the one with the
+// best measured ratio; a stronger level must gain at least 1% over a faster
+// one to be worth its time. The projection comes from compressing a small
+// sample of the selection at each level with 7z.exe on this machine. A
+// store-only run is timed too and subtracted, so the fixed cost of starting
+// 7z.exe does not count as compression time. The sample is small enough that
+// LZMA2 may not use every core, which errs on the side of finishing early.
+struct LevelSpeed { int level; double bytesPerSec; double ratio; };
+
+static uint64_t FileSizeOf(const std::wstring& p) {
+    WIN32_FILE_ATTRIBUTE_DATA fad{};
+    if (!GetFileAttributesExW(p.c_str(), GetFileExInfoStandard, &fad)) return 0;
+    return (uint64_t(fad.nFileSizeHigh) << 32) | fad.nFileSizeLow;
+}
+// Concatenates up to `chunks` pieces of `chunkSize` bytes, taken from the
+// middle of the largest files of a bounded scan, into `sampleFile`.
+static uint64_t WriteSample(const PathArena& paths, const std::wstring& sampleFile,
+                            size_t chunks, uint32_t chunkSize) {
+    std::vector<FileRecord> files;
+    ScanFiles(paths, files, 4096);
+    std::sort(files.begin(), files.end(), [](auto& a, auto& b) { return a.size > b.size; });
+
+    HANDLE out = CreateFileW(sampleFile.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, nullptr);
+    if (out == INVALID_HANDLE_VALUE) return 0;
+    std::vector<uint8_t> buf(chunkSize);
+    uint64_t total = 0;
+    for (size_t i = 0; i < files.size() && i < chunks; ++i) {
+        HANDLE f = CreateFileW(files[i].path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                               OPEN_EXISTING, 0, nullptr);
+        if (f == INVALID_HANDLE_VALUE) continue;
+        uint64_t off = files[i].size > chunkSize ? (files[i].size - chunkSize) / 2 : 0;
+        DWORD got = 0, written = 0;
+        if (ReadAt(f, off, buf.data(), chunkSize, got) && got) {
+            WriteFile(out, buf.data(), got, &written, nullptr);
+            total += written;
+        }
+        CloseHandle(f);
+    }
+    CloseHandle(out);
+    return total;
+}
+// Times "7z a -t<type> -mx=<level>" over the sample for every level.
+static std::vector<LevelSpeed> CalibrateLevels(const PathArena& paths, const wchar_t* type,
+                                               const std::vector<int>& levels) {
+    std::vector<LevelSpeed> result;
+    wchar_t tmp[MAX_PATH]{}, sample[MAX_PATH]{};
+    GetTempPathW(MAX_PATH, tmp);
+    GetTempFileNameW(tmp, L"7zs", 0, sample);
+    const std::wstring archive = std::wstring(sample) + L".arc";
+    const uint64_t sampleBytes = WriteSample(paths, sample, 4, 2u << 20);
+    const auto sevenZ = Find7zTool(L"7z.exe");
+
+    auto timeLevel = [&](int level, uint64_t& packed) {
+        DeleteFileW(archive.c_str()); // "a" would otherwise append
+        std::string ignored;
+        double t0 = NowSeconds();
+        RunCapture(sevenZ, L"a -bd -y -t" + std::wstring(type) + L" -mx=" + std::to_wstring(level) +
+                           L" \"" + archive + L"\" \"" + sample + L"\"", ignored);
+        double t = NowSeconds() - t0;
+        packed = FileSizeOf(archive);
+        return t;
+    };
+    if (sampleBytes) {
+        uint64_t packed = 0;
+        const double overhead = timeLevel(0, packed);
+        for (int level : levels) {
+            double t = std::max(timeLevel(level, packed) - overhead, 1e-3);
+            if (packed) result.push_back({ level, double(sampleBytes) / t, double(sampleBytes) / double(packed) });
+        }
+    }
+    DeleteFileW(archive.c_str());
+    DeleteFileW(sample);
+    return result;
+}
+// Returns the -mx level to use, or -1 to keep 7-Zip's default.
+static int PickAutoLevel(const PathArena& paths, const wchar_t* type) {
+    if (!ReadSetting(L"AutoLevel", 0)) return -1;
+    const double budget = double(ReadSetting(L"AutoBudgetSeconds", 300));
+
+    // Sizing is bounded too: past kScanLimit files the selection is too big
+    // to size quickly, and the fastest level is the safe answer, without
+    // spending a calibration on it.
+    constexpr size_t kScanLimit = 100000;
+    std::vector<FileRecord> files;
+    ScanFiles(paths, files, kScanLimit);
+    if (files.size() >= kScanLimit) return 1;
+    uint64_t total = 0;
+    for (auto& f : files) total += f.size;
+    if (total < (256ull << 20)) return -1; // not worth a calibration
+
+    auto speeds = CalibrateLevels(paths, type, { 1, 3, 5, 7, 9 });
+    if (speeds.empty()) return -1;
+    const LevelSpeed* best = &speeds.front(); // fastest; used even if nothing fits
+    for (auto& s : speeds)
+        if (double(total) / s.bytesPerSec <= budget && s.ratio > best->ratio * 1.01) best = &s;
+    return best->level;
+}
+static std::wstring LevelSwitch(const PathArena& paths, const wchar_t* type) {
+    int level = PickAutoLevel(paths, type);
+    return level < 0 ? L"" : L"-mx=" + std::to_wstring(level) + L" ";
+}
+
+// ---------- Compression advisor ----------
+// "Compare compression methods": compresses a small sample of the selection
+// with every method and level of a fixed matrix, all cells in parallel, and
+// projects ratio, compress time and decompress time for the whole selection.
+// Files are grouped into strata by extension and size class. Each stratum
+// gets sample bytes in proportion to its share of the selection (at least
+// one chunk) and is compressed on its own; its results are scaled back by
+// its real size, so a few large videos don't hide thousands of small sources
+// or the other way round. The scan, the sample and the matrix are all
+// bounded, so the command takes seconds whatever the selection size.
+struct SampleStratum {
+    std::wstring ext;          // as found, without the dot; "*" for the merged tail
+    int sizeClass{ 0 };        // 0: < 64 KB, 1: < 1 MB, 2: < 16 MB, 3: larger; -1: mixed
+    uint64_t files{ 0 }, bytes{ 0 };
+    struct Pick { size_t file; uint32_t chunks; };
+    std::vector<Pick> picks;   // into the scanned files, in sampling order
+};
+// One stratum's sample through one method and level; times are one-thread CPU seconds.
+struct CellSample { uint64_t in{ 0 }, packed{ 0 }; double encodeSec{ 0 }, decodeSec{ 0 }; };
+struct Projection { uint64_t packed{ 0 }; double encodeSec{ 0 }, decodeSec{ 0 }; };
+
+static int SizeClass(uint64_t size) {
+    return size < (64u << 10) ? 0 : size < (1u << 20) ? 1 : size < (16u << 20) ? 2 : 3;
+}
+static std::wstring_view FileExt(std::wstring_view path) {
+    const size_t slash = path.find_last_of(L"\\/"), dot = path.rfind(L'.');
+    if (dot == std::wstring_view::npos || (slash != std::wstring_view::npos && dot < slash)) return {};
+    return path.substr(dot + 1);
+}
+// Strata of the largest byte counts (the rest merged into one), each with the
+// files to read: a stable pseudo-random order, one chunk (or the whole file)
+// each until the stratum's share of `budget` is covered. Strata of a few big
+// files take further chunks from the files already picked.
+static std::vector<SampleStratum> PlanSample(const std::vector<FileRecord>& files, uint64_t budget, uint32_t chunk,
+                                             size_t maxStrata = 16, size_t maxPicks = 256) {
+    std::vector<SampleStratum> strata;
+    std::vector<std::vector<size_t>> members;
+    NameMap<size_t> index;
+    uint64_t total = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (!files[i].size) continue;
+        const std::wstring_view ext = FileExt(files[i].path);
+        const int cls = SizeClass(files[i].size);
+        auto it = index.emplace(std::wstring(ext) + L'|' + wchar_t(L'0' + cls), strata.size()).first;
+        if (it->second == strata.size()) {
+            strata.push_back({ std::wstring(ext), cls });
+            members.emplace_back();
+        }
+        strata[it->second].files++;
+        strata[it->second].bytes += files[i].size;
+        members[it->second].push_back(i);
+        total += files[i].size;
+    }
+    std::vector<size_t> order(strata.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return strata[a].bytes > strata[b].bytes; });
+    std::vector<SampleStratum> kept;
+    std::vector<std::vector<size_t>> keptMembers;
+    for (size_t k = 0; k < order.size(); ++k) {
+        SampleStratum& s = strata[order[k]];
+        if (k + 1 < maxStrata || order.size() <= maxStrata) {
+            kept.push_back(std::move(s));
+            keptMembers.push_back(std::move(members[order[k]]));
+            continue;
+        }
+        if (k + 1 == maxStrata) { kept.push_back({ L"*", -1 }); keptMembers.emplace_back(); }
+        kept.back().files += s.files;
+        kept.back().bytes += s.bytes;
+        auto& m = members[order[k]];
+        keptMembers.back().insert(keptMembers.back().end(), m.begin(), m.end());
+    }
+
+    for (size_t k = 0; k < kept.size(); ++k) {
+        auto& m = keptMembers[k];
+        std::sort(m.begin(), m.end(), [&](size_t a, size_t b) {
+            const uint64_t ha = NameHashI(files[a].path), hb = NameHashI(files[b].path);
+            return ha != hb ? ha < hb : a < b;
+        });
+        const uint64_t share = std::max<uint64_t>(chunk, uint64_t(double(budget) * double(kept[k].bytes) / double(total)));
+        auto& picks = kept[k].picks;
+        uint64_t taken = 0;
+        for (size_t i : m) {
+            if (taken >= share || picks.size() >= maxPicks) break;
+            picks.push_back({ i, 1 });
+            taken += std::min<uint64_t>(files[i].size, chunk);
+        }
+        for (bool grew = true; grew && taken < share; ) {
+            grew = false;
+            for (auto& p : picks) {
+                if (taken >= share) break;
+                if (uint64_t(p.chunks + 1) * chunk > files[p.file].size) continue;
+                ++p.chunks;
+                taken += chunk;
+                grew = true;
+            }
+        }
+    }
+    return kept;
+}
+// Scales each stratum's cell by its real size. Strata without a usable
+// sample count as stored, at no cost.
+static Projection ProjectSelection(const std::vector<SampleStratum>& strata, const std::vector<CellSample>& cells) {
+    Projection p;
+    for (size_t s = 0; s < strata.size(); ++s) {
+        const CellSample& c = cells[s];
+        if (!c.in || !c.packed) { p.packed += strata[s].bytes; continue; }
+        const double scale = double(strata[s].bytes) / double(c.in);
+        p.packed += uint64_t(double(c.packed) * scale);
+        p.encodeSec += c.encodeSec * scale;
+        p.decodeSec += c.decodeSec * scale;
+    }
+    return p;
+}
+
+// The picked chunks, spread evenly over each file (one chunk: the middle),
+// concatenated into one buffer per stratum.
+static std::vector<std::vector<uint8_t>> ReadSample(const std::vector<FileRecord>& files,
+                                                   const std::vector<SampleStratum>& strata, uint32_t chunk) {
+    std::vector<std::pair<size_t, SampleStratum::Pick>> jobs; // (stratum, pick)
+    for (size_t s = 0; s < strata.size(); ++s)
+        for (const auto& p : strata[s].picks) jobs.push_back({ s, p });
+    std::vector<std::vector<uint8_t>> pieces(jobs.size());
+    ParallelFor(jobs.size(), [&](size_t j) {
+        const FileRecord& f = files[jobs[j].second.file];
+        const uint32_t chunks = jobs[j].second.chunks;
+        HANDLE h = CreateFileW(f.path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               nullptr, OPEN_EXISTING, 0, nullptr);
+        if (h == INVALID_HANDLE_VALUE) return;
+        const DWORD len = DWORD(std::min<uint64_t>(f.size, chunk));
+        pieces[j].resize(size_t(len) * chunks);
+        size_t have = 0;
+        for (uint32_t c = 0; c < chunks; ++c) {
+            const uint64_t off = (f.size - uint64_t(len) * chunks) * (2 * c + 1) / (2 * chunks) + uint64_t(len) * c;
+            DWORD got = 0;
+            if (!ReadAt(h, off, pieces[j].data() + have, len, got)) break;
+            have += got;
+        }
+        pieces[j].resize(have);
+        CloseHandle(h);
+    });
+    std::vector<std::vector<uint8_t>> out(strata.size());
+    for (size_t j = 0; j < jobs.size(); ++j)
+        out[jobs[j].first].insert(out[jobs[j].first].end(), pieces[j].begin(), pieces[j].end());
     return out;
 }
-static bool IsDirectoryPath(const std::wstring& p) {
-    DWORD a = GetFileAttributesW(p.c_str());
-    return (a != INVALID_FILE_ATTRIBUTES) && (a & FILE_ATTRIBUTE_DIRECTORY);
+
+// The matrix. Level 9 PPMd wants 192 MB per instance, hence 3/5/7; zstd is
+// only present in 7-Zip builds that bundle it and drops out elsewhere.
+struct AdvisorMethod {
+    const wchar_t* format;
+    const wchar_t* name;
+    uint64_t id;               // 7z.dll method id
+    const wchar_t* switches;   // the same for 7z.exe
+    int levels[3];
+    enum Cap { None, Dictionary, Memory } cap; // what to size to the sample (saves memory, same result)
+    uint32_t threadsProp;      // kNumThreads to set, 0 for codecs without it
+    bool parallel;             // a real job spreads over all threads
+};
+static const AdvisorMethod kAdvisorMethods[] = {
+    { L"7z/xz", L"LZMA2",   0x21,      L"-t7z -m0=LZMA2",    { 1, 5, 9 },  AdvisorMethod::Dictionary, 1, true },
+    { L"zip",   L"Deflate", 0x040108,  L"-tzip -mm=Deflate", { 1, 5, 9 },  AdvisorMethod::None, 0, true },
+    { L"7z/bz2", L"BZip2",  0x040202,  L"-t7z -m0=BZip2",    { 1, 5, 9 },  AdvisorMethod::None, 1, true },
+    { L"7z",    L"PPMd",    0x030401,  L"-t7z -m0=PPMd",     { 3, 5, 7 },  AdvisorMethod::Memory, 0, false },
+    { L"7z",    L"zstd",    0x4F71101, L"-t7z -m0=zstd",     { 3, 9, 19 }, AdvisorMethod::None, 0, true },
+};
+struct AdvisorCell { const AdvisorMethod* method; int level; };
+
+// Every (cell, stratum) pair on its own instance, in parallel. Coders are
+// sized to the sample, not the level: LZMA2's dictionary to the next power of
+// two, PPMd's model to 16 times the sample (7-Zip's own rule for small
+// inputs), never above what the level would use. With every worker running a
+// cell, that keeps the matrix to what its samples can use. False when 7z.dll
+// can't be used in-process.
+static bool RunCellsInProcess(const std::vector<AdvisorCell>& cells, const std::vector<std::vector<uint8_t>>& samples,
+                              std::vector<std::vector<CellSample>>& out) {
+    if (!InProcessCodec(0x21, 1, 0, 0).Ok()) return false;
+    out.assign(cells.size(), std::vector<CellSample>(samples.size()));
+    ParallelFor(cells.size() * samples.size(), [&](size_t t) {
+        const AdvisorCell& c = cells[t / samples.size()];
+        const std::vector<uint8_t>& in = samples[t % samples.size()];
+        if (in.empty()) return;
+        uint32_t dictionary = 0, memory = 0;
+        if (c.method->cap == AdvisorMethod::Dictionary)
+            for (dictionary = 1u << 16; dictionary < in.size(); dictionary <<= 1) {}
+        if (c.method->cap == AdvisorMethod::Memory)
+            for (memory = 1u << 16; memory / 16 < in.size() && memory < (1u << (c.level + 19)); memory <<= 1) {}
+        InProcessCodec codec(c.method->id, uint32_t(c.level), dictionary, c.method->threadsProp, memory);
+        std::vector<uint8_t> packed, unpacked(in.size());
+        double t0 = NowSeconds();
+        if (!codec.Ok() || !codec.Encode(in.data(), in.size(), packed)) return;
+        const double t1 = NowSeconds();
+        if (!codec.Decode(packed, unpacked.data(), unpacked.size()) || unpacked != in) return;
+        CellSample& r = out[t / samples.size()][t % samples.size()];
+        r = { in.size(), packed.size(), t1 - t0, NowSeconds() - t1 };
+    });
+    return true;
 }
-static bool IsArchiveExt(const std::wstring& ext) {
-    static const wchar_t* exts[] = {
-        L".7z",L".zip",L".rar",L".tar",L".gz",L".xz",L".bz2",L".cab",L".wim",L".lzma",L".zst",L".arj"
+// Fallback through 7z.exe: the strata go into one sample file, so a cell is
+// one "a" and one "t", timed less the cost of the same run with -mx=0. The
+// results are spread over the strata by sample size, i.e. unweighted.
+static void RunCellsWith7z(const std::vector<AdvisorCell>& cells, const std::vector<std::vector<uint8_t>>& samples,
+                           std::vector<std::vector<CellSample>>& out) {
+    out.assign(cells.size(), std::vector<CellSample>(samples.size()));
+    wchar_t tmp[MAX_PATH]{}, sample[MAX_PATH]{};
+    GetTempPathW(MAX_PATH, tmp);
+    GetTempFileNameW(tmp, L"7zc", 0, sample);
+    HANDLE f = CreateFileW(sample, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, nullptr);
+    if (f == INVALID_HANDLE_VALUE) return;
+    uint64_t total = 0;
+    for (auto& s : samples) {
+        DWORD written = 0;
+        if (!s.empty()) WriteFile(f, s.data(), DWORD(s.size()), &written, nullptr);
+        total += written;
+    }
+    CloseHandle(f);
+    const auto sevenZ = Find7zTool(L"7z.exe");
+
+    // Returns false if 7z.exe failed (unknown method, say).
+    auto run = [&](const std::wstring& switches, size_t slot, CellSample& r) {
+        const std::wstring archive = std::wstring(sample) + L"." + std::to_wstring(slot);
+        DeleteFileW(archive.c_str());
+        std::string ignored;
+        DWORD code = 1;
+        double t0 = NowSeconds();
+        RunCapture(sevenZ, L"a -bd -y -mmt=1 " + switches + L" \"" + archive + L"\" \"" + sample + L"\"", ignored, &code);
+        const double t1 = NowSeconds();
+        bool ok = code == 0;
+        if (ok) RunCapture(sevenZ, L"t -bd -mmt=1 \"" + archive + L"\"", ignored, &code);
+        r = { total, FileSizeOf(archive), t1 - t0, NowSeconds() - t1 };
+        DeleteFileW(archive.c_str());
+        return ok && code == 0;
     };
-    for (auto e : exts) if (_wcsicmp(ext.c_str(), e) == 0) return true;
-    return false;
+    CellSample overhead;
+    if (total && run(L"-t7z -mx=0", 0, overhead)) {
+        // Blocking child processes: plain threads, one per worker, not the executor.
+        std::atomic<size_t> next{ 0 };
+        std::vector<std::thread> threads(std::min<size_t>(WorkerCount(), cells.size()));
+        for (auto& t : threads) t = std::thread([&] {
+            for (size_t i; (i = next.fetch_add(1)) < cells.size(); ) {
+                CellSample r;
+                if (!run(std::wstring(cells[i].method->switches) + L" -mx=" + std::to_wstring(cells[i].level), i + 1, r))
+                    continue;
+                r.encodeSec = std::max(r.encodeSec - overhead.encodeSec, 1e-3);
+                r.decodeSec = std::max(r.decodeSec - overhead.decodeSec, 1e-3);
+                for (size_t s = 0; s < samples.size(); ++s) {
+                    const double share = double(samples[s].size()) / double(total);
+                    out[i][s] = { samples[s].size(), uint64_t(double(r.packed) * share),
+                                  r.encodeSec * share, r.decodeSec * share };
+                }
+            }
+        });
+        for (auto& t : threads) t.join();
+    }
+    DeleteFileW(sample);
 }
-static std::wstring BaseName(const std::wstring& path) {
-    std::filesystem::path p(path);
-    return IsDirectoryPath(path) ? p.filename().wstring() : p.stem().wstring();
+
+static std::wstring FormatDuration(double seconds) {
+    wchar_t buf[32];
+    const uint64_t s = uint64_t(seconds + 0.5);
+    swprintf_s(buf, L"%llu:%02u:%02u", (unsigned long long)(s / 3600), unsigned(s / 60 % 60), unsigned(s % 60));
+    return buf;
 }
-static std::wstring DefaultArchiveName(const std::vector<std::wstring>& paths, const wchar_t* ext) {
-    if (paths.empty()) return L"Archive" + std::wstring(ext);
-    if (paths.size() == 1) return BaseName(paths[0]) + ext;
+static void CompressionAdvisorCommand(const PathArena& paths) {
+    constexpr size_t kScanLimit = 200000;
+    constexpr uint32_t kChunk = 64u << 10;
+    const unsigned threads = WorkerCount();
+    const double start = NowSeconds();
 
-    // Multi-selection → use parent directory name if common
-    std::filesystem::path parent = std::filesystem::path(paths[0]).parent_path();
-    bool allSameParent = true;
+    std::vector<FileRecord> files;
+    ScanFiles(paths, files, kScanLimit);
+    uint64_t total = 0;
+    for (auto& f : files) total += f.size;
+    // About half a megabyte per thread keeps every cell well under a second.
+    const uint64_t budget = std::clamp<uint64_t>(uint64_t(threads) << 19, 1u << 20, 8u << 20);
+    const auto strata = PlanSample(files, budget, kChunk);
+    const auto samples = ReadSample(files, strata, kChunk);
+    size_t picked = 0;
+    uint64_t sampled = 0;
+    for (size_t s = 0; s < strata.size(); ++s) { picked += strata[s].picks.size(); sampled += samples[s].size(); }
+
+    std::vector<AdvisorCell> cells;
+    for (const AdvisorMethod& m : kAdvisorMethods)
+        for (int level : m.levels) cells.push_back({ &m, level });
+    std::vector<std::vector<CellSample>> results;
+    const bool inProcess = RunCellsInProcess(cells, samples, results);
+    if (!inProcess) RunCellsWith7z(cells, samples, results);
+
+    auto pad = [](std::wstring s, size_t w, bool right) {
+        if (s.size() < w) s.insert(right ? 0 : s.size(), w - s.size(), L' ');
+        return s;
+    };
+    std::wstring text = L"Compression advisor: " + std::to_wstring(files.size()) + L" files, " + FormatSize(total);
+    if (files.size() >= kScanLimit) text += L" (scan stopped early; figures cover the scanned part)";
+    text += L"\r\nSample: " + FormatSize(sampled) + L" from " + std::to_wstring(picked) + L" files in " +
+            std::to_wstring(strata.size()) + L" strata (extension x size), " +
+            (inProcess ? L"7z.dll in-process" : L"7z.exe") + L", " + std::to_wstring(threads) + L" threads\r\n\r\n";
+    text += L"Format  Method  Level   Ratio    Projected  Compress  Decompress\r\n";
+    text += L"------- ------- -----  ------  -----------  --------  ----------\r\n";
+    for (size_t i = 0; i < cells.size(); ++i) {
+        if (std::none_of(results[i].begin(), results[i].end(), [](const CellSample& c) { return c.packed != 0; }))
+            continue; // method not available
+        const Projection p = ProjectSelection(strata, results[i]);
+        const double wall = cells[i].method->parallel ? double(threads) : 1.0;
+        wchar_t ratio[16];
+        swprintf_s(ratio, L"%6.2f", p.packed ? double(total) / double(p.packed) : 0.0);
+        text += pad(cells[i].method->format, 7, false) + L" " + pad(cells[i].method->name, 7, false) + L" " +
+                pad(L"x" + std::to_wstring(cells[i].level), 5, false) + L"  " + ratio + L"  " +
+                pad(FormatSize(p.packed), 11, true) + L"  " + pad(FormatDuration(p.encodeSec / wall), 8, true) + L"  " +
+                pad(FormatDuration(p.decodeSec / wall), 10, true) + L"\r\n";
+    }
+    text += L"\r\nTimes are wall-clock projections for " + std::to_wstring(threads) +
+            L" threads (PPMd runs on one).\r\n";
+    text += L"\r\nStratum          Files         Size  Sampled\r\n";
+    for (size_t s = 0; s < strata.size(); ++s) {
+        static const wchar_t* const classes[] = { L"< 64 KB", L"< 1 MB", L"< 16 MB", L">= 16 MB" };
+        const std::wstring ext = strata[s].ext.empty() ? L"(none)" : strata[s].ext;
+        const std::wstring name = strata[s].sizeClass < 0 ? L"other" : ext + L" " + classes[strata[s].sizeClass];
+        text += pad(name, 16, false) + pad(std::to_wstring(strata[s].files), 6, true) + L" " +
+                pad(FormatSize(strata[s].bytes), 12, true) + L" " + pad(FormatSize(samples[s].size()), 8, true) + L"\r\n";
+    }
+    wchar_t took[32];
+    swprintf_s(took, L"\r\nDone in %.1f s.\r\n", NowSeconds() - start);
+    ShowReport(L"7-Zip Compression advisor.txt", text + took);
+}
+
+// ---------- Selection ----------
+// Whether a path is a folder, or exists at all, asked at most once on a job
+// thread (a stat can block on a slow share). Query waits up to `seconds` and
+// returns -1 while the answer is still out; with 0 it only looks.
+class PathProbe {
+public:
+    enum Kind { Folder, Exists };
+    PathProbe(Kind kind, std::wstring path) : m_kind(kind), m_path(std::move(path)) {}
+    bool Is(Kind kind, std::wstring_view path) const { return m_kind == kind && m_path == path; }
+    static int Query(const std::shared_ptr<PathProbe>& self, double seconds) {
+        std::unique_lock<std::mutex> lk(self->m_lock);
+        if (!self->m_started) {
+            self->m_started = true;
+            lk.unlock();
+            PostJob([self] {
+                const int yes = (self->m_kind == Folder ? IsDirectoryPath(self->m_path) : FileExists(self->m_path)) ? 1 : 0;
+                { std::lock_guard<std::mutex> g(self->m_lock); self->m_answer = yes; }
+                self->m_done.notify_all();
+            });
+            lk.lock();
+        }
+        if (self->m_answer < 0 && seconds > 0)
+            self->m_done.wait_for(lk, std::chrono::duration<double>(seconds), [&] { return self->m_answer >= 0; });
+        return self->m_answer;
+    }
+private:
+    const Kind m_kind;
+    const std::wstring m_path;
+    std::mutex m_lock;
+    std::condition_variable m_done;
+    bool m_started{ false };
+    int m_answer{ -1 };
+};
+
+// Everything the menu needs about one selection, computed once per menu open
+// instead of once per command and per GetTitle/GetState call. Only what the
+// item names give away is computed up front. The file system checks behind
+// titles and states (is the first item a folder, does "<Name>.7z" or the
+// index exist) are made on first use, each at most once per snapshot, and
+// all of them together wait at most `probeBudget` on Explorer's thread; a
+// check still out after that counts as "no" (a neutral title, a hidden
+// entry) and is looked at again by later calls on the snapshot.
+struct Selection {
+    // The item array it was read from, held so that while this is the cached
+    // snapshot the pointer cannot come back for a different selection.
+    IShellItemArray* source{ nullptr };
+    DWORD sourceCount{ 0 };
+    PathArena paths;
+    bool allArchives{ false };
+    std::wstring first;        // the first item
+    std::wstring parent;       // its folder
+    std::wstring parentName;   // the folder's last component, names a multi-item archive
+    std::wstring firstName;    // file name of the first item
+    std::wstring firstFileStem; // the same without extension
+
+    // 1 or 0 once the check is in, -1 while it is still out.
+    int Probe(PathProbe::Kind kind, std::wstring_view path) const {
+        std::shared_ptr<PathProbe> probe;
+        double wait;
+        {
+            std::lock_guard<std::mutex> g(m_probeLock);
+            for (auto& p : m_probes) if (p->Is(kind, path)) { probe = p; break; }
+            if (!probe) m_probes.push_back(probe = std::make_shared<PathProbe>(kind, std::wstring(path)));
+            wait = m_waitLeft;
+        }
+        const double start = NowSeconds();
+        const int answer = PathProbe::Query(probe, wait);
+        if (wait > 0) {
+            std::lock_guard<std::mutex> g(m_probeLock);
+            m_waitLeft = std::max(0.0, m_waitLeft - (NowSeconds() - start));
+        }
+        return answer;
+    }
+    // BaseName of the first item; false while the folder check is still out
+    // (the caller shows a neutral title, never a guess).
+    // `out` is std::wstring or a scratch string.
+    template<class S> bool FirstStem(S& out) const {
+        int folder = firstName == firstFileStem ? 1 : Probe(PathProbe::Folder, first); // no extension: same either way
+        if (folder < 0) return false;
+        const std::wstring& stem = folder ? firstName : firstFileStem;
+        out.assign(stem.data(), stem.size());
+        return true;
+    }
+    // DefaultArchiveName without extension; false as above.
+    template<class S> bool ArchiveStem(S& out) const {
+        if (paths.size() == 1) return FirstStem(out);
+        const std::wstring_view stem = !paths.empty() && paths.SameParent() && !parentName.empty() ? parentName : L"Archive";
+        out.assign(stem.data(), stem.size());
+        return true;
+    }
+
+    explicit Selection(double probeBudget) : m_waitLeft(probeBudget) {}
+    Selection(const Selection&) = delete;
+    Selection& operator=(const Selection&) = delete;
+    ~Selection() { if (source && !g_processExiting) source->Release(); } // Explorer's objects may be gone at exit
+
+private:
+    mutable std::mutex m_probeLock;
+    mutable std::vector<std::shared_ptr<PathProbe>> m_probes; // a handful: one per kind of check
+    mutable double m_waitLeft;
+};
+
+static std::vector<std::wstring> ReadSelection(IShellItemArray* arr) {
+    std::vector<std::wstring> out;
+    DWORD c = 0;
+    if (!arr || FAILED(arr->GetCount(&c))) return out;
+    out.reserve(c);
+    for (DWORD i = 0; i < c; ++i) {
+        IShellItem* it = nullptr;
+        if (SUCCEEDED(arr->GetItemAt(i, &it)) && it) {
+            auto p = GetItemPath(it);
+            it->Release();
+            if (!p.empty()) out.push_back(std::move(p));
+        }
+    }
+    return out;
+}
+// Explorer passes the same item array to every command of one menu (and to
+// Invoke), and an item array never changes once made, so the snapshot stands
+// while the array and its item count match; the items are not read again.
+// It is the cache manager's to drop.
+static std::mutex g_selectionLock;
+static std::shared_ptr<const Selection> g_selection;
+
+static size_t SelectionBytes() {
+    std::lock_guard<std::mutex> g(g_selectionLock);
+    if (!g_selection) return 0;
+    const Selection& s = *g_selection;
+    const size_t chars = s.first.capacity() + s.parent.capacity() + s.parentName.capacity() + s.firstName.capacity() +
+                         s.firstFileStem.capacity();
+    return sizeof(Selection) + s.paths.Bytes() + chars * sizeof(wchar_t);
+}
+static size_t SelectionCacheId() {
+    static const size_t id = g_caches.Register(L"selection", SelectionBytes, [](size_t keep) {
+        if (keep < SelectionBytes()) {
+            std::lock_guard<std::mutex> g(g_selectionLock);
+            g_selection.reset();
+        }
+    });
+    return id;
+}
+
+static std::shared_ptr<const Selection> GetSelection(IShellItemArray* arr) {
+    DWORD count = 0;
+    if (arr && FAILED(arr->GetCount(&count))) count = 0;
+    {
+        std::lock_guard<std::mutex> g(g_selectionLock);
+        if (g_selection && g_selection->source == arr && g_selection->sourceCount == count) return g_selection;
+    }
+
+    auto paths = ReadSelection(arr);
+    NormalizeSelection(paths);
+    auto sel = std::make_shared<Selection>(ReadSetting(L"TitleBudgetMs", 20) / 1000.0);
+    sel->source = arr;
+    sel->sourceCount = count;
+    if (arr) arr->AddRef();
+    sel->allArchives = !paths.empty();
     for (auto& p : paths) {
-        if (std::filesystem::path(p).parent_path() != parent) { allSameParent = false; break; }
+        if (!IsArchiveExt(std::filesystem::path(p).extension().wstring())) { sel->allArchives = false; break; }
     }
-    if (allSameParent && !parent.filename().empty())
-        return parent.filename().wstring() + ext;
+    if (!paths.empty()) {
+        const std::filesystem::path first(paths[0]);
+        sel->first = paths[0];
+        sel->parent = first.parent_path().wstring();
+        sel->parentName = first.parent_path().filename().wstring();
+        sel->firstName = first.filename().wstring();
+        sel->firstFileStem = first.stem().wstring();
+    }
+    sel->paths.Assign(paths);
 
-    // Fallback
-    return std::wstring(L"Archive") + ext;
+    {
+        std::lock_guard<std::mutex> g(g_selectionLock);
+        g_selection = sel;
+    }
+    g_caches.Grew(SelectionCacheId());
+    return sel;
 }
 
 // ---------- Command IDs ----------
@@ -132,7 +4611,9 @@ enum class CommandID {
     Open, Test, ExtractFiles, ExtractHere, ExtractTo,
     AddToArchive, AddTo7z, AddToZip,
     EmailArchive, Email7z, EmailZip,
-    CRCMenu, CRC32, CRC64, SHA1, SHA256
+    CRCMenu, CRC32, CRC64, SHA1, SHA256, SHA512, BLAKE2sp, CRC32C, XXH3, BLAKE3, Benchmark,
+    FindDuplicates, UpdateArchive, CompressionAdvisor,
+    IndexArchives, SearchIndex, SearchInArchives, CompareWithArchive
 };
 
 // ---------- IEnumExplorerCommand ----------
@@ -201,28 +4682,39 @@ struct ExplorerCommandBase : IExplorerCommand {
     IFACEMETHODIMP GetTitle(IShellItemArray* psiItemArray, LPWSTR* ppszName) override {
     if (!ppszName) return E_POINTER;
 
-    std::vector<std::wstring> paths;
-    CollectPaths(psiItemArray, paths);
+    ScratchScope scratch;
+    auto sel = GetSelection(psiItemArray);
 
     if (m_id == CommandID::AddTo7z || m_id == CommandID::AddToZip ||
         m_id == CommandID::Email7z || m_id == CommandID::EmailZip) {
 
-        std::wstring ext = (m_id == CommandID::AddToZip || m_id == CommandID::EmailZip) ? L".zip" : L".7z";
-        std::wstring base = DefaultArchiveName(paths, ext.c_str());
-
-        std::wstring text;
-        if (m_id == CommandID::AddTo7z || m_id == CommandID::AddToZip)
-            text = L"Add to \"" + base + L"\"";
+        const wchar_t* ext = (m_id == CommandID::AddToZip || m_id == CommandID::EmailZip) ? L".zip" : L".7z";
+        const bool add = m_id == CommandID::AddTo7z || m_id == CommandID::AddToZip;
+        ScratchString stem = Scratch();
+        ScratchString text = Scratch();
+        if (!sel->ArchiveStem(stem)) // folder check still out: no name rather than a wrong one
+            text.append(add ? L"Add to archive (" : L"Compress to archive (").append(ext).append(add ? L")" : L") and email");
+        else if (add)
+            text.append(L"Add to \"").append(stem).append(ext).append(L"\"");
         else
-            text = L"Compress to \"" + base + L"\" and email";
+            text.append(L"Compress to \"").append(stem).append(ext).append(L"\" and email");
+
+        return SHStrDupW(text.c_str(), ppszName);
+    }
 
+    if (m_id == CommandID::UpdateArchive) {
+        ScratchString stem = Scratch();
+        if (!sel->ArchiveStem(stem)) return SHStrDupW(L"Update archive (.7z)", ppszName);
+        ScratchString text = Scratch(L"Update \"");
+        text.append(stem).append(L".7z\"");
         return SHStrDupW(text.c_str(), ppszName);
     }
 
     if (m_id == CommandID::ExtractTo) {
-        if (!paths.empty()) {
-            std::wstring folder = BaseName(paths[0]);
-            std::wstring text = L"Extract to \"" + folder + L"\\\"";
+        ScratchString stem = Scratch();
+        if (!sel->paths.empty() && sel->FirstStem(stem)) {
+            ScratchString text = Scratch(L"Extract to \"");
+            text.append(stem).append(L"\\\"");
             return SHStrDupW(text.c_str(), ppszName);
         }
         return SHStrDupW(L"Extract to \\<Folder>\\", ppszName);
@@ -235,41 +4727,55 @@ struct ExplorerCommandBase : IExplorerCommand {
     IFACEMETHODIMP GetToolTip(IShellItemArray*, LPWSTR* ppszInfotip) override { *ppszInfotip = nullptr; return E_NOTIMPL; }
     IFACEMETHODIMP GetCanonicalName(GUID* pguidCommandName) override { *pguidCommandName = GUID_NULL; return E_NOTIMPL; }
 
-    static void CollectPaths(IShellItemArray* arr, std::vector<std::wstring>& out) {
-        out.clear(); if (!arr) return;
-        DWORD c = 0; if (FAILED(arr->GetCount(&c))) return;
-        for (DWORD i = 0; i < c; ++i) {
-            IShellItem* it = nullptr;
-            if (SUCCEEDED(arr->GetItemAt(i, &it)) && it) {
-                auto p = GetItemPath(it);
-                it->Release();
-                if (!p.empty()) out.push_back(std::move(p));
-            }
-        }
-    }
-
     IFACEMETHODIMP GetState(IShellItemArray* psiItemArray, BOOL, EXPCMDSTATE* pState) override {
         *pState = ECS_HIDDEN;
-        std::vector<std::wstring> paths;
-        CollectPaths(psiItemArray, paths);
+        ScratchScope scratch;
+        auto sel = GetSelection(psiItemArray);
+        const PathArena& paths = sel->paths;
         if (paths.empty()) return S_OK;
-
-        bool allArchives = true;
-        for (auto& p : paths) {
-            auto ext = std::filesystem::path(p).extension().wstring();
-            if (!IsArchiveExt(ext)) { allArchives = false; break; }
-        }
+        const bool allArchives = sel->allArchives;
 
         switch (m_id) {
         case CommandID::Open:
             if (paths.size() == 1 && allArchives) *pState = ECS_ENABLED;
             break;
+        case CommandID::CompareWithArchive: {
+            if (paths.size() != 1 || !allArchives) break;
+            ScratchString stem = Scratch();
+            if (!sel->FirstStem(stem)) break; // offered once the folder check is in
+            ScratchString folder = Scratch(sel->parent);
+            AppendPath(folder, stem);
+            if (sel->Probe(PathProbe::Folder, folder) > 0) *pState = ECS_ENABLED;
+            break;
+        }
         case CommandID::Test:
+        case CommandID::SearchInArchives:
         case CommandID::ExtractFiles:
         case CommandID::ExtractHere:
         case CommandID::ExtractTo:
             if (allArchives) *pState = ECS_ENABLED;
             break;
+        case CommandID::IndexArchives:
+        case CommandID::SearchIndex: {
+            if (paths.size() != 1) break;
+            if (m_id == CommandID::IndexArchives) {
+                if (sel->Probe(PathProbe::Folder, sel->first) > 0) *pState = ECS_ENABLED;
+            } else {
+                ScratchString index = Scratch(sel->first);
+                AppendPath(index, kIndexName);
+                if (sel->Probe(PathProbe::Exists, index) > 0) *pState = ECS_ENABLED;
+            }
+            break;
+        }
+        case CommandID::UpdateArchive: {
+            // Only offered when "Add to <Name>.7z" already produced the archive.
+            ScratchString stem = Scratch();
+            if (!sel->ArchiveStem(stem)) break; // never probe a guessed name
+            ScratchString target = Scratch(sel->parent);
+            AppendPath(target, stem).append(L".7z");
+            if (sel->Probe(PathProbe::Exists, target) > 0) *pState = ECS_ENABLED;
+            break;
+        }
         default:
             *pState = ECS_ENABLED; // Add/Email/CRC always available
             break;
@@ -278,19 +4784,22 @@ struct ExplorerCommandBase : IExplorerCommand {
     }
 
     IFACEMETHODIMP Invoke(IShellItemArray* psiItemArray, IBindCtx*) override {
-        std::vector<std::wstring> paths;
-        CollectPaths(psiItemArray, paths);
-        if (paths.empty()) return S_OK;
-
+        auto sel = GetSelection(psiItemArray);
+        if (sel->paths.empty()) return S_OK;
+        // Prompts, scans and multi-archive loops can take a while: run on a job.
+        PostJob([id = m_id, sel] { Run(id, sel->paths); });
+        return S_OK;
+    }
+    static void Run(CommandID id, const PathArena& paths) {
         const auto sevenZG = Find7zTool(L"7zG.exe");
         const auto sevenZ  = Find7zTool(L"7z.exe");
         const auto sevenFM = Find7zTool(L"7zFM.exe");
 
-        auto quoteJoin = [](const std::vector<std::wstring>& v) {
+        auto quoteJoin = [](const PathArena& v) {
             std::wstring s; for (auto& p : v) { s += L"\""; s += p; s += L"\" "; } return s;
         };
 
-        switch (m_id) {
+        switch (id) {
         case CommandID::Open:
             ShellRun(sevenFM, L"\"" + paths[0] + L"\"");
             break;
@@ -304,23 +4813,9 @@ struct ExplorerCommandBase : IExplorerCommand {
             ShellRun(sevenZG, L"x " + quoteJoin(paths));
             break;
 
-        case CommandID::ExtractHere: {
-            if (paths.size() == 1) {
-        // Classic single-archive behavior: extract into parent folder of the archive
-            std::filesystem::path parent = std::filesystem::path(paths[0]).parent_path();
-            std::wstring args = L"x -y -o\"" + parent.wstring() + L"\\\" \"" + paths[0] + L"\"";
-            ShellRun(sevenZG, args);
-        } else {
-        // SMART multi-archive behavior: each archive into its own folder
-            for (auto& p : paths) {
-            std::filesystem::path parent = std::filesystem::path(p).parent_path();
-            std::wstring folder = BaseName(p);
-            std::wstring args = L"x -y -o\"" + (parent / folder).wstring() + L"\\\" \"" + p + L"\"";
-            ShellRun(sevenZG, args);
-                                  }
-                }
+        case CommandID::ExtractHere:
+            ExtractHereCommand(paths);
             break;
-        }
 
         case CommandID::ExtractTo:
             // Classic: always into <ArchiveName>\ (multi-select creates per-archive dirs)
@@ -342,13 +4837,20 @@ struct ExplorerCommandBase : IExplorerCommand {
         case CommandID::AddTo7z: {
             std::filesystem::path parent = std::filesystem::path(paths[0]).parent_path();
             std::wstring out = (parent / DefaultArchiveName(paths, L".7z")).wstring();
-            ShellRun(sevenZG, L"a \"" + out + L"\" " + quoteJoin(paths));
+            ShellRun(sevenZG, L"a " + SevenZipAddSwitches(paths) + LevelSwitch(paths, L"7z") +
+                              L"\"" + out + L"\" " + quoteJoin(paths));
             break;
         }   
 
+        case CommandID::UpdateArchive: {
+            std::filesystem::path parent = std::filesystem::path(paths[0]).parent_path();
+            UpdateArchiveCommand(paths, (parent / DefaultArchiveName(paths, L".7z")).wstring());
+            break;
+        }
+
         case CommandID::AddToZip: {
             std::wstring out = DefaultArchiveName(paths, L".zip");
-            ShellRun(sevenZG, L"a -tzip \"" + out + L"\" " + quoteJoin(paths));
+            ShellRun(sevenZG, L"a -tzip " + LevelSwitch(paths, L"zip") + L"\"" + out + L"\" " + quoteJoin(paths));
             break;
         }
 
@@ -358,7 +4860,7 @@ struct ExplorerCommandBase : IExplorerCommand {
 
         case CommandID::Email7z: {
             std::wstring out = DefaultArchiveName(paths, L".7z");
-            ShellRun(sevenZG, L"a \"" + out + L"\" " + quoteJoin(paths));
+            ShellRun(sevenZG, L"a " + SevenZipAddSwitches(paths) + L"\"" + out + L"\" " + quoteJoin(paths));
             break;
         }
 
@@ -380,11 +4882,48 @@ struct ExplorerCommandBase : IExplorerCommand {
         case CommandID::SHA256:
             ShellRun(sevenZ, L"h -scrcSHA256 " + quoteJoin(paths));
             break;
+        case CommandID::SHA512:
+            ChecksumCommand(paths, HashKind::Sha512);
+            break;
+        case CommandID::BLAKE2sp:
+            ChecksumCommand(paths, HashKind::Blake2sp);
+            break;
+        case CommandID::CRC32C:
+            ChecksumCommand(paths, HashKind::Crc32c);
+            break;
+        case CommandID::XXH3:
+            ChecksumCommand(paths, HashKind::Xxh3);
+            break;
+        case CommandID::BLAKE3:
+            ChecksumCommand(paths, HashKind::Blake3);
+            break;
+        case CommandID::Benchmark:
+            ShowReport(L"7-Zip Benchmark.txt", RunBenchmark());
+            break;
+
+        case CommandID::FindDuplicates:
+            FindDuplicatesCommand(paths);
+            break;
+        case CommandID::CompressionAdvisor:
+            CompressionAdvisorCommand(paths);
+            break;
+
+        case CommandID::IndexArchives:
+            BuildArchiveIndexCommand(paths[0]);
+            break;
+        case CommandID::SearchIndex:
+            SearchArchiveIndexCommand(paths[0]);
+            break;
+        case CommandID::SearchInArchives:
+            SearchInArchivesCommand(paths);
+            break;
+        case CommandID::CompareWithArchive:
+            CompareWithArchiveCommand(paths[0]);
+            break;
 
         default:
             break;
         }
-        return S_OK;
     }
 
     IFACEMETHODIMP GetFlags(EXPCMDFLAGS* pFlags) override {
@@ -403,6 +4942,12 @@ struct CRCMenuParent : ExplorerCommandBase {
         v.push_back(new ExplorerCommandBase(CommandID::CRC64,  L"CRC-64"));
         v.push_back(new ExplorerCommandBase(CommandID::SHA1,   L"SHA-1"));
         v.push_back(new ExplorerCommandBase(CommandID::SHA256, L"SHA-256"));
+        v.push_back(new ExplorerCommandBase(CommandID::SHA512, L"SHA-512"));
+        v.push_back(new ExplorerCommandBase(CommandID::BLAKE2sp, L"BLAKE2sp"));
+        v.push_back(new ExplorerCommandBase(CommandID::CRC32C, L"CRC-32C"));
+        v.push_back(new ExplorerCommandBase(CommandID::XXH3,   L"XXH3-128"));
+        v.push_back(new ExplorerCommandBase(CommandID::BLAKE3, L"BLAKE3"));
+        v.push_back(new ExplorerCommandBase(CommandID::Benchmark, L"Benchmark"));
         *ppEnum = new CommandEnum(v);
         (*ppEnum)->AddRef();
         return S_OK;
@@ -420,13 +4965,20 @@ struct ExplorerCommandRoot : IExplorerCommand, IEnumExplorerCommand {
         subs.push_back(new ExplorerCommandBase(CommandID::ExtractHere,  L"Extract Here"));
         subs.push_back(new ExplorerCommandBase(CommandID::ExtractTo,    L"Extract to \\<Folder>\\"));
         subs.push_back(new ExplorerCommandBase(CommandID::Test,         L"Test archive"));
+        subs.push_back(new ExplorerCommandBase(CommandID::SearchInArchives, L"Search in archives..."));
+        subs.push_back(new ExplorerCommandBase(CommandID::CompareWithArchive, L"Compare with extracted folder"));
         subs.push_back(new ExplorerCommandBase(CommandID::AddToArchive, L"Add to archive..."));
         subs.push_back(new ExplorerCommandBase(CommandID::AddTo7z,      L"Add to \"<Name>.7z\""));
         subs.push_back(new ExplorerCommandBase(CommandID::AddToZip,     L"Add to \"<Name>.zip\""));
+        subs.push_back(new ExplorerCommandBase(CommandID::UpdateArchive, L"Update \"<Name>.7z\""));
+        subs.push_back(new ExplorerCommandBase(CommandID::CompressionAdvisor, L"Compare compression methods"));
         subs.push_back(new ExplorerCommandBase(CommandID::EmailArchive, L"Compress and email..."));
         subs.push_back(new ExplorerCommandBase(CommandID::Email7z,      L"Compress to \"<Name>.7z\" and email"));
         subs.push_back(new ExplorerCommandBase(CommandID::EmailZip,     L"Compress to \"<Name>.zip\" and email"));
         subs.push_back(new CRCMenuParent());
+        subs.push_back(new ExplorerCommandBase(CommandID::FindDuplicates, L"Find duplicates"));
+        subs.push_back(new ExplorerCommandBase(CommandID::IndexArchives,  L"Index archives in folder"));
+        subs.push_back(new ExplorerCommandBase(CommandID::SearchIndex,    L"Search archive index..."));
     }
     ~ExplorerCommandRoot(){for(auto*c:subs)if(c)c->Release();InterlockedDecrement(&g_ObjCount);}
 
@@ -445,7 +4997,10 @@ struct ExplorerCommandRoot : IExplorerCommand, IEnumExplorerCommand {
     IFACEMETHODIMP GetIcon(IShellItemArray*, LPWSTR* ppszIcon) override {
     if (!ppszIcon) return E_POINTER;
     *ppszIcon = nullptr;
-    std::wstring iconPath = L"C:\\Program Files\\7-Zip\\7zFM.exe,0";
+    ScratchScope scratch;
+    const std::wstring& fm = Tools().fm;
+    ScratchString iconPath = Scratch(PathIsRelativeW(fm.c_str()) ? L"C:\\Program Files\\7-Zip\\7zFM.exe" : fm);
+    iconPath += L",0";
     return SHStrDupW(iconPath.c_str(), ppszIcon);
 }
 
@@ -489,11 +5044,122 @@ struct ClassFactory : IClassFactory {
     }
 };
 
+// ---------- Menu benchmark ----------
+// What opening the menu costs for a large selection: GetState and GetTitle
+// for every entry (the root's and the CRC SHA submenu's), as Explorer asks
+// for them, first on a new item array (the snapshot is built) and then on
+// the same array again (it is reused). The items come from an in-memory array
+// of names in the temp folder that do not exist, so the shell's own cost of
+// making items is left out while every file check still runs.
+// `rundll32 7Zip.ShellExtension.dll,Benchmark /menu`.
+struct BenchItem : IShellItem {
+    LONG m_ref{ 1 };
+    std::wstring m_path;
+    explicit BenchItem(std::wstring path) : m_path(std::move(path)) {}
+    IFACEMETHODIMP QueryInterface(REFIID riid, void** ppv) override {
+        if (!ppv) return E_POINTER;
+        if (riid == IID_IUnknown || riid == IID_IShellItem) { *ppv = this; AddRef(); return S_OK; }
+        *ppv = nullptr; return E_NOINTERFACE;
+    }
+    IFACEMETHODIMP_(ULONG) AddRef() override { return InterlockedIncrement(&m_ref); }
+    IFACEMETHODIMP_(ULONG) Release() override { ULONG c = InterlockedDecrement(&m_ref); if (!c) delete this; return c; }
+    IFACEMETHODIMP BindToHandler(IBindCtx*, REFGUID, REFIID, void** ppv) override { *ppv = nullptr; return E_NOTIMPL; }
+    IFACEMETHODIMP GetParent(IShellItem** pp) override { *pp = nullptr; return E_NOTIMPL; }
+    IFACEMETHODIMP GetDisplayName(SIGDN sigdn, LPWSTR* ppsz) override {
+        *ppsz = nullptr;
+        return sigdn == SIGDN_FILESYSPATH ? SHStrDupW(m_path.c_str(), ppsz) : E_NOTIMPL;
+    }
+    IFACEMETHODIMP GetAttributes(SFGAOF, SFGAOF* attrs) override { *attrs = 0; return E_NOTIMPL; }
+    IFACEMETHODIMP Compare(IShellItem*, SICHINTF, int*) override { return E_NOTIMPL; }
+};
+struct BenchItemArray : IShellItemArray {
+    LONG m_ref{ 1 };
+    std::vector<std::wstring> m_paths;
+    explicit BenchItemArray(std::vector<std::wstring> paths) : m_paths(std::move(paths)) {}
+    IFACEMETHODIMP QueryInterface(REFIID riid, void** ppv) override {
+        if (!ppv) return E_POINTER;
+        if (riid == IID_IUnknown || riid == IID_IShellItemArray) { *ppv = this; AddRef(); return S_OK; }
+        *ppv = nullptr; return E_NOINTERFACE;
+    }
+    IFACEMETHODIMP_(ULONG) AddRef() override { return InterlockedIncrement(&m_ref); }
+    IFACEMETHODIMP_(ULONG) Release() override { ULONG c = InterlockedDecrement(&m_ref); if (!c) delete this; return c; }
+    IFACEMETHODIMP BindToHandler(IBindCtx*, REFGUID, REFIID, void** ppv) override { *ppv = nullptr; return E_NOTIMPL; }
+    IFACEMETHODIMP GetPropertyStore(GETPROPERTYSTOREFLAGS, REFIID, void** ppv) override { *ppv = nullptr; return E_NOTIMPL; }
+    IFACEMETHODIMP GetPropertyDescriptionList(REFPROPERTYKEY, REFIID, void** ppv) override { *ppv = nullptr; return E_NOTIMPL; }
+    IFACEMETHODIMP GetAttributes(SIATTRIBFLAGS, SFGAOF, SFGAOF* attrs) override { *attrs = 0; return E_NOTIMPL; }
+    IFACEMETHODIMP GetCount(DWORD* count) override { *count = DWORD(m_paths.size()); return S_OK; }
+    IFACEMETHODIMP GetItemAt(DWORD i, IShellItem** pp) override {
+        *pp = i < m_paths.size() ? new BenchItem(m_paths[i]) : nullptr; // a new item per call, like the shell's
+        return *pp ? S_OK : E_INVALIDARG;
+    }
+    IFACEMETHODIMP EnumItems(IEnumShellItems** pp) override { *pp = nullptr; return E_NOTIMPL; }
+};
+
+static std::wstring RunMenuBenchmark() {
+    // The entries as Explorer sees them: the root's, then the submenu's.
+    std::vector<IExplorerCommand*> entries;
+    auto collect = [&](IExplorerCommand* parent) {
+        IEnumExplorerCommand* e = nullptr;
+        if (FAILED(parent->EnumSubCommands(&e)) || !e) return;
+        IExplorerCommand* c = nullptr;
+        while (e->Next(1, &c, nullptr) == S_OK) entries.push_back(c);
+        e->Release();
+    };
+    auto* root = new ExplorerCommandRoot();
+    collect(root);
+    for (size_t i = 0, n = entries.size(); i < n; ++i) {
+        EXPCMDFLAGS flags = 0;
+        if (SUCCEEDED(entries[i]->GetFlags(&flags)) && (flags & ECF_HASSUBCOMMANDS)) collect(entries[i]);
+    }
+    auto open = [&](IShellItemArray* arr) {
+        const double t0 = NowSeconds();
+        for (IExplorerCommand* c : entries) {
+            EXPCMDSTATE state = ECS_HIDDEN;
+            c->GetState(arr, FALSE, &state);
+            LPWSTR title = nullptr;
+            if (SUCCEEDED(c->GetTitle(arr, &title))) CoTaskMemFree(title);
+        }
+        return (NowSeconds() - t0) * 1000;
+    };
+
+    wchar_t temp[MAX_PATH]{};
+    GetTempPathW(MAX_PATH, temp);
+    const std::wstring dir = Combine(temp, L"7-Zip menu benchmark");
+    std::wstring text = L"Menu open: GetState and GetTitle for " + std::to_wstring(entries.size()) + L" entries\r\n\r\n";
+    text += L"   Items Kind       New array ms  Same array ms\r\n";
+    text += L"-------- -------- -------------- -------------\r\n";
+    constexpr int kAgain = 10;
+    for (size_t count : { size_t(1), size_t(1000), size_t(50000) }) {
+        for (const wchar_t* ext : { L".jpg", L".zip" }) {
+            std::vector<std::wstring> paths(count);
+            for (size_t i = 0; i < count; ++i) {
+                wchar_t name[32];
+                swprintf_s(name, L"%06zu%ls", i, ext);
+                paths[i] = Combine(dir, name);
+            }
+            auto* arr = new BenchItemArray(std::move(paths));
+            const double first = open(arr);
+            double again = 0;
+            for (int k = 0; k < kAgain; ++k) again += open(arr);
+            arr->Release();
+            wchar_t row[128];
+            swprintf_s(row, L"%8zu %-8ls %14.2f %13.3f\r\n", count, wcscmp(ext, L".zip") ? L"files" : L"archives",
+                       first, again / kAgain);
+            text += row;
+        }
+    }
+    for (IExplorerCommand* c : entries) c->Release();
+    root->Release();
+    return text;
+}
+
 // ---------- Exports ----------
-extern "C" BOOL APIENTRY DllMain(HMODULE hModule, DWORD reason, LPVOID) {
+extern "C" BOOL APIENTRY DllMain(HMODULE hModule, DWORD reason, LPVOID reserved) {
     if (reason == DLL_PROCESS_ATTACH) {
         g_hMod = hModule;
         DisableThreadLibraryCalls(hModule);
+    } else if (reason == DLL_PROCESS_DETACH) {
+        g_processExiting = reserved != nullptr; // read by the pool destructors that run next
     }
     return TRUE;
 }
@@ -510,7 +5176,14 @@ extern "C" BOOL APIENTRY DllMain(HMODULE hModule, DWORD reason, LPVOID) {
 //     return hr;
 // }
 HRESULT __stdcall DllCanUnloadNow(void) {
-    return (g_ObjCount == 0 && g_LockCount == 0) ? S_OK : S_FALSE;
+    if (g_ObjCount != 0 || g_LockCount != 0) return S_FALSE;
+    g_jobs.Shutdown();
+    g_executor.Shutdown();
+    g_caches.Shutdown(); // empties the block and selection caches
+    ShutdownLibrary();
+    ShutdownToolCache(); // the change-notification wait must not outlive the DLL
+    ShutdownSharedCache();
+    return S_OK;
 }
 
 HRESULT __stdcall DllGetClassObject(REFCLSID rclsid, REFIID riid, void** ppv) {
@@ -520,3 +5193,23 @@ HRESULT __stdcall DllGetClassObject(REFCLSID rclsid, REFIID riid, void** ppv) {
     cf->Release();
     return hr;
 }
+
+// Command-line benchmark: rundll32 7Zip.ShellExtension.dll,Benchmark [/q]
+// Prints to the calling console, or opens the report in Notepad when there is
+// none; /q only stores the results.
+extern "C" void CALLBACK Benchmark(HWND, HINSTANCE, LPSTR cmdLine, int) {
+    const bool menu = cmdLine && (strstr(cmdLine, "/menu") || strstr(cmdLine, "/MENU"));
+    const std::wstring report = menu ? RunMenuBenchmark() : RunBenchmark();
+    if (cmdLine && (strstr(cmdLine, "/q") || strstr(cmdLine, "/Q"))) return;
+    if (AttachConsole(ATTACH_PARENT_PROCESS)) {
+        HANDLE out = CreateFileW(L"CONOUT$", GENERIC_WRITE, FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
+        if (out != INVALID_HANDLE_VALUE) {
+            DWORD written = 0;
+            WriteConsoleW(out, report.data(), DWORD(report.size()), &written, nullptr);
+            CloseHandle(out);
+        }
+        FreeConsole();
+        if (out != INVALID_HANDLE_VALUE) return;
+    }
+    ShowReport(L"7-Zip Benchmark.txt", report);
+}
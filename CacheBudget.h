@@ -0,0 +1,104 @@
+// CacheBudget.h
+// The budget shared by the process-wide caches of 7Zip.ShellExtension.cpp,
+// without the Windows timer and low-memory signal its CacheManager adds, so
+// tests/ can exercise it on any platform.
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+
+// Caches register how to measure and how to shrink themselves so one budget
+// covers all of them. Growing past it (checked at most every kCheckMs, since
+// measuring takes every cache's lock) trims the least recently used caches
+// back to three quarters of the budget.
+class CacheBudget {
+public:
+    using Measure = std::function<size_t()>;
+    using Shrink = std::function<void(size_t keep)>; // to at most `keep` bytes
+    static constexpr size_t kMaxCaches = 8;
+    static constexpr uint64_t kCheckMs = 100;
+
+    static uint64_t NowMs() {
+        using namespace std::chrono;
+        return uint64_t(duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count());
+    }
+
+    size_t Register(const wchar_t* name, Measure bytes, Shrink trim) {
+        std::lock_guard<std::mutex> g(m_lock);
+        const size_t id = m_count.load(std::memory_order_relaxed);
+        if (id == kMaxCaches) std::abort();
+        m_caches[id].name = name;
+        m_caches[id].bytes = std::move(bytes);
+        m_caches[id].trim = std::move(trim);
+        m_count.store(id + 1, std::memory_order_release);
+        return id;
+    }
+    void SetBudget(size_t bytes) { m_budget.store(bytes, std::memory_order_relaxed); }
+    size_t Budget() const { return m_budget.load(std::memory_order_relaxed); }
+
+    // Called after a cache was used.
+    void Touch(size_t id) { m_caches[id].lastUse.store(NowMs(), std::memory_order_relaxed); }
+    // Called after a cache grew; only one caller per kCheckMs measures the
+    // total. True if it trimmed.
+    bool Grew(size_t id) {
+        const uint64_t now = NowMs();
+        m_caches[id].lastUse.store(now, std::memory_order_relaxed);
+        uint64_t next = m_nextCheck.load(std::memory_order_relaxed);
+        if (now < next || !m_nextCheck.compare_exchange_strong(next, now + kCheckMs, std::memory_order_relaxed)) return false;
+        const size_t budget = Budget();
+        if (Total() <= budget) return false;
+        TrimTo(budget / 4 * 3);
+        return true;
+    }
+    // Shrinks the least recently used caches first until the total fits `target`.
+    void TrimTo(size_t target) {
+        std::lock_guard<std::mutex> g(m_trimLock);
+        const size_t n = m_count.load(std::memory_order_acquire);
+        std::array<Entry*, kMaxCaches> order{};
+        for (size_t i = 0; i < n; ++i) order[i] = &m_caches[i];
+        std::sort(order.begin(), order.begin() + n, [](const Entry* x, const Entry* y) {
+            return x->lastUse.load(std::memory_order_relaxed) < y->lastUse.load(std::memory_order_relaxed);
+        });
+        for (size_t i = 0; i < n; ++i) {
+            const size_t total = Total();
+            if (total <= target) break;
+            const size_t mine = order[i]->bytes(), others = total - mine;
+            if (mine == 0) continue;
+            order[i]->trim(target > others ? target - others : 0);
+        }
+    }
+    size_t Total() const {
+        size_t total = 0;
+        const size_t n = m_count.load(std::memory_order_acquire);
+        for (size_t i = 0; i < n; ++i) total += m_caches[i].bytes();
+        return total;
+    }
+    // Milliseconds since any cache was last used.
+    uint64_t IdleMs() const {
+        uint64_t last = 0;
+        const size_t n = m_count.load(std::memory_order_acquire);
+        for (size_t i = 0; i < n; ++i) last = std::max(last, m_caches[i].lastUse.load(std::memory_order_relaxed));
+        const uint64_t now = NowMs();
+        return now > last ? now - last : 0;
+    }
+
+private:
+    struct Entry {
+        const wchar_t* name{};
+        Measure bytes;
+        Shrink trim;
+        std::atomic<uint64_t> lastUse{ 0 };
+    };
+    std::array<Entry, kMaxCaches> m_caches;
+    std::atomic<size_t> m_count{ 0 };
+    std::atomic<size_t> m_budget{ size_t(64) << 20 };
+    std::atomic<uint64_t> m_nextCheck{ 0 }; // NowMs() of the next budget check
+    std::mutex m_lock;     // registration
+    std::mutex m_trimLock; // one trim at a time
+};
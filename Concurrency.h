@@ -0,0 +1,507 @@
+// Concurrency.h
+// The thread pool, job queue, pipeline channel and seqlock of
+// 7Zip.ShellExtension.cpp.
+// Nothing here needs Windows headers, so tests/ builds and stress-tests it on
+// any platform; the DLL plugs its Windows parts (COM, the surrogate's lock
+// count, error reporting) in through the small hook structs below.
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define CONCURRENCY_PAUSE() _mm_pause()
+#elif defined(_M_ARM64)
+#include <intrin.h>
+#define CONCURRENCY_PAUSE() __yield()
+#elif defined(__aarch64__)
+#define CONCURRENCY_PAUSE() __asm__ __volatile__("yield")
+#else
+#define CONCURRENCY_PAUSE() ((void)0)
+#endif
+
+// ---------- Executor ----------
+// One work-stealing pool shared by every parallel loop. Each worker owns a
+// Chase-Lev deque (owner pushes/pops at the bottom, thieves take from the
+// top); work posted from other threads goes through lock-free injection
+// queues, one per priority. Workers look for interactive work first, then
+// their own deque, then bulk work, then steal; with nothing found they spin
+// with growing pauses, yield, and finally park until new work is posted.
+// Blocking work (prompts, pipeline stages waiting on channels) stays on its
+// own threads so it can never starve this pool.
+enum class Priority { Interactive, Bulk };
+using Task = std::function<void()>;
+
+// What a pool needs from its host. Unset hooks fall back to the hardware
+// thread count and to joining the threads in the destructor.
+struct PoolHooks {
+    unsigned (*workers)() = nullptr;
+    // Threads still running when the pool is destroyed. A DLL can't join them
+    // under the loader lock; the hook must leave `threads` empty.
+    void (*orphaned)(std::vector<std::thread>& threads, const wchar_t* pool) = nullptr;
+    // A posted task threw. Unset: the exception is dropped.
+    void (*failed)(std::exception_ptr error) = nullptr;
+};
+
+// Spins 1, 2, 4 ... 64 pauses, then yields a few times; false means "park now".
+class Backoff {
+public:
+    void Reset() { m_step = 0; }
+    bool Step() {
+        if (m_step < 7) for (unsigned i = 0; i < (1u << m_step); ++i) CONCURRENCY_PAUSE();
+        else if (m_step < 7 + 16) std::this_thread::yield();
+        else return false;
+        ++m_step;
+        return true;
+    }
+private:
+    unsigned m_step{ 0 };
+};
+
+// Bounded MPMC ring (Vyukov): every cell carries a sequence number telling
+// producers and consumers whose turn it is.
+template<class T, size_t N> class MpmcQueue {
+    static_assert((N & (N - 1)) == 0, "N must be a power of two");
+public:
+    MpmcQueue() : m_cells(new Cell[N]) { for (size_t i = 0; i < N; ++i) m_cells[i].seq.store(i, std::memory_order_relaxed); }
+    bool TryPush(T v) {
+        size_t pos = m_enq.load(std::memory_order_relaxed);
+        Cell* c;
+        for (;;) {
+            c = &m_cells[pos & (N - 1)];
+            intptr_t dif = intptr_t(c->seq.load(std::memory_order_acquire)) - intptr_t(pos);
+            if (dif == 0 && m_enq.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            if (dif < 0) return false; // full
+            if (dif > 0) pos = m_enq.load(std::memory_order_relaxed);
+        }
+        c->value = v;
+        c->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+    bool TryPop(T& v) {
+        size_t pos = m_deq.load(std::memory_order_relaxed);
+        Cell* c;
+        for (;;) {
+            c = &m_cells[pos & (N - 1)];
+            intptr_t dif = intptr_t(c->seq.load(std::memory_order_acquire)) - intptr_t(pos + 1);
+            if (dif == 0 && m_deq.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            if (dif < 0) return false; // empty
+            if (dif > 0) pos = m_deq.load(std::memory_order_relaxed);
+        }
+        v = c->value;
+        c->seq.store(pos + N, std::memory_order_release);
+        return true;
+    }
+    bool Empty() const { return m_deq.load(std::memory_order_acquire) >= m_enq.load(std::memory_order_acquire); }
+private:
+    struct Cell { std::atomic<size_t> seq; T value; };
+    std::unique_ptr<Cell[]> m_cells;
+    alignas(64) std::atomic<size_t> m_enq{ 0 };
+    alignas(64) std::atomic<size_t> m_deq{ 0 };
+};
+
+// Chase-Lev deque (with the memory orders of Le et al., PPoPP'13). The ring
+// doubles when full; retired rings live until the deque goes, since a thief
+// may still be reading one.
+class WorkDeque {
+public:
+    WorkDeque() { m_rings.push_back(std::make_unique<Ring>(256)); m_ring.store(m_rings.back().get()); }
+    void Push(Task* t) { // owner only
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t top = m_top.load(std::memory_order_acquire);
+        Ring* r = m_ring.load(std::memory_order_relaxed);
+        if (b - top > int64_t(r->mask)) r = Grow(r, top, b);
+        r->At(b).store(t, std::memory_order_relaxed);
+        m_bottom.store(b + 1, std::memory_order_release); // publishes the slot (and the task) to thieves
+    }
+    Task* Pop() { // owner only
+        int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+        Ring* r = m_ring.load(std::memory_order_relaxed);
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t top = m_top.load(std::memory_order_relaxed);
+        Task* t = nullptr;
+        if (top <= b) {
+            t = r->At(b).load(std::memory_order_relaxed);
+            if (top == b) { // last one: race the thieves for it
+                if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) t = nullptr;
+                m_bottom.store(b + 1, std::memory_order_relaxed);
+            }
+        } else {
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return t;
+    }
+    Task* Steal() { // any thread
+        int64_t top = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = m_bottom.load(std::memory_order_acquire);
+        if (top >= b) return nullptr;
+        Task* t = m_ring.load(std::memory_order_acquire)->At(top).load(std::memory_order_relaxed);
+        if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) return nullptr;
+        return t;
+    }
+    bool Empty() const { return m_bottom.load(std::memory_order_acquire) <= m_top.load(std::memory_order_acquire); }
+private:
+    struct Ring {
+        explicit Ring(size_t n) : mask(n - 1), slots(new std::atomic<Task*>[n]) {}
+        std::atomic<Task*>& At(int64_t i) { return slots[size_t(i) & mask]; }
+        size_t mask;
+        std::unique_ptr<std::atomic<Task*>[]> slots;
+    };
+    Ring* Grow(Ring* r, int64_t top, int64_t b) {
+        auto bigger = std::make_unique<Ring>(2 * (r->mask + 1));
+        for (int64_t i = top; i < b; ++i) bigger->At(i).store(r->At(i).load(std::memory_order_relaxed), std::memory_order_relaxed);
+        Ring* nr = bigger.get();
+        m_rings.push_back(std::move(bigger));
+        m_ring.store(nr, std::memory_order_release);
+        return nr;
+    }
+    alignas(64) std::atomic<int64_t> m_top{ 0 };
+    alignas(64) std::atomic<int64_t> m_bottom{ 0 };
+    std::atomic<Ring*> m_ring{ nullptr };
+    std::vector<std::unique_ptr<Ring>> m_rings; // owner only
+};
+
+// The pool starts with the host's worker count and grows when that rises.
+// When it falls, loops post fewer helpers and the extra threads stay parked;
+// Shutdown() ends them all, and the next post starts the current number.
+class Executor {
+public:
+    explicit Executor(PoolHooks hooks = {}) : m_hooks(hooks) {}
+    ~Executor() {
+        if (m_hooks.orphaned) m_hooks.orphaned(m_threads, L"executor");
+        else Shutdown();
+    }
+    void Post(Task fn, Priority prio = Priority::Bulk) {
+        Start();
+        auto* t = new Task(std::move(fn));
+        const int self = Self();
+        if (prio == Priority::Bulk && self >= 0) m_workers[self]->Push(t); // children of running work: LIFO, stealable
+        else if (!(prio == Priority::Interactive ? m_interactive : m_bulk).TryPush(t)) { Execute(t); return; } // full: run inline
+        Wake();
+    }
+    // Runs one queued task on the calling thread; false if none was found.
+    bool RunOne() {
+        if (!m_started.load(std::memory_order_acquire)) return false;
+        Task* t = Find();
+        if (!t) return false;
+        Execute(t);
+        return true;
+    }
+    // Threads a loop should plan for: the host's current answer.
+    unsigned Workers() const {
+        const unsigned n = m_hooks.workers ? m_hooks.workers() : std::thread::hardware_concurrency();
+        return n ? n : 1;
+    }
+    // Threads running now.
+    unsigned Threads() const { return m_running.load(std::memory_order_acquire); }
+    // Only once nothing is queued or running.
+    void Shutdown() {
+        std::lock_guard<std::mutex> g(m_startLock);
+        if (!m_started.load()) return;
+        m_stop.store(true);
+        { std::lock_guard<std::mutex> p(m_parkLock); }
+        m_wake.notify_all();
+        for (auto& t : m_threads) t.join();
+        m_threads.clear();
+        while (Task* t = Find()) Execute(t); // leftover loop helpers with nothing to claim
+        m_running.store(0);
+        m_workers.clear();
+        m_stop.store(false);
+        m_started.store(false);
+    }
+
+    // Runs fn(i) for i in [0, count) on the pool, the calling thread included;
+    // returns once all are done. While the last items finish elsewhere the
+    // caller runs other queued tasks, so nested loops can't deadlock the pool.
+    // The first exception fn throws, on any thread, stops the loop from
+    // handing out further indices and is rethrown here once the calls already
+    // under way have returned, since they still use fn.
+    void For(size_t count, const std::function<void(size_t)>& fn, Priority prio = Priority::Bulk) {
+        if (count == 0) return;
+        struct State {
+            std::atomic<size_t> next{ 0 }, done{ 0 };
+            std::mutex lock;
+            std::condition_variable finished;
+            std::exception_ptr error; // under lock
+        };
+        auto st = std::make_shared<State>();
+        auto finish = [st, count](size_t n) {
+            if (st->done.fetch_add(n) + n == count) { std::lock_guard<std::mutex> g(st->lock); st->finished.notify_all(); }
+        };
+        auto work = [st, count, &fn, finish] { // fn is only touched for claimed indices, all done before we return
+            for (size_t i; (i = st->next.fetch_add(1)) < count; ) {
+                try {
+                    fn(i);
+                } catch (...) {
+                    {
+                        std::lock_guard<std::mutex> g(st->lock);
+                        if (!st->error) st->error = std::current_exception();
+                    }
+                    const size_t rest = st->next.exchange(count); // nobody claims [rest, count) now
+                    if (rest < count) finish(count - rest);
+                }
+                finish(1);
+            }
+        };
+        const size_t helpers = std::min<size_t>(Workers(), count) - 1;
+        for (size_t t = 0; t < helpers; ++t) Post(work, prio);
+        work();
+        while (st->done.load() < count) {
+            if (RunOne()) continue;
+            std::unique_lock<std::mutex> lk(st->lock);
+            st->finished.wait(lk, [&] { return st->done.load() == count; });
+        }
+        std::exception_ptr error;
+        { std::lock_guard<std::mutex> g(st->lock); error.swap(st->error); } // a helper may drop the last st
+        if (error) std::rethrow_exception(error);
+    }
+
+private:
+    void Start() {
+        const unsigned want = Workers();
+        if (m_started.load(std::memory_order_acquire) && want <= m_running.load(std::memory_order_acquire)) return;
+        std::lock_guard<std::mutex> g(m_startLock);
+        if (!m_started.load()) {
+            // Deques for as many workers as the pool may grow to: thieves walk
+            // the array without a lock, so it is never reallocated.
+            const unsigned cap = std::max(want, std::thread::hardware_concurrency());
+            for (unsigned i = 0; i < cap; ++i) m_workers.push_back(std::make_unique<WorkDeque>());
+            m_started.store(true, std::memory_order_release);
+        }
+        const unsigned n = std::min(want, unsigned(m_workers.size()));
+        for (unsigned i = unsigned(m_threads.size()); i < n; ++i) m_threads.emplace_back([this, i] { Worker(int(i)); });
+        m_running.store(unsigned(m_threads.size()), std::memory_order_release);
+    }
+    void Worker(int self) {
+        t_pool = this;
+        t_self = self;
+        Backoff idle;
+        while (!m_stop.load(std::memory_order_acquire)) {
+            if (Task* t = Find()) { Execute(t); idle.Reset(); continue; }
+            if (idle.Step()) continue;
+            Park();
+            idle.Reset();
+        }
+        t_pool = nullptr;
+        t_self = -1;
+    }
+    // Loop helpers catch what fn throws; anything else escaping a task goes to
+    // the host, not std::terminate.
+    void Execute(Task* t) {
+        try {
+            (*t)();
+        } catch (...) {
+            if (m_hooks.failed) m_hooks.failed(std::current_exception());
+        }
+        delete t;
+    }
+    int Self() const { return t_pool == this ? t_self : -1; }
+    Task* Find() {
+        Task* t = nullptr;
+        const int self = Self();
+        if (m_interactive.TryPop(t)) return t;
+        if (self >= 0 && (t = m_workers[self]->Pop())) return t;
+        if (m_bulk.TryPop(t)) return t;
+        const size_t n = m_running.load(std::memory_order_acquire);
+        if (n == 0) return nullptr;
+        thread_local uint32_t seed = uint32_t(std::hash<std::thread::id>()(std::this_thread::get_id())) | 1;
+        seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5; // xorshift: random first victim
+        for (size_t k = 0, v = seed % n; k < n; ++k, v = (v + 1) % n)
+            if (int(v) != self && (t = m_workers[v]->Steal())) return t;
+        return nullptr;
+    }
+    bool HasWork() const {
+        if (!m_interactive.Empty() || !m_bulk.Empty()) return true;
+        for (auto& w : m_workers) if (!w->Empty()) return true;
+        return false;
+    }
+    // The sleeper count is raised under m_parkLock before the final HasWork()
+    // check, and Wake() takes the lock before notifying, so a post can't slip
+    // between a worker's last look and its wait.
+    void Park() {
+        std::unique_lock<std::mutex> lk(m_parkLock);
+        m_sleepers.fetch_add(1, std::memory_order_seq_cst);
+        if (!HasWork() && !m_stop.load()) m_wake.wait(lk);
+        m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+    void Wake() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_sleepers.load(std::memory_order_seq_cst) == 0) return;
+        { std::lock_guard<std::mutex> g(m_parkLock); }
+        m_wake.notify_one();
+    }
+    // The pool a worker thread belongs to and its index there; a worker of
+    // one pool posting to another goes through that pool's queues.
+    static inline thread_local const Executor* t_pool = nullptr;
+    static inline thread_local int t_self = -1;
+    const PoolHooks m_hooks;
+    MpmcQueue<Task*, 4096> m_interactive, m_bulk;
+    std::vector<std::unique_ptr<WorkDeque>> m_workers;
+    std::vector<std::thread> m_threads;
+    std::atomic<bool> m_started{ false }, m_stop{ false };
+    std::atomic<unsigned> m_running{ 0 }, m_sleepers{ 0 };
+    std::mutex m_startLock, m_parkLock;
+    std::condition_variable m_wake;
+};
+
+// ---------- Background jobs ----------
+// Threads for blocking work, added while every one of them is busy - a job
+// may sit in a prompt or a MessageBox - up to kMaxJobThreads.
+struct JobHooks {
+    void (*posted)() = nullptr;   // before a job is queued...
+    void (*finished)() = nullptr; // ...and once it has run (or thrown)
+    // Per thread; threadEnd only runs when threadStart returned true.
+    bool (*threadStart)() = nullptr;
+    void (*threadEnd)() = nullptr;
+    // Runs one job. Unset: run it and drop whatever it throws.
+    void (*run)(const std::function<void()>& job) = nullptr;
+    void (*orphaned)(std::vector<std::thread>& threads, const wchar_t* pool) = nullptr;
+};
+
+class JobQueue {
+public:
+    explicit JobQueue(JobHooks hooks = {}) : m_hooks(hooks) {}
+    ~JobQueue() {
+        if (m_hooks.orphaned) m_hooks.orphaned(m_threads, L"job");
+        else Shutdown();
+    }
+    void Post(std::function<void()> job) {
+        if (m_hooks.posted) m_hooks.posted();
+        std::lock_guard<std::mutex> g(m_lock);
+        m_jobs.push_back(std::move(job));
+        if (m_idle == 0 && m_threads.size() < kMaxJobThreads)
+            m_threads.emplace_back([this] { Worker(); });
+        else
+            m_wake.notify_one();
+    }
+    // Only once nothing is queued or running.
+    void Shutdown() {
+        std::vector<std::thread> threads;
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            m_stop = true;
+            threads.swap(m_threads);
+        }
+        m_wake.notify_all();
+        for (auto& t : threads) t.join();
+        std::lock_guard<std::mutex> g(m_lock);
+        m_stop = false;
+    }
+    static constexpr size_t kMaxJobThreads = 8;
+private:
+    void Worker() {
+        const bool started = m_hooks.threadStart && m_hooks.threadStart();
+        std::unique_lock<std::mutex> lk(m_lock);
+        for (;;) {
+            ++m_idle;
+            m_wake.wait(lk, [this] { return m_stop || !m_jobs.empty(); });
+            --m_idle;
+            if (m_jobs.empty()) break; // stopping
+            std::function<void()> job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+            lk.unlock();
+            Run(job);
+            job = nullptr;
+            if (m_hooks.finished) m_hooks.finished();
+            lk.lock();
+        }
+        lk.unlock();
+        if (started && m_hooks.threadEnd) m_hooks.threadEnd();
+    }
+    void Run(const std::function<void()>& job) {
+        if (m_hooks.run) { m_hooks.run(job); return; }
+        try { job(); } catch (...) {}
+    }
+    const JobHooks m_hooks;
+    std::mutex m_lock;
+    std::condition_variable m_wake;
+    std::deque<std::function<void()>> m_jobs;
+    std::vector<std::thread> m_threads;
+    size_t m_idle{ 0 };
+    bool m_stop{ false };
+};
+
+// ---------- Channel ----------
+// Bounded queue between pipeline stages: a slow stage blocks the ones feeding
+// it instead of letting the queue grow. Counts its peak depth and how often a
+// producer had to wait.
+template<class T> class Channel {
+public:
+    explicit Channel(size_t capacity) : m_capacity(std::max<size_t>(capacity, 1)) {}
+    // Blocks while full; false if the channel was closed.
+    bool Push(T v) {
+        std::unique_lock<std::mutex> lk(m_lock);
+        if (m_items.size() >= m_capacity && !m_closed) {
+            ++m_stalls;
+            m_notFull.wait(lk, [this] { return m_items.size() < m_capacity || m_closed; });
+        }
+        if (m_closed) return false;
+        m_items.push_back(std::move(v));
+        m_peak = std::max(m_peak, m_items.size());
+        lk.unlock();
+        m_notEmpty.notify_one();
+        return true;
+    }
+    // Blocks while empty; false once closed and drained.
+    bool Pop(T& v) {
+        std::unique_lock<std::mutex> lk(m_lock);
+        m_notEmpty.wait(lk, [this] { return !m_items.empty() || m_closed; });
+        if (m_items.empty()) return false;
+        v = std::move(m_items.front());
+        m_items.pop_front();
+        lk.unlock();
+        m_notFull.notify_one();
+        return true;
+    }
+    void Close() {
+        { std::lock_guard<std::mutex> g(m_lock); m_closed = true; }
+        m_notEmpty.notify_all();
+        m_notFull.notify_all();
+    }
+    size_t Peak() { std::lock_guard<std::mutex> g(m_lock); return m_peak; }
+    uint64_t Stalls() { std::lock_guard<std::mutex> g(m_lock); return m_stalls; }
+private:
+    std::mutex m_lock;
+    std::condition_variable m_notEmpty, m_notFull;
+    std::deque<T> m_items;
+    const size_t m_capacity;
+    size_t m_peak{ 0 };
+    uint64_t m_stalls{ 0 };
+    bool m_closed{ false };
+};
+
+// ---------- Seqlock ----------
+// For records shared without a lock (the DLL's cross-process cache): readers
+// copy between two loads of `seq`; a writer owns the record from a
+// successful even -> odd exchange until it stores seq + 2. T must be
+// trivially copyable; a reader may copy a torn record but never returns one.
+template<class T> bool SeqRead(const std::atomic<uint32_t>& seq, const T& src, T& out) {
+    uint32_t s1 = seq.load(std::memory_order_acquire);
+    if (s1 & 1) return false;
+    memcpy(&out, &src, sizeof(T));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return seq.load(std::memory_order_relaxed) == s1;
+}
+// False if another writer holds the record: drop the write.
+inline bool SeqWriteBegin(std::atomic<uint32_t>& seq, uint32_t& start) {
+    start = seq.load(std::memory_order_relaxed);
+    if ((start & 1) || !seq.compare_exchange_strong(start, start + 1, std::memory_order_acquire)) return false;
+    // Pairs with SeqRead's fence: a reader that copies any of the new bytes
+    // then sees the odd number (or a later one) and discards its copy.
+    std::atomic_thread_fence(std::memory_order_release);
+    return true;
+}
+inline void SeqWriteEnd(std::atomic<uint32_t>& seq, uint32_t start) { seq.store(start + 2, std::memory_order_release); }
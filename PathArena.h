@@ -0,0 +1,141 @@
+// PathArena.h
+// The selection storage of 7Zip.ShellExtension.cpp, on any 16-bit code unit
+// like Utf8.h, so tests/ can measure and round-trip it on any platform.
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "Utf8.h"
+
+// Paths of one selection in a single UTF-8 buffer, front coded: each path
+// stores how many leading bytes it shares with the one before it plus the
+// rest, so items of one folder keep that folder once. Every kRestart-th path
+// is stored whole, so Get(i) replays at most kRestart - 1 predecessors; 32-bit
+// offsets locate the restarts. Iterating decodes each entry once, in order.
+// UTF-16 is produced on demand for Win32 calls.
+template<class C> class BasicPathArena {
+public:
+    using String = std::basic_string<C>;
+
+    class const_iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = String;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const String*;
+        using reference = const String&;
+
+        const String& operator*() const { return m_path; }
+        const String* operator->() const { return &m_path; }
+        const_iterator& operator++() {
+            if (++m_i < m_arena->m_count) Decode();
+            return *this;
+        }
+        bool operator==(const const_iterator& o) const { return m_i == o.m_i; }
+        bool operator!=(const const_iterator& o) const { return m_i != o.m_i; }
+
+    private:
+        friend class BasicPathArena;
+        const_iterator(const BasicPathArena* arena, size_t i) : m_arena(arena), m_i(i), m_p(arena->m_buf.data()) {
+            if (m_i < m_arena->m_count) Decode();
+        }
+        void Decode() {
+            Next(m_p, m_utf8);
+            ToWide(m_utf8, m_path);
+        }
+        const BasicPathArena* m_arena;
+        size_t m_i;
+        const char* m_p;
+        std::string m_utf8; // the current path; the next entry is relative to it
+        String m_path;
+    };
+
+    BasicPathArena() = default;
+    explicit BasicPathArena(const std::vector<String>& paths) { Assign(paths); }
+
+    void Assign(const std::vector<String>& paths) {
+        m_buf.clear();
+        m_restarts.clear();
+        m_count = paths.size();
+        m_sameParent = !paths.empty();
+        std::string prev, cur, parent;
+        for (size_t i = 0; i < paths.size(); ++i) {
+            cur.resize(paths[i].size() * 3);
+            cur.resize(Utf16ToUtf8(paths[i].data(), paths[i].size(), cur.data()));
+            size_t shared = 0;
+            if (i % kRestart == 0) {
+                m_restarts.push_back(uint32_t(m_buf.size()));
+            } else {
+                const size_t n = std::min(prev.size(), cur.size());
+                while (shared < n && prev[shared] == cur[shared]) ++shared;
+            }
+            PutVarint(shared);
+            PutVarint(cur.size() - shared);
+            m_buf.append(cur, shared, std::string::npos);
+            if (i == 0) {
+                parent = cur.substr(0, cur.find_last_of("\\/") + 1); // npos + 1: no parent
+                m_sameParent = !parent.empty();
+            } else if (m_sameParent) {
+                m_sameParent = cur.size() > parent.size() && cur.compare(0, parent.size(), parent) == 0 &&
+                               cur.find_first_of("\\/", parent.size()) == std::string::npos;
+            }
+            prev.swap(cur);
+        }
+        m_buf.shrink_to_fit();
+        m_restarts.shrink_to_fit();
+    }
+    size_t size() const { return m_count; }
+    bool empty() const { return m_count == 0; }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, m_count); }
+    // Every item sits directly in the first one's folder (found while assigning).
+    bool SameParent() const { return m_sameParent; }
+    // Decodes straight into `out` (String or a scratch string).
+    template<class S> void Get(size_t i, S& out) const {
+        std::string path;
+        const char* p = m_buf.data() + m_restarts[i / kRestart];
+        for (size_t k = i % kRestart + 1; k; --k) Next(p, path);
+        ToWide(path, out);
+    }
+    String operator[](size_t i) const {
+        String out;
+        Get(i, out);
+        return out;
+    }
+    size_t Bytes() const { return m_buf.capacity() + m_restarts.capacity() * sizeof(uint32_t); }
+
+private:
+    static constexpr size_t kRestart = 16;
+    void PutVarint(size_t v) {
+        for (; v >= 0x80; v >>= 7) m_buf += char(0x80 | (v & 0x7F));
+        m_buf += char(v);
+    }
+    static size_t GetVarint(const char*& p) {
+        size_t v = 0;
+        for (unsigned shift = 0; ; shift += 7) {
+            const uint8_t b = uint8_t(*p++);
+            v |= size_t(b & 0x7F) << shift;
+            if (b < 0x80) return v;
+        }
+    }
+    // Applies the entry at p to `path` (the previous path) and advances p.
+    static void Next(const char*& p, std::string& path) {
+        const size_t shared = GetVarint(p), len = GetVarint(p);
+        path.resize(shared);
+        path.append(p, len);
+        p += len;
+    }
+    template<class S> static void ToWide(const std::string& u, S& out) {
+        out.resize(u.size());
+        out.resize(Utf8ToUtf16(u.data(), u.size(), out.data()));
+    }
+    std::string m_buf;
+    std::vector<uint32_t> m_restarts; // offset of every kRestart-th entry
+    size_t m_count{ 0 };
+    bool m_sameParent{ false };
+};
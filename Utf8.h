@@ -0,0 +1,113 @@
+// Utf8.h
+// The UTF-8 <-> UTF-16 transcoders of 7Zip.ShellExtension.cpp, on any 16-bit
+// code unit (wchar_t on Windows, char16_t where wchar_t is 32 bits), so
+// tests/ can run them and the path arena built on them on any platform.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// The one transcoder for list files, reports and the index. Runs of ASCII are
+// converted 16 code units at a time with SSE2; everything else goes through
+// the scalar path. Ill-formed input (lone surrogates, invalid UTF-8) becomes
+// U+FFFD, one replacement per maximal invalid subsequence.
+template<class C> size_t Utf16ToUtf8(const C* src, size_t n, char* dst) {
+    static_assert(sizeof(C) == 2, "UTF-16 code units");
+    char* out = dst;
+    size_t i = 0;
+    while (i < n) {
+#if defined(_M_X64) || defined(__SSE2__)
+        while (i + 16 <= n) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 8));
+            __m128i hi = _mm_and_si128(_mm_or_si128(a, b), _mm_set1_epi16(short(0xFF80)));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(hi, _mm_setzero_si128())) != 0xFFFF) break;
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_packus_epi16(a, b));
+            out += 16;
+            i += 16;
+        }
+        if (i == n) break;
+#endif
+        uint32_t c = uint16_t(src[i++]);
+        if (c < 0x80) { *out++ = char(c); continue; }
+        if (c < 0x800) {
+            *out++ = char(0xC0 | (c >> 6));
+            *out++ = char(0x80 | (c & 0x3F));
+            continue;
+        }
+        if (c >= 0xD800 && c <= 0xDFFF) {
+            uint32_t lo = i < n ? uint16_t(src[i]) : 0;
+            if (c <= 0xDBFF && lo >= 0xDC00 && lo <= 0xDFFF) {
+                ++i;
+                c = 0x10000 + ((c - 0xD800) << 10) + (lo - 0xDC00);
+                *out++ = char(0xF0 | (c >> 18));
+                *out++ = char(0x80 | ((c >> 12) & 0x3F));
+                *out++ = char(0x80 | ((c >> 6) & 0x3F));
+                *out++ = char(0x80 | (c & 0x3F));
+                continue;
+            }
+            c = 0xFFFD; // lone surrogate
+        }
+        *out++ = char(0xE0 | (c >> 12));
+        *out++ = char(0x80 | ((c >> 6) & 0x3F));
+        *out++ = char(0x80 | (c & 0x3F));
+    }
+    return size_t(out - dst);
+}
+template<class C> size_t Utf8ToUtf16(const char* src, size_t n, C* dst) {
+    static_assert(sizeof(C) == 2, "UTF-16 code units");
+    const uint8_t* s = reinterpret_cast<const uint8_t*>(src);
+    C* out = dst;
+    size_t i = 0;
+    while (i < n) {
+#if defined(_M_X64) || defined(__SSE2__)
+        while (i + 16 <= n) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            if (_mm_movemask_epi8(v)) break;
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_unpacklo_epi8(v, _mm_setzero_si128()));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 8), _mm_unpackhi_epi8(v, _mm_setzero_si128()));
+            out += 16;
+            i += 16;
+        }
+        if (i == n) break;
+#endif
+        uint32_t b0 = s[i];
+        if (b0 < 0x80) { *out++ = C(b0); ++i; continue; }
+        // Sequence length and the allowed range of the second byte (excludes
+        // overlongs, surrogates and code points above U+10FFFF).
+        size_t len = 0;
+        uint32_t lo2 = 0x80, hi2 = 0xBF, c = 0;
+        if (b0 >= 0xC2 && b0 <= 0xDF) { len = 2; c = b0 & 0x1F; }
+        else if (b0 >= 0xE0 && b0 <= 0xEF) {
+            len = 3; c = b0 & 0x0F;
+            if (b0 == 0xE0) lo2 = 0xA0;
+            if (b0 == 0xED) hi2 = 0x9F;
+        } else if (b0 >= 0xF0 && b0 <= 0xF4) {
+            len = 4; c = b0 & 0x07;
+            if (b0 == 0xF0) lo2 = 0x90;
+            if (b0 == 0xF4) hi2 = 0x8F;
+        }
+        size_t k = 1;
+        if (len) {
+            for (; k < len && i + k < n; ++k) {
+                uint32_t b = s[i + k];
+                if (k == 1 ? (b < lo2 || b > hi2) : (b & 0xC0) != 0x80) break;
+                c = (c << 6) | (b & 0x3F);
+            }
+        }
+        if (!len || k < len) { *out++ = C(0xFFFD); i += k; continue; }
+        i += len;
+        if (c >= 0x10000) {
+            c -= 0x10000;
+            *out++ = C(0xD800 + (c >> 10));
+            *out++ = C(0xDC00 + (c & 0x3FF));
+        } else {
+            *out++ = C(c);
+        }
+    }
+    return size_t(out - dst);
+}
@@ -0,0 +1,106 @@
+// CacheBudgetTests.cpp
+// CacheBudget.h: least-recently-used trimming, the rate-limited budget check
+// on growth, and caches growing, being used and trimmed from many threads.
+
+#include "CacheBudget.h"
+#include "TestMain.h"
+
+#include <thread>
+#include <vector>
+
+namespace {
+
+// A cache that is just a byte count, with its own lock like the real ones.
+struct FakeCache {
+    std::mutex lock;
+    size_t bytes{ 0 };
+    std::atomic<int> measured{ 0 }, trimmed{ 0 };
+    size_t Bytes() { measured.fetch_add(1); std::lock_guard<std::mutex> g(lock); return bytes; }
+    void Trim(size_t keep) { trimmed.fetch_add(1); std::lock_guard<std::mutex> g(lock); bytes = std::min(bytes, keep); }
+    void Add(size_t n) { std::lock_guard<std::mutex> g(lock); bytes += n; }
+    size_t Register(CacheBudget& b, const wchar_t* name) {
+        return b.Register(name, [this] { return Bytes(); }, [this](size_t keep) { Trim(keep); });
+    }
+};
+
+void Sleep(unsigned ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+
+} // namespace
+
+TEST(CacheBudgetTrimsLeastRecentlyUsedFirst) {
+    CacheBudget budget;
+    FakeCache a, b, c;
+    const size_t ia = a.Register(budget, L"a"), ib = b.Register(budget, L"b"), ic = c.Register(budget, L"c");
+    a.Add(100); b.Add(100); c.Add(100);
+    budget.Touch(ib); Sleep(2);
+    budget.Touch(ic); Sleep(2);
+    budget.Touch(ia); // a is the most recent, b the least
+    budget.TrimTo(150);
+    CHECK(budget.Total() == 150);
+    CHECK(b.bytes == 0);   // emptied first
+    CHECK(c.bytes == 50);  // then cut to what still fits
+    CHECK(a.bytes == 100); // untouched
+    budget.TrimTo(0);
+    CHECK(budget.Total() == 0);
+}
+
+TEST(CacheBudgetGrewChecksAtMostEveryCheckInterval) {
+    CacheBudget budget;
+    budget.SetBudget(1000);
+    FakeCache a;
+    const size_t id = a.Register(budget, L"a");
+    a.Add(400);
+    CHECK(!budget.Grew(id)); // measured, under budget
+    const int measured = a.measured.load();
+    a.Add(2000);
+    for (int i = 0; i < 1000; ++i) CHECK(!budget.Grew(id)); // within kCheckMs: not even measured
+    CHECK(a.measured.load() == measured);
+    Sleep(unsigned(CacheBudget::kCheckMs) + 20);
+    CHECK(budget.Grew(id));
+    CHECK(a.bytes == 750); // three quarters of the budget
+}
+
+TEST(CacheBudgetIdle) {
+    CacheBudget budget;
+    FakeCache a;
+    const size_t id = a.Register(budget, L"a");
+    budget.Touch(id);
+    CHECK(budget.IdleMs() < 50);
+    Sleep(60);
+    CHECK(budget.IdleMs() >= 50);
+}
+
+// Threads grow and use caches while another trims: nothing deadlocks, the
+// growth checks do trim, and a final check brings the total back under the
+// budget.
+TEST(CacheBudgetConcurrentGrowthAndTrim) {
+    CacheBudget budget;
+    budget.SetBudget(1 << 20);
+    std::vector<FakeCache> caches(CacheBudget::kMaxCaches);
+    std::vector<size_t> ids;
+    for (auto& c : caches) ids.push_back(c.Register(budget, L"cache"));
+    std::atomic<bool> stop{ false };
+    std::atomic<int> trims{ 0 };
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < 6; ++t)
+        threads.emplace_back([&, t] {
+            uint32_t x = 0x9E3779B9u * (t + 1);
+            while (!stop.load()) {
+                x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+                const size_t i = x % caches.size();
+                if (x & 0x100) { caches[i].Add(4096 + (x & 0xFFFF)); if (budget.Grew(ids[i])) trims.fetch_add(1); }
+                else budget.Touch(ids[i]);
+            }
+        });
+    threads.emplace_back([&] {
+        while (!stop.load()) { budget.TrimTo(budget.Budget() / 2); Sleep(1); }
+    });
+    Sleep(500);
+    stop.store(true);
+    for (auto& t : threads) t.join();
+    CHECK(trims.load() > 0);
+    Sleep(unsigned(CacheBudget::kCheckMs) + 20);
+    caches[0].Add(1);
+    budget.Grew(ids[0]);
+    CHECK(budget.Total() <= budget.Budget());
+}
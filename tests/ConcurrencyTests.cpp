@@ -0,0 +1,300 @@
+// ConcurrencyTests.cpp
+// Stress tests for Concurrency.h: the lock-free queues under contention, the
+// executor's full-queue and shutdown paths, the job queue and the channel.
+
+#include "Concurrency.h"
+#include "TestMain.h"
+
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+// Runs fn(t) on `threads` threads released together.
+template<class F> void OnThreads(unsigned threads, F fn) {
+    std::atomic<unsigned> ready{ 0 };
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < threads; ++t)
+        pool.emplace_back([&, t] {
+            ready.fetch_add(1);
+            while (ready.load() < threads) std::this_thread::yield();
+            fn(t);
+        });
+    for (auto& th : pool) th.join();
+}
+
+unsigned TwoWorkers() { return 2; }
+unsigned FourWorkers() { return 4; }
+
+} // namespace
+
+TEST(MpmcQueueEveryItemOnce) {
+    constexpr unsigned kProducers = 4, kConsumers = 4;
+    constexpr size_t kPerProducer = 100000;
+    MpmcQueue<size_t, 1024> q;
+    std::vector<std::atomic<uint8_t>> seen(kProducers * kPerProducer);
+    std::atomic<unsigned> producing{ kProducers };
+    std::atomic<size_t> popped{ 0 };
+    OnThreads(kProducers + kConsumers, [&](unsigned t) {
+        if (t < kProducers) {
+            for (size_t i = 0; i < kPerProducer; ++i)
+                while (!q.TryPush(t * kPerProducer + i)) std::this_thread::yield(); // full: consumers catch up
+            producing.fetch_sub(1);
+            return;
+        }
+        size_t v;
+        for (;;) {
+            if (q.TryPop(v)) { seen[v].fetch_add(1); popped.fetch_add(1); continue; }
+            if (producing.load() == 0 && q.Empty()) break;
+        }
+    });
+    CHECK(popped.load() == seen.size());
+    size_t once = 0;
+    for (auto& s : seen) once += s.load() == 1;
+    CHECK(once == seen.size());
+}
+
+TEST(MpmcQueueFullAndEmpty) {
+    MpmcQueue<int, 8> q;
+    int v = -1;
+    CHECK(!q.TryPop(v));
+    for (int i = 0; i < 8; ++i) CHECK(q.TryPush(i));
+    CHECK(!q.TryPush(8));
+    CHECK(q.TryPop(v) && v == 0);
+    CHECK(q.TryPush(8));
+    for (int i = 1; i <= 8; ++i) CHECK(q.TryPop(v) && v == i);
+    CHECK(q.Empty());
+}
+
+// The owner pushes and pops at the bottom while thieves steal from the top;
+// the ring grows past its first 256 slots along the way.
+TEST(WorkDequeStealPopRace) {
+    constexpr unsigned kThieves = 4;
+    constexpr size_t kTasks = 300000;
+    WorkDeque d;
+    std::vector<Task> tasks(kTasks);
+    std::vector<std::atomic<uint8_t>> taken(kTasks);
+    std::atomic<bool> done{ false };
+    std::atomic<size_t> total{ 0 };
+    auto take = [&](Task* t) { taken[size_t(t - tasks.data())].fetch_add(1); total.fetch_add(1); };
+    OnThreads(kThieves + 1, [&](unsigned t) {
+        if (t == 0) {
+            for (size_t i = 0; i < kTasks; ++i) {
+                d.Push(&tasks[i]);
+                if (i % 3 == 0) if (Task* p = d.Pop()) take(p); // owner competes for the bottom
+            }
+            while (Task* p = d.Pop()) take(p);
+            done.store(true);
+            return;
+        }
+        while (!done.load() || !d.Empty())
+            if (Task* p = d.Steal()) take(p);
+    });
+    CHECK(total.load() == kTasks);
+    size_t once = 0;
+    for (auto& s : taken) once += s.load() == 1;
+    CHECK(once == kTasks);
+}
+
+TEST(ExecutorRunsEveryPost) {
+    Executor ex({ FourWorkers, nullptr });
+    std::atomic<size_t> ran{ 0 };
+    OnThreads(4, [&](unsigned) {
+        for (int i = 0; i < 20000; ++i) ex.Post([&] { ran.fetch_add(1); }, i % 2 ? Priority::Bulk : Priority::Interactive);
+    });
+    while (ran.load() < 80000) if (!ex.RunOne()) std::this_thread::yield();
+    CHECK(ran.load() == 80000);
+    ex.Shutdown();
+}
+
+// With every worker stuck, posts beyond the 4096-slot injection queue run on
+// the posting thread instead of being lost.
+TEST(ExecutorFullQueueRunsInline) {
+    Executor ex({ TwoWorkers, nullptr });
+    std::atomic<bool> release{ false };
+    std::atomic<unsigned> blocked{ 0 };
+    for (int i = 0; i < 2; ++i) ex.Post([&] { blocked.fetch_add(1); while (!release.load()) std::this_thread::yield(); });
+    while (blocked.load() < 2) std::this_thread::yield();
+    const auto me = std::this_thread::get_id();
+    std::atomic<size_t> ran{ 0 }, inlined{ 0 };
+    for (int i = 0; i < 5000; ++i) ex.Post([&] { ran.fetch_add(1); if (std::this_thread::get_id() == me) inlined.fetch_add(1); });
+    CHECK(inlined.load() == 5000 - 4096);
+    release.store(true);
+    while (ran.load() < 5000) if (!ex.RunOne()) std::this_thread::yield();
+    CHECK(ran.load() == 5000);
+    ex.Shutdown();
+}
+
+TEST(ExecutorShutdownAndRestart) {
+    Executor ex({ FourWorkers, nullptr });
+    for (int round = 0; round < 20; ++round) {
+        std::atomic<size_t> ran{ 0 };
+        for (int i = 0; i < 1000; ++i) ex.Post([&] { ran.fetch_add(1); });
+        while (ran.load() < 1000) if (!ex.RunOne()) std::this_thread::yield();
+        ex.Shutdown(); // joins the workers; the next Post starts new ones
+        CHECK(ran.load() == 1000);
+    }
+    ex.Shutdown(); // twice is harmless
+}
+
+TEST(ExecutorNestedFor) {
+    Executor ex({ FourWorkers, nullptr });
+    std::vector<std::atomic<uint32_t>> hits(64 * 64);
+    ex.For(64, [&](size_t i) {
+        ex.For(64, [&](size_t j) { hits[i * 64 + j].fetch_add(1); });
+    });
+    size_t once = 0;
+    for (auto& h : hits) once += h.load() == 1;
+    CHECK(once == hits.size());
+    ex.Shutdown();
+}
+
+// fn throwing on the calling thread or on a worker: the loop stops handing
+// out indices, waits for the calls in flight (which still use fn and the
+// caller's locals) and rethrows the first exception to the caller.
+TEST(ExecutorForRethrowsAfterInFlightCalls) {
+    Executor ex({ FourWorkers, nullptr });
+    const auto me = std::this_thread::get_id();
+    for (int onWorker = 0; onWorker < 2; ++onWorker) {
+        for (int round = 0; round < 20; ++round) {
+            constexpr size_t kCount = 100000;
+            std::atomic<int> inFlight{ 0 };
+            std::atomic<size_t> calls{ 0 };
+            bool caught = false, overlapped = false;
+            try {
+                ex.For(kCount, [&](size_t i) {
+                    inFlight.fetch_add(1);
+                    calls.fetch_add(1);
+                    const bool caller = std::this_thread::get_id() == me;
+                    if (caller) std::this_thread::sleep_for(std::chrono::microseconds(50)); // let the workers claim some
+                    const bool thrower = onWorker ? !caller : i == 10;
+                    if (thrower && i >= 10) { inFlight.fetch_sub(1); throw std::runtime_error("item failed"); }
+                    std::this_thread::sleep_for(std::chrono::microseconds(i % 7));
+                    inFlight.fetch_sub(1);
+                });
+            } catch (const std::runtime_error& e) {
+                caught = std::string(e.what()) == "item failed";
+                overlapped = inFlight.load() != 0;
+            }
+            CHECK(caught);
+            CHECK(!overlapped);     // nothing still running on another thread
+            CHECK(calls.load() < kCount); // and the rest were never started
+        }
+    }
+    // The pool is still usable afterwards.
+    std::atomic<size_t> ran{ 0 };
+    ex.For(1000, [&](size_t) { ran.fetch_add(1); });
+    CHECK(ran.load() == 1000);
+    ex.Shutdown();
+}
+
+namespace {
+std::atomic<int> g_taskFailures{ 0 };
+std::atomic<unsigned> g_wanted{ 2 };
+unsigned WantedWorkers() { return g_wanted.load(); }
+} // namespace
+
+TEST(ExecutorThrowingTaskReachesHook) {
+    PoolHooks hooks;
+    hooks.workers = TwoWorkers;
+    hooks.failed = [](std::exception_ptr) { g_taskFailures.fetch_add(1); };
+    Executor ex(hooks);
+    std::atomic<int> ran{ 0 };
+    for (int i = 0; i < 100; ++i) ex.Post([&, i] { ran.fetch_add(1); if (i % 2) throw 42; });
+    while (ran.load() < 100) if (!ex.RunOne()) std::this_thread::yield();
+    while (g_taskFailures.load() < 50) std::this_thread::yield(); // the last throw may still be unwinding
+    CHECK(g_taskFailures.load() == 50);
+    ex.Shutdown();
+}
+
+// The pool follows the host's worker count upwards while running; loops
+// plan for the current count either way.
+TEST(ExecutorGrowsWithWorkerCount) {
+    Executor ex({ WantedWorkers, nullptr });
+    const unsigned cap = std::max(2u, std::thread::hardware_concurrency());
+    g_wanted.store(2);
+    ex.For(100, [](size_t) {});
+    CHECK(ex.Threads() == 2);
+    g_wanted.store(cap + 4);
+    std::atomic<size_t> ran{ 0 };
+    ex.For(10000, [&](size_t) { ran.fetch_add(1); });
+    CHECK(ran.load() == 10000);
+    CHECK(ex.Threads() == cap); // never more than the deques made at start
+    g_wanted.store(1);
+    ex.For(100, [&](size_t) { ran.fetch_add(1); });
+    CHECK(ran.load() == 10100);
+    CHECK(ex.Threads() == cap); // shrinking parks, it doesn't join
+    ex.Shutdown();
+    CHECK(ex.Threads() == 0);
+    ex.Post([] {}); // a one-worker loop runs inline and starts nothing
+    CHECK(ex.Threads() == 1);
+    ex.Shutdown();
+}
+
+namespace {
+std::atomic<int> g_posted{ 0 }, g_finished{ 0 }, g_threadsStarted{ 0 }, g_threadsEnded{ 0 };
+} // namespace
+
+TEST(JobQueueHooksAndRestart) {
+    JobHooks hooks;
+    hooks.posted = [] { g_posted.fetch_add(1); };
+    hooks.finished = [] { g_finished.fetch_add(1); };
+    hooks.threadStart = [] { g_threadsStarted.fetch_add(1); return true; };
+    hooks.threadEnd = [] { g_threadsEnded.fetch_add(1); };
+    JobQueue jobs(hooks);
+    for (int round = 0; round < 3; ++round) {
+        std::atomic<int> ran{ 0 };
+        for (int i = 0; i < 100; ++i)
+            jobs.Post([&, i] { ran.fetch_add(1); if (i % 10 == 0) throw std::runtime_error("job failed"); });
+        while (g_finished.load() < (round + 1) * 100) std::this_thread::yield();
+        CHECK(ran.load() == 100);
+        jobs.Shutdown();
+        CHECK(g_threadsStarted.load() == g_threadsEnded.load());
+    }
+    CHECK(g_posted.load() == 300);
+    CHECK(g_finished.load() == 300); // thrown jobs count as finished too
+}
+
+// More blocked jobs than threads: the extra ones wait for a thread instead
+// of starting a ninth.
+TEST(JobQueueThreadCap) {
+    JobQueue jobs;
+    std::atomic<bool> release{ false };
+    std::atomic<int> running{ 0 }, peak{ 0 }, ran{ 0 };
+    for (size_t i = 0; i < JobQueue::kMaxJobThreads + 4; ++i)
+        jobs.Post([&] {
+            const int now = running.fetch_add(1) + 1;
+            for (int p = peak.load(); now > p && !peak.compare_exchange_weak(p, now); ) {}
+            while (!release.load()) std::this_thread::yield();
+            running.fetch_sub(1);
+            ran.fetch_add(1);
+        });
+    while (running.load() < int(JobQueue::kMaxJobThreads)) std::this_thread::yield();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    CHECK(peak.load() == int(JobQueue::kMaxJobThreads));
+    release.store(true);
+    while (ran.load() < int(JobQueue::kMaxJobThreads + 4)) std::this_thread::yield();
+    jobs.Shutdown();
+}
+
+TEST(ChannelOrderBackpressureClose) {
+    constexpr unsigned kProducers = 3, kConsumers = 3;
+    constexpr uint64_t kPerProducer = 50000;
+    Channel<uint64_t> ch(4);
+    std::atomic<unsigned> producing{ kProducers };
+    std::atomic<uint64_t> sum{ 0 }, count{ 0 };
+    OnThreads(kProducers + kConsumers, [&](unsigned t) {
+        if (t < kProducers) {
+            for (uint64_t i = 1; i <= kPerProducer; ++i) CHECK(ch.Push(i));
+            if (producing.fetch_sub(1) == 1) ch.Close();
+            return;
+        }
+        uint64_t v;
+        while (ch.Pop(v)) { sum.fetch_add(v); count.fetch_add(1); }
+    });
+    CHECK(count.load() == kProducers * kPerProducer);
+    CHECK(sum.load() == kProducers * kPerProducer * (kPerProducer + 1) / 2);
+    CHECK(ch.Peak() <= 4);
+    CHECK(ch.Stalls() > 0);
+    CHECK(!ch.Push(1)); // closed
+}
@@ -0,0 +1,126 @@
+// PathArenaTests.cpp
+// PathArena.h and Utf8.h: paths come back exactly as stored, by index and by
+// iteration, across restarts and non-ASCII text; and 100k paths of a typical
+// selection take a small fraction of the memory they take as separate strings.
+
+#include "PathArena.h"
+#include "TestMain.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+// wchar_t is 32 bits here; char16_t is the Windows wchar_t's stand-in.
+using Arena = BasicPathArena<char16_t>;
+using String = Arena::String;
+
+String ToString(const char* ascii) { return String(ascii, ascii + std::strlen(ascii)); }
+
+// Folder f, file i of a photo library: the shape of a large selection.
+String LibraryPath(size_t f, size_t i) {
+    char buf[128];
+    std::snprintf(buf, sizeof(buf), "C:\\Users\\someone\\Pictures\\Holidays\\%03zu\\IMG_%04zu.jpg", f, i);
+    return ToString(buf);
+}
+
+// What std::vector<std::wstring> holds for the same paths on Windows.
+size_t StringBytes(const std::vector<String>& paths) {
+    size_t bytes = paths.capacity() * sizeof(String);
+    for (auto& p : paths) bytes += p.size() < 8 ? 0 : (p.capacity() + 1) * sizeof(char16_t); // past the SSO buffer
+    return bytes;
+}
+
+double Seconds(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+}
+
+} // namespace
+
+TEST(Utf8RoundTripsAndReplacesIllFormedInput) {
+    const String text = u"C:\\Users\\Zo\u00EB\\\u6587\u4EF6\\\U0001F600 and a run of ASCII longer than sixteen.txt";
+    std::string utf8(text.size() * 3, '\0');
+    utf8.resize(Utf16ToUtf8(text.data(), text.size(), utf8.data()));
+    CHECK(utf8 == "C:\\Users\\Zo\xC3\xAB\\\xE6\x96\x87\xE4\xBB\xB6\\\xF0\x9F\x98\x80 and a run of ASCII longer than sixteen.txt");
+    String back(utf8.size(), u'\0');
+    back.resize(Utf8ToUtf16(utf8.data(), utf8.size(), back.data()));
+    CHECK(back == text);
+
+    const char16_t lone[] = { u'a', char16_t(0xD800), u'b' };
+    std::string out(9, '\0');
+    out.resize(Utf16ToUtf8(lone, 3, out.data()));
+    CHECK(out == "a\xEF\xBF\xBD" "b");
+
+    const char bad[] = "a\xC0\xAF" "b\xE2\x82";
+    String wide(sizeof(bad), u'\0');
+    wide.resize(Utf8ToUtf16(bad, sizeof(bad) - 1, wide.data()));
+    CHECK(wide == String(u"a\uFFFD\uFFFDb\uFFFD")); // one U+FFFD per maximal invalid subsequence
+}
+
+TEST(PathArenaReturnsEveryPathByIndexAndInOrder) {
+    std::vector<String> paths;
+    for (size_t i = 0; i < 100; ++i) paths.push_back(LibraryPath(i / 7, i)); // folders change mid-restart
+    paths.push_back(u"D:\\\u6587\u4EF6\\\U0001F600.txt");
+    paths.push_back(u"D:\\\u6587\u4EF6\\\U0001F601.txt"); // shares a prefix up to the middle of a code point
+    paths.push_back(u"");
+    paths.push_back(u"relative");
+    Arena arena(paths);
+    CHECK(arena.size() == paths.size());
+    for (size_t i = 0; i < paths.size(); ++i) CHECK(arena[i] == paths[i]);
+    size_t i = 0;
+    for (auto& p : arena) CHECK(i < paths.size() && p == paths[i++]);
+    CHECK(i == paths.size());
+
+    Arena empty;
+    CHECK(empty.empty() && empty.begin() == empty.end());
+    empty.Assign({});
+    CHECK(empty.empty());
+}
+
+TEST(PathArenaSameParent) {
+    CHECK(Arena({ u"C:\\a\\x", u"C:\\a\\y", u"C:\\a\\z.txt" }).SameParent());
+    CHECK(Arena({ u"C:\\a\\x" }).SameParent());
+    CHECK(!Arena({ u"C:\\a\\x", u"C:\\a\\b\\y" }).SameParent()); // one level down
+    CHECK(!Arena({ u"C:\\a\\x", u"C:\\ab\\y" }).SameParent());   // shares the prefix, not the folder
+    CHECK(!Arena({ u"C:\\a\\x", u"C:\\a\\" }).SameParent());
+    CHECK(!Arena({ u"x", u"y" }).SameParent());                  // no folder at all
+}
+
+// The figure behind keeping selections in an arena: 100k paths in 100
+// folders. Also times decoding them in order and by index.
+TEST(PathArenaHundredThousandPaths) {
+    constexpr size_t kPaths = 100000;
+    std::vector<String> paths;
+    paths.reserve(kPaths);
+    for (size_t i = 0; i < kPaths; ++i) paths.push_back(LibraryPath(i / 1000, i % 1000 + 1));
+    Arena arena(paths);
+
+    const size_t arenaBytes = arena.Bytes(), stringBytes = StringBytes(paths);
+    std::printf("  100k paths: %.2f MB in the arena, %.2f MB as separate strings\n",
+                arenaBytes / 1e6, stringBytes / 1e6);
+    CHECK(arenaBytes < 11 * kPaths);  // about 1 MB: a file name's tail and two varints per path
+    CHECK(stringBytes > 12000000);
+    CHECK(arenaBytes * 10 < stringBytes);
+
+    size_t i = 0;
+    bool same = true;
+    for (auto& p : arena) same = same && p == paths[i++];
+    CHECK(same && i == kPaths);
+
+    auto start = std::chrono::steady_clock::now();
+    size_t chars = 0;
+    for (auto& p : arena) chars += p.size();
+    const double inOrder = Seconds(start);
+
+    start = std::chrono::steady_clock::now();
+    size_t byIndex = 0;
+    String scratch;
+    for (size_t k = 0; k < kPaths; ++k) { arena.Get(k, scratch); byIndex += scratch.size(); }
+    const double indexed = Seconds(start);
+    CHECK(byIndex == chars);
+    std::printf("  decoding: %.1f M paths/s in order, %.1f M paths/s by index\n",
+                kPaths / inOrder / 1e6, kPaths / indexed / 1e6);
+}
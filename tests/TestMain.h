@@ -0,0 +1,40 @@
+// TestMain.h
+// Just enough of a test runner for the tests/ executables: CHECK records a
+// failure and carries on, TEST registers a function, main() runs them all
+// (or those whose name contains argv[1]) and returns the failure count.
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+struct TestCase { const char* name; void (*fn)(); };
+inline std::vector<TestCase>& Tests() { static std::vector<TestCase> tests; return tests; }
+inline int& Failures() { static int failures = 0; return failures; }
+struct TestRegistrar { TestRegistrar(const char* name, void (*fn)()) { Tests().push_back({ name, fn }); } };
+
+#define TEST(name)                                              \
+    static void name();                                         \
+    static TestRegistrar name##_registrar(#name, name);         \
+    static void name()
+
+#define CHECK(cond)                                                                         \
+    do {                                                                                    \
+        if (!(cond)) {                                                                      \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);  \
+            ++Failures();                                                                   \
+        }                                                                                   \
+    } while (0)
+
+int main(int argc, char** argv) {
+    for (const TestCase& t : Tests()) {
+        if (argc > 1 && !std::strstr(t.name, argv[1])) continue;
+        const int before = Failures();
+        const auto start = std::chrono::steady_clock::now();
+        t.fn();
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::printf("%-48s %s (%.0f ms)\n", t.name, Failures() == before ? "ok" : "FAILED", ms);
+    }
+    return Failures();
+}